@@ -1,33 +1,131 @@
 #ifndef INCLUDE_ADDRESS_HPP_
 #define INCLUDE_ADDRESS_HPP_
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
 
-bool is_mciid(std::string_view line);
+#include "mep2_errors.hpp"
+
+// An MCI ID in canonical form, either 123-4567 or 123-456-7890
+class MciId {
+  public:
+    static constexpr size_t max_length = 12;
+
+    constexpr std::string_view view() const { return std::string_view(_id.data(), _length); }
+    std::string str() const { return std::string(view()); }
+
+  private:
+    friend constexpr std::optional<MciId> match_mciid(std::string_view line);
+
+    constexpr void append(std::string_view part) {
+        for (char c : part) {
+            _id[_length++] = c;
+        }
+    }
+
+    std::array<char, max_length> _id{};
+    uint8_t _length{0};
+};
+
+// Recognises MCI IDs in the form of:
+// 123-4567, 123-456-7890, 1234567, 1234567890
+// and returns the ID in canonical form, with any leading 000 area code
+// removed. Checks and converts in a single pass without allocating.
+constexpr std::optional<MciId> match_mciid(std::string_view line) {
+    // Where the dashes go for each of the accepted lengths, every other
+    // character must be a digit
+    size_t first_dash = std::string_view::npos;
+    size_t second_dash = std::string_view::npos;
+
+    switch (line.length()) {
+    case 7:
+    case 10:
+        break;
+    case 8:
+        first_dash = 3;
+        break;
+    case 12:
+        first_dash = 3;
+        second_dash = 7;
+        break;
+    default:
+        return std::nullopt;
+    }
+
+    std::array<char, 10> digits{};
+    size_t num_digits = 0;
+    for (size_t i = 0; i < line.length(); ++i) {
+        char c = line[i];
+        if (i == first_dash || i == second_dash) {
+            if (c != '-') {
+                return std::nullopt;
+            }
+        } else if (c >= '0' && c <= '9') {
+            digits[num_digits++] = c;
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    std::string_view number(digits.data(), num_digits);
+    // 000-123-4567 and 0001234567 are the same as 123-4567
+    if (number.length() == 10 && number.starts_with("000")) {
+        number.remove_prefix(3);
+    }
+
+    MciId id;
+    id.append(number.substr(0, 3));
+    id.append("-");
+    if (number.length() == 10) {
+        id.append(number.substr(3, 3));
+        id.append("-");
+        id.append(number.substr(6));
+    } else {
+        id.append(number.substr(3));
+    }
+
+    return id;
+}
+
+constexpr bool is_mciid(std::string_view line) { return match_mciid(line).has_value(); }
 std::string canonicalize_mciid(std::string_view line);
 
+// Every string lives in the memory resource the address was made with, see
+// allocated_from(). Values built without one, such as in the tests, use the
+// default resource.
 struct RawAddress {
-    void parse_org_or_loc(std::string_view line);
-    void parse_options(std::string_view& line);
-    void parse_first_line(std::string_view line);
-    void parse_field(std::string_view field, std::string_view information);
+    static RawAddress allocated_from(std::pmr::memory_resource* resource);
+
+    // All report a Malformed_Data error for an address they can't parse
+    PduResult<void> parse_org_or_loc(std::string_view line);
+    PduResult<void> parse_options(std::string_view& line);
+    PduResult<void> parse_first_line(std::string_view line);
+    PduResult<void> parse_field(std::string_view field, std::string_view information);
 
     const std::string str() const;
+    // Appends what str() returns to out
+    void format_to(std::string& out) const;
     bool operator==(const RawAddress& rhs) const;
 
-    std::string _name{};
-    std::string _id{};
-    std::string _organization{};
-    std::string _location{};
-    std::string _unresolved_org_loc_1{};
-    std::string _unresolved_org_loc_2{};
+    std::pmr::string _name{};
+    std::pmr::string _id{};
+    std::pmr::string _organization{};
+    std::pmr::string _location{};
+    std::pmr::string _unresolved_org_loc_1{};
+    std::pmr::string _unresolved_org_loc_2{};
 
-    std::string _alert{};
+    std::pmr::string _alert{};
 
-    std::string _ems{};
-    std::vector<std::string> _mbx{};
+    std::pmr::string _ems{};
+    std::pmr::vector<std::pmr::string> _mbx{};
 
 	bool _has_options{false};
     bool _board{false};
@@ -40,4 +138,91 @@ struct RawAddress {
     bool _no_receipt{false};
 };
 
+// The options of an address, a bit each, see RawAddress
+struct AddressOptions {
+    bool has_options : 1 {false};
+    bool board : 1 {false};
+    bool instant : 1 {false};
+    bool list : 1 {false};
+    bool owner : 1 {false};
+    bool onite : 1 {false};
+    bool print : 1 {false};
+    bool receipt : 1 {false};
+    bool no_receipt : 1 {false};
+
+    bool operator==(const AddressOptions&) const = default;
+};
+
+/*
+ * A RawAddress as it is kept once parsed, for envelopes held on to while
+ * the arena they were parsed in moves on. All the strings share a single
+ * allocation: the ends of the fields as 16 bit offsets, followed by the
+ * characters of one field after another. Equality is exact, every field and
+ * option, and checks the hash worked out up front first, so that putting
+ * recipients into an unordered_set drops the repeated ones cheaply.
+ */
+class PackedAddress {
+  public:
+    // Throws std::length_error when all the fields come to more than 64 KiB
+    explicit PackedAddress(const RawAddress& address);
+
+    PackedAddress(const PackedAddress& other);
+    PackedAddress& operator=(const PackedAddress& other);
+    // A moved from address is left empty, without fields or MBX lines
+    PackedAddress(PackedAddress&& other) noexcept;
+    PackedAddress& operator=(PackedAddress&& other) noexcept;
+
+    RawAddress unpack(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) const;
+    // Appends what RawAddress::format_to() does for the unpacked address
+    void format_to(std::string& out) const;
+
+    std::string_view name() const { return slice(name_field); }
+    std::string_view id() const { return slice(id_field); }
+    std::string_view organization() const { return slice(organization_field); }
+    std::string_view location() const { return slice(location_field); }
+    std::string_view unresolved_org_loc_1() const { return slice(unresolved_org_loc_1_field); }
+    std::string_view unresolved_org_loc_2() const { return slice(unresolved_org_loc_2_field); }
+    std::string_view alert() const { return slice(alert_field); }
+    std::string_view ems() const { return slice(ems_field); }
+    size_t mbx_count() const { return _mbx_count; }
+    std::string_view mbx(size_t i) const { return slice(fixed_fields + i); }
+
+    AddressOptions options() const { return _options; }
+    size_t hash() const { return _hash; }
+    // The one allocation, the object itself not counted
+    size_t allocated_size() const { return data_size(); }
+
+    bool operator==(const PackedAddress& rhs) const;
+
+  private:
+    enum : size_t {
+        name_field,
+        id_field,
+        organization_field,
+        location_field,
+        unresolved_org_loc_1_field,
+        unresolved_org_loc_2_field,
+        alert_field,
+        ems_field,
+        // The MBX lines follow
+        fixed_fields,
+    };
+
+    size_t field_count() const { return fixed_fields + _mbx_count; }
+    uint16_t field_end(size_t i) const;
+    size_t data_size() const {
+        return _data ? field_count() * sizeof(uint16_t) + field_end(field_count() - 1) : 0;
+    }
+    std::string_view slice(size_t i) const;
+
+    std::unique_ptr<char[]> _data;
+    size_t _hash{0};
+    uint16_t _mbx_count{0};
+    AddressOptions _options{};
+};
+
+template <> struct std::hash<PackedAddress> {
+    size_t operator()(const PackedAddress& address) const noexcept { return address.hash(); }
+};
+
 #endif /* INCLUDE_ADDRESS_HPP_ */
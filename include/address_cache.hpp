@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "address.hpp"
+
+/*
+ * Resolving a recipient means asking the directory who an address is, by
+ * MCI ID or by name, organization and location, and where its EMS and MBX
+ * routes lead. Mailing lists bring the same recipients back in session after
+ * session, so the answers are kept in a cache shared by every session.
+ *
+ * Entries are found by the normalized address, see AddressKey, so that the
+ * different ways of writing the same recipient share an entry. The cache is
+ * split into shards with a lock and LRU list each, so that sessions on
+ * different threads rarely wait for one another. Unknown recipients are
+ * cached too, for a shorter time, so that a wrong address on a list isn't
+ * looked up again with every message.
+ */
+
+// Who an address turned out to be
+struct ResolvedAddress {
+    // Canonical MCI ID
+    std::string id{};
+    std::string name{};
+    std::string organization{};
+    std::string location{};
+
+    bool operator==(const ResolvedAddress&) const = default;
+};
+
+// What the directory said about an address, nullopt for an unknown recipient
+using Resolution = std::optional<ResolvedAddress>;
+
+// The parts of an address that decide who it is, with case, runs of spaces
+// and the form of the MCI ID evened out. Options such as receipt requests
+// and alerts don't change the recipient and are left out.
+struct AddressKey {
+    static AddressKey from(const RawAddress& address);
+
+    bool operator==(const AddressKey& rhs) const {
+        return hash == rhs.hash && normalized == rhs.normalized;
+    }
+
+    std::string normalized{};
+    uint64_t hash{0};
+};
+
+struct AddressCacheOptions {
+    // Entries across all shards, known and unknown recipients alike
+    size_t capacity{64 * 1024};
+    // Directory changes show up after at most this long
+    std::chrono::seconds ttl{std::chrono::hours(1)};
+    // New accounts are found soon after they are made
+    std::chrono::seconds negative_ttl{std::chrono::minutes(1)};
+};
+
+// Thread safe
+class AddressCache {
+  public:
+    using clock = std::chrono::steady_clock;
+    static constexpr size_t shard_count = 16;
+
+    explicit AddressCache(const AddressCacheOptions& options = {});
+
+    AddressCache(const AddressCache&) = delete;
+    AddressCache& operator=(const AddressCache&) = delete;
+
+    // nullopt if the address has to be looked up
+    std::optional<Resolution> find(const AddressKey& key);
+    void insert(const AddressKey& key, Resolution resolution);
+
+    // Looks address up with lookup, a callable taking the RawAddress and
+    // returning its Resolution, unless the cache already has the answer.
+    // Two threads missing on the same address at once both look it up.
+    template <typename Lookup> Resolution resolve(const RawAddress& address, Lookup&& lookup) {
+        AddressKey key = AddressKey::from(address);
+        if (auto cached = find(key)) {
+            return std::move(*cached);
+        }
+
+        Resolution resolution = lookup(address);
+        insert(key, resolution);
+        return resolution;
+    }
+
+    void clear();
+    // Entries held, some of which may have expired
+    size_t size() const;
+
+  private:
+    struct Entry {
+        std::string normalized;
+        uint64_t hash;
+        Resolution resolution;
+        clock::time_point expires;
+    };
+
+    // A view of the key in its entry, nodes of the list never move
+    struct EntryRef {
+        std::string_view normalized;
+        uint64_t hash;
+
+        bool operator==(const EntryRef& rhs) const {
+            return hash == rhs.hash && normalized == rhs.normalized;
+        }
+    };
+
+    struct EntryRefHash {
+        size_t operator()(const EntryRef& ref) const { return ref.hash; }
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        // Most recently used first
+        std::list<Entry> lru;
+        std::unordered_map<EntryRef, std::list<Entry>::iterator, EntryRefHash> index;
+    };
+
+    Shard& shard_for(const AddressKey& key) {
+        // The low bits pick the bucket within a shard
+        return _shards[(key.hash >> 56) % shard_count];
+    }
+
+    size_t _shard_capacity;
+    std::chrono::seconds _ttl;
+    std::chrono::seconds _negative_ttl;
+    std::array<Shard, shard_count> _shards;
+};
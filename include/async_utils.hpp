@@ -0,0 +1,17 @@
+#pragma once
+
+#include <type_traits>
+#include <utility>
+
+#include <asio.hpp>
+#include <asio/use_awaitable.hpp>
+
+using asio::awaitable;
+
+// Runs f on pool and resumes the caller on its own executor with the result
+template <typename F>
+awaitable<std::invoke_result_t<F>> run_blocking(asio::thread_pool& pool, F f) {
+    co_return co_await asio::co_spawn(
+        pool, [f = std::move(f)]() -> awaitable<std::invoke_result_t<F>> { co_return f(); },
+        asio::use_awaitable);
+}
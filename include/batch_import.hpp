@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <asio.hpp>
+
+#include "email_message.hpp"
+#include "mail_store.hpp"
+#include "mep2_errors.hpp"
+
+using asio::awaitable;
+
+/*
+ * Offline import of recorded MEP2 sessions. A transcript is the byte stream
+ * a master sent, one PDU after another with their line ends intact.
+ *
+ * Splitting a transcript only looks at the first word of each line, so it
+ * is a quick sequential scan. Messages are parsed on a thread pool, and
+ * only storing them happens on the store's own thread. Files closing
+ * together share their LMDB commit, see MailStore.
+ */
+
+// One message in a transcript: an envelope and the text PDUs following it,
+// up to the next envelope. Either may be missing. Views into the transcript.
+struct TranscriptMessage {
+    std::string_view envelope{};
+    std::vector<std::string_view> texts{};
+};
+
+// Everything else, replies, /send and the like, is skipped
+std::vector<TranscriptMessage> split_transcript(std::string_view transcript);
+
+// A message ready to be stored, the text of all its text PDUs decoded one
+// after another
+struct ImportedMessage {
+    MessageMetadata metadata{};
+    std::string text{};
+};
+
+// Thread safe, every thread parses with a parser of its own
+PduResult<ImportedMessage> parse_message(const TranscriptMessage& message);
+
+struct ImportOptions {
+    QueryPdu::folder_id folder{QueryPdu::folder_id::inbox};
+    // Messages parsed or stored at any one time. Enough to keep the pool
+    // busy while the store waits for its commits.
+    size_t in_flight{64};
+};
+
+struct ImportResult {
+    size_t imported{0};
+    // Index into the split transcript and why that message wasn't imported
+    std::vector<std::pair<size_t, PduError>> failed{};
+};
+
+// Parses transcript on the store's blocking pool and adds its messages to
+// store. Has to run on the store's io_context. The transcript has to stay
+// around until done.
+awaitable<ImportResult> import_transcript(MailStore& store, std::string_view transcript,
+                                          const ImportOptions& options = {});
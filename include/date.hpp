@@ -1,19 +1,29 @@
 #pragma once
 
 #include <chrono>
+#include <cstdint>
+#include <string>
 #include <string_view>
 
+#include "mep2_errors.hpp"
+
 struct Date {
     Date() {}
 
-    void parse(std::string_view line);
+    // A date that doesn't parse is a Malformed_Data error
+    PduResult<void> parse(std::string_view line);
     const std::string to_gmt_string() const;
     const std::string to_orig_string() const;
+    // Appends what to_orig_string() returns to out
+    void format_orig_to(std::string& out) const;
+
+    std::string_view zone_name() const;
+    std::chrono::minutes zone_offset() const;
 
     bool operator==(const Date& rhs) const;
 
-    std::string _orig_zone;
-    std::chrono::zoned_time<std::chrono::seconds> _zone_time;
+    // Index into the MEP2 zone table of the zone the date was sent in
+    uint8_t _orig_zone{0};
     // Mep2 clients don't know about UTC, only GMT.
-    std::chrono::zoned_time<std::chrono::seconds> _gmt_time;
+    std::chrono::sys_seconds _gmt_time{};
 };
@@ -1,14 +1,72 @@
 #pragma once
 
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
 #define CAPNP_LITE 1
 #include <capnp/message.h>
 #include <capnp/serialize.h>
-#include <kj/std/iostream.h>
 
+#include "email_message.capnp.h"
 #include "mep2_pdu.hpp"
 
+// What is recorded about a message when it is committed
+struct MessageMetadata {
+    QueryPdu::folder_id folder{QueryPdu::folder_id::inbox};
+    std::string from{};
+    std::string subject{};
+    std::chrono::sys_seconds date{};
+    size_t size{0};
+    // All of it is stored when the message came with one. Its recipients
+    // are kept packed in to and cc, envelope itself is left without them.
+    std::optional<EnvPdu> envelope{};
+    std::vector<PackedAddress> to{};
+    std::vector<PackedAddress> cc{};
+
+    // Also takes the recipients, sender, subject and date from envelope
+    void set_envelope(const EnvPdu& envelope);
+};
+
+/*
+ * A stored message record, read in place from the bytes it was created
+ * from. Those have to outlive it, for a record in LMDB that means the read
+ * transaction it came from.
+ *
+ * Records are written as a single segment, reading one then doesn't
+ * allocate. The bytes of an LMDB value are only 2-byte aligned, which is why
+ * everything is built with CAPNP_ALLOW_UNALIGNED.
+ */
 class EmailMessage {
   public:
+    // Enough for the envelope of any regular message to fit in one segment
+    static constexpr unsigned int first_segment_words = 1024;
+
+    static void build(EmailRecord::Builder record, const MessageMetadata& metadata);
+
+    explicit EmailMessage(std::string_view record);
+    EmailMessage(const EmailMessage&) = delete;
+    EmailMessage& operator=(const EmailMessage&) = delete;
+
+    EmailRecord::Reader record() const { return _record; }
+
+    QueryPdu::folder_id folder() const;
+    std::string_view from() const;
+    std::string_view subject() const;
+    // The rendered envelope, empty if the message came without one
+    std::string_view header() const;
+    std::chrono::sys_seconds date() const;
+    size_t size() const { return _record.getSize(); }
+
   private:
-    EnvPdu _envelope;
-};
\ No newline at end of file
+    capnp::FlatArrayMessageReader _reader;
+    EmailRecord::Reader _record;
+};
+
+// Text fields are NUL terminated, these never copy
+inline std::string_view to_string_view(capnp::Text::Reader text) {
+    return std::string_view(text.cStr(), text.size());
+}
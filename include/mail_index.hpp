@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "email_message.hpp"
+#include "lmdb++.h"
+#include "mep2_pdu.hpp"
+
+// The filters of a SCAN or TURN. FROM and SUBJECT match case insensitively
+// at the start of the field and are kept in lower case, the size limits are
+// inclusive and the dates are exclusive.
+struct MessageQuery {
+    QueryPdu::folder_id folder{QueryPdu::folder_id::inbox};
+    std::string from{};
+    std::string subject{};
+    std::optional<size_t> min_size{};
+    std::optional<size_t> max_size{};
+    std::optional<std::chrono::sys_seconds> before{};
+    std::optional<std::chrono::sys_seconds> after{};
+
+    static MessageQuery from_pdu(const QueryPdu& pdu);
+
+    bool matches(const EmailMessage& message) const;
+};
+
+/*
+ * Secondary indexes over the messages in a store, kept in the same LMDB
+ * environment and updated in the same transaction as the main record.
+ *
+ * Every index key starts with the folder, followed by the field it indexes
+ * in an encoding that sorts the way the field compares, and maps to the
+ * filename. A query walks a single key range of whichever index narrows it
+ * down the most and only looks up the main record to check what that index
+ * doesn't cover. The main record is an EmailRecord, read in place.
+ */
+class MailIndex {
+  public:
+    // Longer fields are indexed on their start only, LMDB limits key size
+    static constexpr size_t max_text_key = 255;
+
+    // Opens or creates the databases, needs a write transaction the first time
+    void open(lmdb::txn& txn);
+
+    void insert(lmdb::txn& txn, std::string_view filename, const MessageMetadata& metadata);
+
+    // Calls f with the stored message, which is only valid during the call.
+    // Returns false if there is no such message.
+    template <typename F> bool read(lmdb::txn& txn, std::string_view filename, F&& f) {
+        std::string_view record;
+        if (!_main.get(txn, filename, record)) {
+            return false;
+        }
+
+        const EmailMessage message(record);
+        f(message);
+        return true;
+    }
+
+    // Filenames of the messages matching query
+    std::vector<std::string> query(lmdb::txn& txn, const MessageQuery& query);
+
+    size_t size(lmdb::txn& txn);
+
+  private:
+    lmdb::dbi _main;
+    lmdb::dbi _from;
+    lmdb::dbi _subjects;
+    lmdb::dbi _dates;
+    lmdb::dbi _sizes;
+};
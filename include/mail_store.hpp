@@ -1,66 +1,243 @@
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include <asio.hpp>
 #include <asio/stream_file.hpp>
 
 #include "lmdb++.h"
+#include "mail_index.hpp"
+#include "string_utils.hpp"
 
 using asio::awaitable;
 
 class MailStoreFile;
 
+struct MailStoreOptions {
+    size_t max_size{0};
+    // Files closing within this window of each other are committed together
+    std::chrono::microseconds commit_window{1000};
+    // Whether a file and its directory entry are synced to disk before
+    // close() reports it as delivered
+    bool durable{true};
+
+    // The LMDB map starts out at this size and doubles whenever it fills up,
+    // up to max_map_size if that isn't 0. An existing store that has grown
+    // larger keeps its size.
+    size_t map_size{1UL << 30};
+    size_t max_map_size{0};
+    unsigned int max_readers{126};
+    // Reset read transactions kept around for reuse, each holds on to its
+    // reader slot
+    size_t read_txn_cache{8};
+    // Threads for filesystem calls that may block, these never run on the
+    // io_context so a slow disk only holds up the sessions waiting for it
+    size_t blocking_threads{2};
+};
+
+/*
+ * A store is used from a single io_context thread. Files closed from that
+ * thread are committed in groups: all files that close within the commit
+ * window share their directory sync and a single LMDB write transaction, and
+ * their close() only returns once the whole group is on disk.
+ */
 class MailStore {
+    friend class MailStoreFile;
+
   public:
     MailStore(asio::io_context& io_service, const std::string&& path, size_t max_size);
+    MailStore(asio::io_context& io_service, const std::string&& path,
+              const MailStoreOptions& options);
+    ~MailStore();
+
+    MailStoreFile create_file();
+    MailStoreFile open_file(const std::string_view filename);
+
+    // Number of messages in the index
+    size_t message_count();
+    // Filenames of the committed messages matching query. Only reads from
+    // the LMDB map, so it doesn't need the blocking pool.
+    std::vector<std::string> query(const MessageQuery& query);
+    // Calls f with the committed message, see MailIndex::read()
+    template <typename F> bool read_message(std::string_view filename, F&& f) {
+        ReadTxn txn(*this);
+        return _index.read(txn.get(), filename, std::forward<F>(f));
+    }
+
+    // Current size of the LMDB map
+    size_t map_size();
 
-    MailStoreFile create_file() const;
-    MailStoreFile open_file(const std::string_view filename) const;
+    // The pool the store blocks on, for other work that shouldn't run on
+    // the io_context either
+    asio::thread_pool& blocking_pool() { return _blocking_pool; }
 
   private:
+    struct CommitBatch;
+
+    /*
+     * A read-only transaction taken from the cache and handed back to it
+     * once done. The environment is opened with MDB_NOTLS, a transaction
+     * isn't tied to the thread that started it so coroutines that move
+     * between threads can use it just the same.
+     *
+     * Also keeps the map from being resized while it reads from it. The map
+     * lock is only taken by the outermost ReadTxn of a store on a thread, a
+     * read nested in another, say from a read_message() callback, already
+     * holds it. Taking it again could wait behind a resize that waits for
+     * the outer read. A ReadTxn is never held across a co_await, it is
+     * released on the thread that took it.
+     */
+    class ReadTxn {
+      public:
+        ReadTxn(MailStore& store);
+        ~ReadTxn();
+        ReadTxn(const ReadTxn&) = delete;
+        ReadTxn& operator=(const ReadTxn&) = delete;
+
+        lmdb::txn& get() { return _txn; }
+
+      private:
+        // Whether an enclosing ReadTxn on this thread holds store's map lock
+        static bool holds_map_lock(const MailStore& store);
+
+        // The innermost ReadTxn of this thread, of any store
+        static inline thread_local ReadTxn* _innermost = nullptr;
+
+        MailStore& _store;
+        ReadTxn* const _outer;
+        std::shared_lock<std::shared_mutex> _map_lock;
+        lmdb::txn _txn;
+    };
+
+    lmdb::txn begin_read();
+    // Doubles the map unless it has been grown since it was seen at
+    // full_size, returns false if it can't grow any further
+    bool grow_map(size_t full_size);
+
+    // Completes once file has been published and indexed
+    awaitable<void> commit(MailStoreFile& file);
+    awaitable<void> flush(std::shared_ptr<CommitBatch> batch);
+    // Runs on the blocking pool
+    void commit_batch(CommitBatch& batch);
+    void index_batch(CommitBatch& batch);
+    // Fails every file of a batch that isn't indexed yet and unlinks the
+    // ones already published
+    static void fail_batch(CommitBatch& batch, int error_code);
+
     asio::io_service& _io_service;
+    asio::thread_pool _blocking_pool;
     const std::filesystem::path _path;
     const std::filesystem::path _tmp_path;
-    size_t _max_size;
+    const MailStoreOptions _options;
+    // New files are created with O_TMPFILE unless the filesystem turns out
+    // not to support it, then they go through tmp/ instead
+    bool _use_tmpfile{true};
     lmdb::env _db_env;
-    
-    lmdb::dbi _db_main;
-    lmdb::dbi _db_subjects;
+    MailIndex _index;
+
+    // Held shared for every transaction, the map is only resized while
+    // nothing uses it
+    std::shared_mutex _map_mutex;
+    std::mutex _read_txns_mutex;
+    std::vector<lmdb::txn> _read_txns;
+
+    // The batch files that close now will join
+    std::shared_ptr<CommitBatch> _open_batch;
 };
 
-class MailStoreFile {
+class MailStoreFile final {
     friend class MailStore;
 
   public:
     ~MailStoreFile();
 
+    // Both throw InsufficientSpaceError rather than let a new file grow past
+    // the store's max_size, nothing of that write goes to the file then
     awaitable<size_t> write(const std::string_view sv);
     awaitable<size_t> write_encoded(const std::string_view sv);
+    // Decodes a chunk of /text body into the file, a bad %-code throws a
+    // PduMalformedDataError
+    awaitable<void> write_text(std::string_view text);
     awaitable<std::string> read(size_t size);
 
+    // For sending a stored file during pickup. Both write the whole file and
+    // return the number of bytes written to the socket.
+    static constexpr size_t send_chunk_size = 16384;
+    // %-encodes the file as it goes, straight from a mapping of the file
+    // into fixed chunks
+    awaitable<size_t> send_encoded(asio::ip::tcp::socket& socket);
+    // For files already stored in wire form, the kernel copies them to the
+    // socket with sendfile()
+    awaitable<size_t> send_raw(asio::ip::tcp::socket& socket);
+
+    // The whole file, mapped read only. Stays valid for as long as the file
+    // is open.
+    std::string_view view();
+
     const std::string& get_filename() const { return _filename; }
+    size_t get_size() const { return _size; }
 
-    [[nodiscard]] bool close();
+    // Recorded in the index when the file is closed, the size is filled in
+    // from what was written
+    MessageMetadata& metadata() { return _metadata; }
+
+    [[nodiscard]] awaitable<bool> close();
 
   protected:
-    MailStoreFile(asio::io_context& io_service, const std::string& filename,
+    MailStoreFile(MailStore& store, const std::string& filename,
                   const std::filesystem::path& tmp_path, const std::filesystem::path& final_path,
                   size_t max_size);
-    MailStoreFile(asio::io_context& io_service, const std::string_view filename,
+    // A new file without a name yet, opened with O_TMPFILE
+    MailStoreFile(MailStore& store, int fd, const std::string& filename,
+                  const std::filesystem::path& final_path, size_t max_size);
+    MailStoreFile(MailStore& store, const std::string_view filename,
                   const std::filesystem::path& path);
 
+    // Gives an O_TMPFILE file its name
+    static int link_anonymous(int fd, const std::string& final_path);
+    // Gives the file its final name, returns an errno value on failure.
+    // Blocks.
+    int publish();
+    // Takes the final name away again when the file couldn't be indexed.
+    // Blocks.
+    void unpublish();
+
   private:
+    struct Unmap {
+        size_t length;
+        void operator()(const char* map) const;
+    };
+
+    size_t file_length();
+    // Throws if length more bytes would take a new file past _max_size
+    void check_size(size_t length) const;
+
+    MailStore& _store;
     asio::stream_file _file;
     const std::string _filename;
     const std::string _tmp_path;
     const std::string _final_path;
     const size_t _max_size;
-    size_t _size;
+    size_t _size{0};
+    MessageMetadata _metadata{};
     bool _new{false};
     bool _finished{false};
-    
-    size_t _chars_since_cr{0};
-    std::string _leftover{};
+
+    std::unique_ptr<const char, Unmap> _map{nullptr, Unmap{0}};
+    // For send_encoded()
+    StringEncoder _encoder{};
+
+    // For write_encoded()
+    StringDecoder _decoder{};
+    // Reused between write_encoded() calls
+    std::string _decoded{};
 };
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <exception>
+#include <expected>
 #include <string>
 #include <unordered_map>
 
@@ -83,9 +84,11 @@ class Mep2Error : public std::exception {
     Mep2Error() = delete;
     Mep2Error(const Mep2ErrorCode code) : _code(code) {}
     Mep2Error(const Mep2ErrorCode code, const std::string& context)
-        : _code(code), _context_message(Mep2ErrorMessages.at(_code) + ": " + context) {}
+        : _code(code), _context(context),
+          _context_message(Mep2ErrorMessages.at(_code) + ": " + context) {}
 
     Mep2ErrorCode code() const { return _code; }
+    const std::string& context() const { return _context; }
 
     const char* what() const noexcept override {
         if (_context_message.empty()) {
@@ -97,6 +100,7 @@ class Mep2Error : public std::exception {
 
   private:
     const Mep2ErrorCode _code;
+    std::string _context;
     std::string _context_message;
 };
 
@@ -114,5 +118,68 @@ Mep2Exception(PduEnvelopeDataError, Mep2ErrorCode::Envelope_Problem);
 Mep2Exception(PduNoEnvelopeDataError, Mep2ErrorCode::Envelope_No_Data);
 Mep2Exception(PduToRequiredError, Mep2ErrorCode::Envelope_No_To);
 Mep2Exception(PduChecksumError, Mep2ErrorCode::Checksum_Error);
+Mep2Exception(InsufficientSpaceError, Mep2ErrorCode::Insufficient_Space);
 
 #undef Mep2Exception
+
+/*
+ * The non-throwing parse API reports errors as a PduError instead. Malformed
+ * input is common enough that we don't want to pay for unwinding every time.
+ */
+struct PduError {
+    Mep2ErrorCode code;
+    std::string context{};
+
+    std::string message() const {
+        if (context.empty()) {
+            return Mep2ErrorMessages.at(code);
+        } else {
+            return Mep2ErrorMessages.at(code) + ": " + context;
+        }
+    }
+};
+
+template <typename T = void> using PduResult = std::expected<T, PduError>;
+
+inline std::unexpected<PduError> pdu_error(Mep2ErrorCode code, std::string context = {}) {
+    return std::unexpected(PduError{code, std::move(context)});
+}
+
+inline std::unexpected<PduError> pdu_error(const Mep2Error& e) {
+    return pdu_error(e.code(), e.context());
+}
+
+template <typename E> [[noreturn]] inline void throw_pdu_error_as(const PduError& error) {
+    if (error.context.empty()) {
+        throw E();
+    }
+
+    throw E(error.context);
+}
+
+// Throws the exception matching the error code, for the throwing API
+[[noreturn]] inline void throw_pdu_error(const PduError& error) {
+    switch (error.code) {
+    case Mep2ErrorCode::Unable_To_Perform:
+        throw_pdu_error_as<UnableToPerformError>(error);
+    case Mep2ErrorCode::PDU_Syntax_Error:
+        throw_pdu_error_as<PduSyntaxError>(error);
+    case Mep2ErrorCode::Malformed_Data:
+        throw_pdu_error_as<PduMalformedDataError>(error);
+    case Mep2ErrorCode::Envelope_Problem:
+        throw_pdu_error_as<PduEnvelopeDataError>(error);
+    case Mep2ErrorCode::Envelope_No_Data:
+        throw_pdu_error_as<PduNoEnvelopeDataError>(error);
+    case Mep2ErrorCode::Envelope_No_To:
+        throw_pdu_error_as<PduToRequiredError>(error);
+    case Mep2ErrorCode::Checksum_Error:
+        throw_pdu_error_as<PduChecksumError>(error);
+    case Mep2ErrorCode::Insufficient_Space:
+        throw_pdu_error_as<InsufficientSpaceError>(error);
+    default:
+        if (error.context.empty()) {
+            throw Mep2Error(error.code);
+        }
+        throw Mep2Error(error.code, error.context);
+    }
+}
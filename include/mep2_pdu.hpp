@@ -7,17 +7,24 @@
 #include <cstdint>
 #include <cstring>
 #include <format>
+#include <memory_resource>
+#include <optional>
+#include <span>
 #include <stdexcept>
 #include <string_view>
+#include <type_traits>
 #include <variant>
 
 #include "address.hpp"
 #include "date.hpp"
 #include "mep2_errors.hpp"
+#include "simd_utils.hpp"
 #include "string_utils.hpp"
 
 class PduType {
   public:
+    static constexpr size_t type_count = 15;
+
     enum class type_id {
         busy = 0,
         comment,
@@ -72,10 +79,10 @@ class PduType {
     constexpr operator const char*() const { return get_name().data(); }
 
   private:
-    static constexpr std::array<std::string_view, 15> _name = {
+    static constexpr std::array<std::string_view, type_count> _name = {
         "BUSY",  "COMMENT", "CREATE", "END",  "ENV",  "HDR",  "INIT",  "REPLY",
         "RESET", "SCAN",    "SEND",   "TERM", "TEXT", "TURN", "VERIFY"};
-    const type_id _type;
+    type_id _type;
 };
 
 struct PduChecksum {
@@ -92,63 +99,91 @@ struct PduChecksum {
     PduChecksum(uint16_t checksum) : _checksum(checksum) {}
     PduChecksum() = default;
 
+    // Non-throwing version of PduChecksum(std::string_view)
+    static std::optional<PduChecksum> from_string(std::string_view checksum) {
+        if (checksum.length() != 4) {
+            return std::nullopt;
+        }
+
+        uint16_t value = 0;
+        for (auto c : checksum) {
+            int nibble = hex_value(c);
+            if (nibble < 0) {
+                return std::nullopt;
+            }
+
+            value = (value << 4) | nibble;
+        }
+
+        return PduChecksum(value);
+    }
+
     operator uint16_t() const { return _checksum; }
     const std::string to_string() const { return std::format("{:04X}", _checksum); }
 
     void add_line(const std::string_view line) {
         // std::println("Adding line: '{}'", line);
-        for (auto c : line) {
-            // The upper bits should never appear, but if they
-            // somehow do we must ignore them
-            _checksum += c & 0x7F;
-        }
+        // The upper bits should never appear, but if they
+        // somehow do we must ignore them
+        _checksum += sum_7bit(line);
     }
 
     uint16_t _checksum = 0;
 };
 
+/*
+ * Common base of all PDUs. Every PDU lives in a PduVariant and is only ever
+ * used through std::visit, so there is no need for virtual dispatch. The
+ * derived classes hide parse_options, _parse_line and _finalize, and
+ * parse_line and finalize find them through the deduced type of this.
+ */
 class Pdu {
   public:
     Pdu(PduType type) : _type(type) {};
-    virtual ~Pdu() = default;
-    
+
     PduChecksum& get_checksum() { return _checksum; }
     const PduType get_type() const { return _type; }
 
-    void parse_line(std::string_view line) {
-        if (_type.is_single_line()) {
-            throw PduSyntaxError("Parse line called on single-line PDU");
+    template <typename Self> PduResult<void> parse_line(this Self& self, std::string_view line) {
+        if (self.get_type().is_single_line()) {
+            return pdu_error(Mep2ErrorCode::PDU_Syntax_Error,
+                             "Parse line called on single-line PDU");
         }
 
-        _parse_line(line);
+        return self._parse_line(line);
     };
 
-    void finalize() {
-        if (_type.is_single_line()) {
-            throw PduSyntaxError("Finalize calledd single-line PDU");
+    template <typename Self> PduResult<void> finalize(this Self& self) {
+        if (self.get_type().is_single_line()) {
+            return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Finalize calledd single-line PDU");
         }
 
-        _finalize();
+        return self._finalize();
     };
 
-    virtual void parse_options(std::string_view options) {
+    PduResult<void> parse_options(std::string_view options) {
         if (options.length()) {
-            throw PduSyntaxError("Option for non-option PDU");
+            return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Option for non-option PDU");
         }
+
+        return {};
     };
 
   protected:
-    virtual void _parse_line([[maybe_unused]] std::string_view line) {
+    // Only ever destroyed as the derived type
+    ~Pdu() = default;
+
+    PduResult<void> _parse_line([[maybe_unused]] std::string_view line) {
         throw std::runtime_error("Pdu::_parse_line() base called without implementation");
     };
 
-    virtual void _finalize() {
+    PduResult<void> _finalize() {
         throw std::runtime_error("Pdu::_finalize() base called without implementation");
     };
 
   private:
     PduChecksum _checksum;
-    const PduType _type;
+    PduType _type;
 };
 
 class BusyPdu : public Pdu {
@@ -175,11 +210,16 @@ class QueryPdu : public Pdu {
   public:
     enum class folder_id { outbox, inbox, desk, trash };
 
-    void parse_options(std::string_view options);
+    PduResult<void> parse_options(std::string_view options);
 
     folder_id get_folder_id() const { return _folder; }
     const std::string& get_subject() const { return _subject; }
     const std::string& get_from() const { return _from; }
+    // Sizes in bytes, dates in GMT
+    std::optional<size_t> get_max_size() const { return _max_size; }
+    std::optional<size_t> get_min_size() const { return _min_size; }
+    std::optional<std::chrono::sys_seconds> get_before() const { return _before; }
+    std::optional<std::chrono::sys_seconds> get_after() const { return _after; }
 
   protected:
     QueryPdu(PduType type) : Pdu(type) {}
@@ -188,6 +228,10 @@ class QueryPdu : public Pdu {
     folder_id _folder = folder_id::inbox;
     std::string _subject;
     std::string _from;
+    std::optional<size_t> _max_size;
+    std::optional<size_t> _min_size;
+    std::optional<std::chrono::sys_seconds> _before;
+    std::optional<std::chrono::sys_seconds> _after;
 
     bool _priority = false;
 };
@@ -207,9 +251,31 @@ class CommentPdu : public Pdu {
     CommentPdu() : Pdu(PduType(PduType::type_id::comment)) {}
 
   private:
-    void _parse_line(std::string_view line);
+    friend class Pdu;
+
+    PduResult<void> _parse_line(std::string_view line);
     // Nothing to do
-    void _finalize() {};
+    PduResult<void> _finalize() { return {}; };
+};
+
+/*
+ * The resource a PDU allocates what it parses from, which goes the way of the
+ * pmr members it is used for: a copy of the PDU allocates from the default
+ * resource, not from the arena of the original, and assigning one PDU to
+ * another leaves the resource of the target alone. Moves keep it.
+ */
+class PduResource {
+  public:
+    PduResource(std::pmr::memory_resource* resource) : _resource(resource) {}
+    PduResource(const PduResource&) : _resource(std::pmr::get_default_resource()) {}
+    PduResource(PduResource&&) = default;
+    PduResource& operator=(const PduResource&) { return *this; }
+    PduResource& operator=(PduResource&&) { return *this; }
+
+    std::pmr::memory_resource* get() const { return _resource; }
+
+  private:
+    std::pmr::memory_resource* _resource;
 };
 
 class EnvelopeHeaderPdu : public Pdu {
@@ -229,62 +295,89 @@ class EnvelopeHeaderPdu : public Pdu {
         address_cont,
     };
 
-    void parse_options(std::string_view options);
+    PduResult<void> parse_options(std::string_view options);
     priority_id get_priority_id() const { return _priority; }
 
-    const std::vector<RawAddress>& get_to_address() const { return _to_address; }
-    const std::vector<RawAddress>& get_cc_address() const { return _cc_address; }
+    const std::pmr::vector<RawAddress>& get_to_address() const { return _to_address; }
+    const std::pmr::vector<RawAddress>& get_cc_address() const { return _cc_address; }
 
   protected:
+    friend class Pdu;
+
     enum class address_parse_state { idle, parsing_to, parsing_cc, parsing_from };
 
-    EnvelopeHeaderPdu(PduType type) : Pdu(type) {}
+    // Whatever is parsed is allocated from resource. Copying the PDU copies
+    // all of it to the default resource.
+    EnvelopeHeaderPdu(PduType type, std::pmr::memory_resource* resource)
+        : Pdu(type), _resource(resource), _current_address(RawAddress::allocated_from(resource)),
+          _to_address(resource), _cc_address(resource), _source_message_id(resource),
+          _u_fields(resource) {}
 
-    void parse_envelope_line(std::string_view line, bool address_only);
-    void _finalize();
+    PduResult<void> parse_envelope_line(std::string_view line, bool address_only);
+    PduResult<void> _finalize();
 
     void finish_current_address();
 
     bool _envelope_data = false;
     address_parse_state _address_parse_state = address_parse_state::idle;
 
+    PduResource _resource;
+
     priority_id _priority = priority_id::none;
     RawAddress _current_address;
     std::optional<RawAddress> _from_address;
-    std::vector<RawAddress> _to_address;
-    std::vector<RawAddress> _cc_address;
+    std::pmr::vector<RawAddress> _to_address;
+    std::pmr::vector<RawAddress> _cc_address;
 
     std::optional<Date> _date;
     std::optional<Date> _source_date;
-    std::optional<std::string> _subject;
-    std::optional<std::string> _message_id;
-    std::vector<std::string> _source_message_id;
-    std::vector<std::pair<std::string, std::string>> _u_fields;
+    std::optional<std::pmr::string> _subject;
+    std::optional<std::pmr::string> _message_id;
+    std::pmr::vector<std::pmr::string> _source_message_id;
+    std::pmr::vector<std::pair<std::pmr::string, std::pmr::string>> _u_fields;
 };
 
 class VerifyPdu : public EnvelopeHeaderPdu {
   public:
-    VerifyPdu() : EnvelopeHeaderPdu(PduType(PduType::type_id::verify)) {}
+    VerifyPdu() : VerifyPdu(std::pmr::get_default_resource()) {}
+    explicit VerifyPdu(std::pmr::memory_resource* resource)
+        : EnvelopeHeaderPdu(PduType(PduType::type_id::verify), resource) {}
 
   protected:
-    void _parse_line(std::string_view line) { parse_envelope_line(line, true); }
+    friend class Pdu;
+
+    PduResult<void> _parse_line(std::string_view line) { return parse_envelope_line(line, true); }
 };
 
 class EnvPdu : public EnvelopeHeaderPdu {
   public:
-    EnvPdu() : EnvelopeHeaderPdu(PduType(PduType::type_id::env)) {}
+    EnvPdu() : EnvPdu(std::pmr::get_default_resource()) {}
+    explicit EnvPdu(std::pmr::memory_resource* resource)
+        : EnvelopeHeaderPdu(PduType(PduType::type_id::env), resource) {}
+
+    const std::string str() const;
+    // Appends the header block str() returns to out, which can be reused
+    // from one envelope to the next
+    void format_to(std::string& out) const;
+    // The same with to and cc as the recipients, for an envelope kept
+    // without its own, see clear_recipients()
+    void format_to(std::string& out, std::span<const PackedAddress> to,
+                   std::span<const PackedAddress> cc) const;
+
+    // Drops the To and Cc addresses, for recipients that are kept elsewhere
+    void clear_recipients();
 
-	const std::string str() const;
-	
     const RawAddress& get_from_address() const { return *_from_address; }
-    const std::vector<RawAddress>& get_to_address() const { return _to_address ;}
-    const std::vector<RawAddress>& get_cc_address() const { return _cc_address ;}
+    const std::pmr::vector<RawAddress>& get_to_address() const { return _to_address ;}
+    const std::pmr::vector<RawAddress>& get_cc_address() const { return _cc_address ;}
     const Date& get_date() const { return *_date; }
     const Date& get_source_date() const { return *_source_date; }
-    const std::string& get_subject() const { return *_subject; }
-    const std::string& get_message_id() const { return *_message_id; }
-    const std::vector<std::string>& get_source_message_id() const { return _source_message_id; }
-    const std::vector<std::pair<std::string, std::string>>& get_u_fields() const {
+    const std::pmr::string& get_subject() const { return *_subject; }
+    const std::pmr::string& get_message_id() const { return *_message_id; }
+    const std::pmr::vector<std::pmr::string>& get_source_message_id() const {
+        return _source_message_id;
+    }
+    const std::pmr::vector<std::pair<std::pmr::string, std::pmr::string>>& get_u_fields() const {
         return _u_fields;
     }
 
@@ -300,7 +393,11 @@ class EnvPdu : public EnvelopeHeaderPdu {
     
 
   protected:
-    void _parse_line(std::string_view line) { parse_envelope_line(line, false); }
+    friend class Pdu;
+
+    PduResult<void> _parse_line(std::string_view line) {
+        return parse_envelope_line(line, false);
+    }
 };
 
 class TextPdu : public Pdu {
@@ -322,26 +419,44 @@ class TextPdu : public Pdu {
         racal
     };
 
-    TextPdu() : Pdu(PduType(PduType::type_id::text)) {}
-    void parse_options(std::string_view options);
+    TextPdu() : TextPdu(std::pmr::get_default_resource()) {}
+    // The description is allocated from resource
+    explicit TextPdu(std::pmr::memory_resource* resource)
+        : Pdu(PduType(PduType::type_id::text)), _resource(resource) {}
+    PduResult<void> parse_options(std::string_view options);
 
     content_type get_content_type() const { return _content_type; }
     content_type get_content_type_handling() const { return _content_type_handling; }
-    const std::string& get_description() const { return *_description; }
+    const std::pmr::string& get_description() const { return *_description; }
 
     bool has_description() const { return _description.has_value(); }
 
+    // Body lines are appended to body as they are parsed, otherwise they are
+    // dropped
+    void collect_body(std::string* body) { _body = body; }
+
   private:
-    void _parse_line(std::string_view line);
-    void _finalize() {};
+    friend class Pdu;
+
+    PduResult<void> _parse_line(std::string_view line);
+    PduResult<void> _finalize() { return {}; };
 
     // If unspecified we assume ASCII
     content_type _content_type{TextPdu::content_type::ascii};
     content_type _content_type_handling{TextPdu::content_type::ascii};
-    std::optional<std::string> _description;
+    PduResource _resource;
+    std::optional<std::pmr::string> _description;
+    std::string* _body{nullptr};
 };
 
 using PduVariant = std::variant<BusyPdu, CreatePdu, TermPdu, SendPdu, ScanPdu, TurnPdu, CommentPdu,
                                 VerifyPdu, EnvPdu, TextPdu>;
 
+// Dispatch happens through std::visit alone, no alternative should carry a
+// vtable pointer
+template <typename... Pdus> constexpr bool no_polymorphic_pdus(std::variant<Pdus...>*) {
+    return (!std::is_polymorphic_v<Pdus> && ...);
+}
+static_assert(no_polymorphic_pdus(static_cast<PduVariant*>(nullptr)));
+
 #endif /* INCLUDE_MEP2_PDU_HPP_ */
@@ -1,18 +1,26 @@
 #ifndef INCLUDE_MEP2_PDU_PARSER_HPP_
 #define INCLUDE_MEP2_PDU_PARSER_HPP_
 
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
 #include <stdexcept>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include <asio.hpp>
 
+#include "mep2_errors.hpp"
 #include "mep2_pdu.hpp"
+#include "pdu_arena.hpp"
+#include "text_sink.hpp"
 #include "trie.hpp"
 
 using asio::awaitable;
 
-void validate_checksum(const PduChecksum& checksum, std::string_view line);
-std::string_view strip_pdu_crlf(std::string_view line);
+PduResult<std::string_view> strip_pdu_crlf(std::string_view line);
 
 consteval auto create_pdu_trie() {
     Trie<PduType::type_id, 15, 7> trie;
@@ -34,19 +42,75 @@ consteval auto create_pdu_trie() {
     return trie;
 }
 
+consteval auto create_compact_pdu_trie() {
+    constexpr auto trie = create_pdu_trie();
+    return CompactTrie<PduType::type_id, trie.size()>(trie);
+}
+
 class PduParser {
   public:
+    // Enough for an envelope with a few dozen recipients
+    static constexpr size_t default_arena_size = 16 * 1024;
+
+    PduParser() = default;
+
+    // Builds envelopes and text PDUs in a PduArena of arena_size bytes. The
+    // arena is released all at once rather than freeing every string of a
+    // PDU, which makes a PDU taken out of the parser only valid until it is
+    // reset or starts parsing the next one.
+    //
+    // With more than one arena, every PDU taken out gets an arena to itself
+    // and the parser moves on to the next one. A PDU then stays valid until
+    // arena_count - 1 more PDUs have been taken out after it.
+    explicit PduParser(size_t arena_size, size_t arena_count = 1,
+                       std::pmr::memory_resource* upstream = std::pmr::get_default_resource()) {
+        for (size_t i = 0; i < arena_count; ++i) {
+            _arenas.push_back(std::make_unique<PduArena>(arena_size, upstream));
+        }
+    }
+
+    // The body of a /text PDU goes to sink in chunks of about
+    // text_chunk_size, whatever the size of the message. The last chunk is
+    // written before the /end line is parsed, the checksum is only checked
+    // after the body has been written. Parsing waits for the sink, which
+    // should hand the body on rather than write it to disk itself, see
+    // PduChannel.
+    static constexpr size_t text_chunk_size = 16 * 1024;
+    void set_text_sink(TextSink* sink) { _text_sink = sink; }
+
     awaitable<void> parse_line(std::string_view line);
 
+    // Same as parse_line, but reports errors through the result rather than
+    // by throwing. An error in a multi-line PDU past its type, in its first
+    // line or in its body, is still only reported once its /end line has
+    // been parsed, the lines up to it are dropped.
+    //
+    // Only parse_line can wait for the text sink. With a sink set, this
+    // keeps the body until the next parse_line, and fails the PDU with a
+    // System_Error rather than keep more than text_chunk_size of it.
+    PduResult<void> try_parse_line(std::string_view line);
+
     PduVariant extract_pdu() {
         if (_state != state::complete) {
             throw std::runtime_error("extract_pdu called in invalid state");
         }
 
-        reset();
+        // The next PDU releases the arena, this one needs it until then
+        _arena_taken = true;
+        _state = state::idle;
+        _current_type.reset();
+        _current_error.reset();
         return std::move(_current_pdu);
     }
 
+    // A '\n' that arrived in a later read than the '\r' ending the previous
+    // line still counts towards the checksum of a multi-line PDU.
+    void add_trailing_lf() {
+        if (_state == state::parsing) {
+            std::visit([](auto&& pdu) { pdu.get_checksum().add_line("\n"); }, _current_pdu);
+        }
+    }
+
     const std::optional<PduType> get_current_type() const { return _current_type; }
 
     bool is_complete() const { return _state == state::complete; }
@@ -56,26 +120,60 @@ class PduParser {
         _state = state::idle;
         _current_type.reset();
         _current_error.reset();
+
+        // Destroying the PDU frees nothing when it came from the arena, the
+        // release hands everything back in one go
+        _current_pdu.emplace<BusyPdu>();
+        _text_chunk.clear();
+        if (_arenas.empty()) {
+            return;
+        }
+
+        // The PDU last taken out still lives in the current arena, the
+        // oldest one is free by now
+        if (_arena_taken) {
+            _arena_taken = false;
+            _arena_index = (_arena_index + 1) % _arenas.size();
+        }
+        _arenas[_arena_index]->release();
     }
 
   private:
-    PduType parse_pdu_start(std::string_view& line_parse);
-    PduType parse_pdu_type(std::string_view& line_parse);
+    PduResult<PduType> parse_pdu_start(std::string_view& line_parse);
+    PduResult<PduType> parse_pdu_type(std::string_view& line_parse);
 
-    void parse_first_line(std::string_view line);
-    void parse_information_line(std::string_view line);
-    void parse_end_line(std::string_view line);
-    void validate_checksum(std::string_view line);
+    PduResult<void> parse_first_line(std::string_view line);
+    PduResult<void> parse_information_line(std::string_view line);
+    PduResult<void> parse_end_line(std::string_view line);
+    PduResult<void> validate_checksum(std::string_view line);
+    awaitable<void> flush_text();
 
     enum class state { idle, parsing, complete };
 
+    std::pmr::memory_resource* resource() const {
+        return _arenas.empty() ? std::pmr::get_default_resource()
+                               : _arenas[_arena_index]->resource();
+    }
+
     state _state = state::idle;
     std::optional<PduType> _current_type;
-    std::optional<std::exception_ptr> _current_error;
-
+    // When the first line of the current PDU came in
+    std::chrono::steady_clock::time_point _started{};
+    std::optional<PduError> _current_error;
+
+    // Declared first so that they outlive the PDU built in them
+    std::vector<std::unique_ptr<PduArena>> _arenas;
+    size_t _arena_index{0};
+    bool _arena_taken{false};
     PduVariant _current_pdu;
 
-    static constexpr auto _pdu_trie = create_pdu_trie();
+    TextSink* _text_sink{nullptr};
+    // Body lines not yet handed to the sink
+    std::string _text_chunk;
+
+    // Aligned, so that it doesn't straddle more lines than it fills
+    alignas(64) static constexpr auto _pdu_trie = create_compact_pdu_trie();
+    static_assert(sizeof(_pdu_trie) <= 128, "PDU type lookup should fit in two cache lines");
 };
 
 #endif /* INCLUDE_MEP2_PDU_PARSER_HPP_ */
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <asio.hpp>
+
+#include "mail_store.hpp"
+#include "mep2_errors.hpp"
+#include "mep2_pdu_parser.hpp"
+#include "pdu_channel.hpp"
+#include "pdu_framer.hpp"
+
+using asio::awaitable;
+using asio::ip::tcp;
+
+// Renders the /reply PDU reporting code back to the master
+std::string format_reply(Mep2ErrorCode code, std::string_view context = {});
+
+/*
+ * A single MEP2 connection. The session runs entirely on the executor of its
+ * socket and only touches the MailStore of that executor, so sessions on
+ * different io_contexts never share anything.
+ *
+ * Reading and handling PDUs are two coroutines connected by a bounded
+ * channel. While one PDU is handled and replied to, the ones after it are
+ * already being read and parsed. When handling falls behind the channel
+ * fills up and reading stops, leaving the rest in the socket's receive
+ * window rather than in memory.
+ *
+ * The body of a /text PDU goes through the same channel, see PduChannel,
+ * and the handler writes it to the message's file while the rest is read.
+ * A message is an /env and the /text PDUs after it, it is stored when the
+ * master sends /send. Any PDU other than those and /comment drops a message
+ * that hasn't been sent.
+ */
+class Mep2Session {
+  public:
+    // How many parsed PDUs or body chunks may wait for the one being
+    // handled
+    static constexpr size_t pipeline_depth = 4;
+
+    Mep2Session(tcp::socket socket, MailStore& store);
+
+    // Serves the connection until the master sends /term or disconnects
+    awaitable<void> run();
+
+  private:
+    // The two stages, each runs until the master goes away or sends /term
+    awaitable<void> read_pdus();
+    awaitable<void> handle_pdus();
+
+    // Returns false once the session should end
+    awaitable<bool> handle_pdu(const PduVariant& pdu);
+    awaitable<void> write_body(std::string_view text);
+    awaitable<void> send_message();
+    awaitable<void> send_reply(Mep2ErrorCode code, std::string_view context = {});
+
+    // Starts a new message, dropping the one before if it wasn't sent
+    void open_message();
+
+    tcp::socket _socket;
+    MailStore& _store;
+    // A PDU lives in the parser's arenas until it is handled. There is one
+    // for each PDU in the channel, the one being handled and the one being
+    // parsed.
+    PduParser _parser;
+    PduFramer _framer;
+    PduChannel _channel;
+
+    // The message being received, MailStoreFile can't be moved so it is
+    // held by pointer
+    std::unique_ptr<MailStoreFile> _message;
+    // Why the message can't be stored any more, the rest of it is dropped
+    // and /send reports this
+    std::optional<PduError> _message_error;
+    // Whether body chunks have come in whose /text PDU hasn't yet
+    bool _in_body{false};
+};
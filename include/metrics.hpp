@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "mep2_errors.hpp"
+#include "mep2_pdu.hpp"
+
+using metrics_clock = std::chrono::steady_clock;
+
+/*
+ * A counter written by a single thread. Adding is a plain load and store
+ * rather than a locked read-modify-write, the atomic only keeps readers on
+ * other threads from seeing torn values.
+ */
+class Counter {
+  public:
+    void add(uint64_t n = 1) {
+        _value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const { return _value.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<uint64_t> _value{0};
+};
+
+// Durations in power of two buckets of nanoseconds, bucket i counts what is
+// shorter than 2^i ns. The last one takes everything from half a second on.
+class Histogram {
+  public:
+    static constexpr size_t bucket_count = 31;
+
+    void observe(metrics_clock::duration duration) {
+        const uint64_t ns = std::max<int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(), 0);
+        _buckets[std::min<size_t>(std::bit_width(ns), bucket_count - 1)].add();
+        _sum_ns.add(ns);
+    }
+
+    uint64_t bucket(size_t i) const { return _buckets[i].get(); }
+    uint64_t sum_ns() const { return _sum_ns.get(); }
+
+  private:
+    std::array<Counter, bucket_count> _buckets{};
+    Counter _sum_ns{};
+};
+
+// Everything one thread records, see Metrics
+struct alignas(64) ThreadMetrics {
+    // Reply codes are all below this
+    static constexpr size_t max_reply_code = 500;
+
+    // Completed PDUs by type
+    std::array<Counter, PduType::type_count> pdus{};
+    // From the first line of a PDU to its last
+    Histogram parse_latency{};
+    // Replies sent, by code
+    std::array<Counter, max_reply_code> replies{};
+
+    // Message text, taken in by write_encoded() and sent by send_encoded()
+    Counter bytes_decoded{};
+    Counter bytes_encoded{};
+
+    // MailStoreFile::write(), and the wait in close() for the file to be
+    // committed
+    Histogram write_latency{};
+    Histogram commit_latency{};
+
+    void count_reply(Mep2ErrorCode code) {
+        const auto index = static_cast<size_t>(code);
+        if (index < replies.size()) {
+            replies[index].add();
+        }
+    }
+};
+
+/*
+ * Every thread records into its own ThreadMetrics, so recording an event is
+ * an uncontended store of a few nanoseconds. Only reading takes a lock, to
+ * sum what all threads have recorded.
+ *
+ * The block of a thread that exits is handed to the next new thread, whose
+ * counts simply add to it. Totals never go down.
+ */
+class Metrics {
+  public:
+    // The ThreadMetrics of the calling thread
+    static ThreadMetrics& local() {
+        if (!_local) [[unlikely]] {
+            _local = &acquire();
+        }
+        return *_local;
+    }
+
+    // The totals over all threads, in the Prometheus text exposition format
+    static std::string render();
+
+  private:
+    static ThreadMetrics& acquire();
+
+    static inline thread_local ThreadMetrics* _local = nullptr;
+};
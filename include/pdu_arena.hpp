@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <optional>
+
+/*
+ * The memory the PDUs of one connection are built in.
+ *
+ * Allocations are carved from a single buffer and never freed one by one,
+ * release() drops everything at once. Whatever doesn't fit into the buffer
+ * comes from upstream, and the next release() grows the buffer to hold it
+ * so that a connection sending large envelopes settles into not allocating
+ * at all.
+ */
+class PduArena final : public std::pmr::memory_resource {
+  public:
+    // Grown buffers are capped at this, anything beyond keeps coming from
+    // upstream
+    static constexpr size_t max_buffer_size = 1024 * 1024;
+
+    PduArena(size_t size, std::pmr::memory_resource* upstream);
+    ~PduArena();
+
+    PduArena(const PduArena&) = delete;
+    PduArena& operator=(const PduArena&) = delete;
+
+    // What PDUs allocate from
+    std::pmr::memory_resource* resource() { return &*_resource; }
+    size_t buffer_size() const { return _size; }
+
+    // Everything allocated from resource() becomes invalid
+    void release();
+
+  private:
+    // Only the monotonic resource allocates through these, for what doesn't
+    // fit in the buffer
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    std::pmr::memory_resource* _upstream;
+    size_t _size;
+    std::byte* _buffer;
+    // Taken from upstream since the last release
+    size_t _overflow{0};
+    std::optional<std::pmr::monotonic_buffer_resource> _resource;
+};
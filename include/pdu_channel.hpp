@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+
+#include <asio.hpp>
+#include <asio/experimental/channel.hpp>
+
+#include "mep2_errors.hpp"
+#include "mep2_pdu.hpp"
+#include "text_sink.hpp"
+
+using asio::awaitable;
+
+/*
+ * Carries what the reading stage of a session parsed over to the stage
+ * handling it, in the order it was read: PDUs, or why what was sent couldn't
+ * be parsed into one, and ahead of every /text PDU its body.
+ *
+ * As the parser's text sink the channel passes the body on in the chunks
+ * the parser collects it in, so that the handler writes it to the store
+ * while the rest of it is still being read. The channel only holds capacity
+ * items. Once the handler falls behind, on a slow disk say, the parser
+ * waits for room and reading from the socket waits with it.
+ */
+class PduChannel final : public TextSink {
+  public:
+    // Part of the body of the /text PDU that follows it through the channel,
+    // as sent with its %-codes and line ends
+    struct BodyChunk {
+        std::string text;
+    };
+
+    using item = std::variant<PduResult<PduVariant>, BodyChunk>;
+
+    PduChannel(const asio::any_io_executor& executor, size_t capacity)
+        : _channel(executor, capacity) {}
+
+    // Both wait while the channel is full, and throw once it is closed
+    awaitable<void> send(PduResult<PduVariant> pdu);
+    awaitable<PduResult<void>> write_text(std::string_view text) override;
+
+    // nullopt once the channel is closed and everything sent before has
+    // been received
+    awaitable<std::optional<item>> receive();
+
+    // Whatever has been sent can still be received
+    void close() { _channel.close(); }
+    // Wakes a sender waiting for room, what was sent is dropped
+    void cancel() { _channel.cancel(); }
+
+  private:
+    asio::experimental::channel<void(asio::error_code, item)> _channel;
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+
+#include <asio.hpp>
+
+#include "mep2_pdu_parser.hpp"
+
+using asio::awaitable;
+
+/*
+ * Splits a received byte stream into MEP2 lines and hands them to a PduParser.
+ *
+ * A line ends at a '\r', optionally followed by a '\n'. Both are part of the
+ * line as far as the parser is concerned since they count towards the
+ * checksum of multi-line PDUs.
+ *
+ * Lines that lie entirely within one read are passed to the parser as views
+ * into the receive buffer. Only a line that straddles two reads is copied,
+ * into a small fixed carry-over area.
+ */
+class PduFramer {
+  public:
+    // Lines are wrapped at 200 characters, any of which might be %-encoded.
+    // Anything longer than this is not a MEP2 client talking to us.
+    static constexpr size_t max_line_length = 1024;
+    static constexpr size_t receive_buffer_size = 16384;
+
+    // Feeds lines from data to the parser until either the parser holds a
+    // complete PDU or data is exhausted. Returns true if a PDU is complete,
+    // data then holds what is left for the next PDU.
+    //
+    // Any error thrown by the parser is passed on, the offending line has
+    // been consumed from data at that point.
+    awaitable<bool> feed(PduParser& parser, std::string_view& data);
+
+    // Reads from the stream until the parser holds a complete PDU.
+    // Data following the PDU is kept for the next call.
+    template <typename AsyncReadStream>
+    awaitable<void> read_pdu(AsyncReadStream& stream, PduParser& parser) {
+        for (;;) {
+            if (co_await feed(parser, _pending)) {
+                co_return;
+            }
+
+            size_t length = co_await stream.async_read_some(asio::buffer(_receive_buffer),
+                                                            asio::use_awaitable);
+            _pending = std::string_view(_receive_buffer.data(), length);
+        }
+    }
+
+    bool has_partial_line() const { return _carry_length != 0 || _discarding; }
+
+    void reset() {
+        _carry_length = 0;
+        _discarding = false;
+        _pending_lf = false;
+        _pending = std::string_view();
+    }
+
+  private:
+    void carry(std::string_view data, bool line_complete);
+
+    std::array<char, max_line_length> _carry;
+    size_t _carry_length{0};
+
+    // The current line was too long, drop everything up to its end
+    bool _discarding{false};
+    // The last line ended in a '\r' that was the last byte of a read, if the
+    // next read starts with a '\n' it still belongs to that line.
+    bool _pending_lf{false};
+
+    std::array<char, receive_buffer_size> _receive_buffer;
+    std::string_view _pending;
+};
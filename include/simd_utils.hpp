@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+// Sum of the low 7 bits of every byte, modulo 2^16. This is the MEP2
+// checksum; the upper bit should never appear but must be ignored if it does.
+//
+// Picks the widest vector unit available at runtime.
+uint16_t sum_7bit(std::string_view sv);
+
+// Byte at a time reference implementation of sum_7bit()
+uint16_t sum_7bit_scalar(std::string_view sv);
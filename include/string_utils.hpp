@@ -1,19 +1,72 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <cstdint>
 #include <cstring>
 #include <ranges>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 
+enum class DecodeStatus { ok, stray_slash, short_percent, invalid_percent };
+
+const char* decode_status_message(DecodeStatus status);
+
+// Decodes into out, replacing its contents. out keeps its capacity, so
+// reusing the same string across calls doesn't allocate.
+[[nodiscard]] DecodeStatus decode_string(std::string_view sv, std::string& out);
+// As above, but throws std::invalid_argument on error
 std::string decode_string(std::string_view sv);
 std::string encode_string(std::string_view sv);
+// Appends the encoded sv to out
+void encode_string_to(std::string_view sv, std::string& out);
+
+/*
+ * %-encodes data that arrives, or is written out, a piece at a time. Lines
+ * longer than max_line_length are broken with a transparent newline, the
+ * length of the current line carries over from one call to the next.
+ */
+class StringEncoder {
+  public:
+    static constexpr size_t max_line_length = 200;
+    // What a single character can turn into, a line break and a % code
+    static constexpr size_t max_encoded_char = 6;
+
+    // Encodes from the front of input for as long as output has room for
+    // another max_encoded_char, returns the number of characters written.
+    size_t encode(std::string_view& input, std::span<char> output);
+
+    void reset() { _chars_since_cr = 0; }
+
+  private:
+    size_t _chars_since_cr{0};
+};
+
+/*
+ * The other direction, for the stored body of a /text PDU. Transparent
+ * newlines are dropped and a % code split between two pieces is completed by
+ * the next call. Throws std::invalid_argument on an invalid % code.
+ */
+class StringDecoder {
+  public:
+    // Replaces the contents of output, which keeps its capacity
+    void decode(std::string_view input, std::string& output);
+
+    void reset() { _leftover_length = 0; }
+
+  private:
+    // An incomplete % code at the end of the last piece
+    std::array<char, 2> _leftover{};
+    uint8_t _leftover_length{0};
+};
 
 // Our own because we don't want any locale interpretations
 constexpr char lower(const char c) { return (c >= 'A' && c <= 'Z') ? (c - 'A' + 'a') : c; }
 
-constexpr unsigned char hex_to_char(const unsigned char c) {
+// Returns -1 if c is not a hex character
+constexpr int hex_value(const unsigned char c) {
     if (c >= '0' && c <= '9') {
         return c - '0';
     }
@@ -23,7 +76,16 @@ constexpr unsigned char hex_to_char(const unsigned char c) {
         return lc - 'a' + 10;
     }
 
-    throw std::invalid_argument("Input is not a valid hex character");
+    return -1;
+}
+
+constexpr unsigned char hex_to_char(const unsigned char c) {
+    int value = hex_value(c);
+    if (value < 0) {
+        throw std::invalid_argument("Input is not a valid hex character");
+    }
+
+    return value;
 }
 
 constexpr unsigned char char_to_hex(const unsigned char c) {
@@ -40,13 +102,24 @@ inline bool is_numeric(const std::string_view sv) {
 
 inline bool is_printable(const std::string& str) { return is_printable(std::string_view(str)); }
 
-inline bool icompare(std::string_view haystack, std::string_view needle) {
+// Case insensitive prefix match, needle must be lower case
+constexpr bool icompare(std::string_view haystack, std::string_view needle) {
     if (haystack.length() < needle.length()) {
         return false;
     }
 
-    haystack = haystack.substr(0, needle.length());
-    return std::ranges::equal(haystack | std::views::transform(lower), needle);
+    for (size_t i = 0; i < needle.length(); ++i) {
+        if (lower(haystack[i]) != needle[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Case insensitive full match, needle must be lower case
+constexpr bool iequals(std::string_view sv, std::string_view needle) {
+    return sv.length() == needle.length() && icompare(sv, needle);
 }
 
 static constexpr std::string_view whitespace = " \t";
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string_view>
+
+#include <asio.hpp>
+
+#include "mep2_errors.hpp"
+
+using asio::awaitable;
+
+/*
+ * Where the body of a /text PDU goes while it is still being parsed, so that
+ * a message never has to be held in memory as a whole. A sink is handed the
+ * body lines as they were sent, with their %-codes and line ends, a chunk of
+ * them at a time.
+ *
+ * The parser waits for every chunk to be taken, and reading waits with it.
+ * A sink in a session hands the chunks on to be written elsewhere, see
+ * PduChannel, rather than wait for the disk itself.
+ *
+ * A sink reports a problem by returning an error. The rest of the body is
+ * then dropped, and the error reported once the PDU has ended.
+ */
+class TextSink {
+  public:
+    virtual awaitable<PduResult<void>> write_text(std::string_view text) = 0;
+
+  protected:
+    ~TextSink() = default;
+};
@@ -1,13 +1,18 @@
 #pragma once
 
 #include <array>
+#include <bit>
 #include <cstddef>
 #include <cstdint>
 #include <optional>
 #include <string_view>
 
+template <typename CommandEnum, size_t NodeCount> class CompactTrie;
+
 template <typename CommandEnum, size_t MaxCommands, size_t MaxDepth> class Trie {
   private:
+    template <typename, size_t> friend class CompactTrie;
+
     static constexpr size_t alphabet_size = 26;
 
     struct Node {
@@ -32,6 +37,9 @@ template <typename CommandEnum, size_t MaxCommands, size_t MaxDepth> class Trie
   public:
     consteval Trie() : nodes{}, node_count(1) {}
 
+    // Number of nodes in use, including the root
+    constexpr size_t size() const { return node_count; }
+
     consteval void insert(const std::string_view str, const CommandEnum cmd) {
         int16_t node = 0;
         for (char ch : str) {
@@ -74,3 +82,109 @@ template <typename CommandEnum, size_t MaxCommands, size_t MaxDepth> class Trie
         return std::nullopt;
     }
 };
+
+/*
+ * The same trie flattened for lookups, sized exactly to the nodes in use.
+ *
+ * Nodes are numbered breadth first, so the children of a node are
+ * consecutive and edge n always leads to node n + 1. A node then only needs
+ * to know where its edges start, its edges end where those of the next node
+ * start. The label of edge n is kept with node n + 1, the node it leads to,
+ * and the edge labels of a node are sorted. All of a node fits in 16 bits.
+ */
+template <typename CommandEnum, size_t NodeCount> class CompactTrie {
+  private:
+    static_assert(NodeCount > 0, "A trie has at least its root");
+
+    static constexpr size_t edge_bits = std::bit_width(NodeCount);
+    static constexpr size_t label_bits = 5;
+    static constexpr size_t command_bits = 16 - edge_bits - label_bits;
+    static_assert(edge_bits + label_bits < 16, "Too many nodes for 16 bit nodes");
+
+    struct Node {
+        uint16_t first_edge : edge_bits;
+        // Of the edge leading here, 0 for 'a'
+        uint16_t label : label_bits;
+        // Value of the command ending at this node plus one, 0 if none does
+        uint16_t command : command_bits;
+    };
+
+    // One extra node marks the end of the edges of the last node
+    std::array<Node, NodeCount + 1> nodes;
+
+    static constexpr char lower(const char c) {
+        return (c >= 'A' && c <= 'Z') ? (c - 'A' + 'a') : c;
+    }
+
+    static constexpr bool is_valid_command_char(const char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+  public:
+    template <size_t MaxCommands, size_t MaxDepth>
+    consteval CompactTrie(const Trie<CommandEnum, MaxCommands, MaxDepth>& trie)
+        : nodes{} {
+        if (trie.size() != NodeCount) {
+            throw("NodeCount must match the size of the trie");
+        }
+
+        // Breadth first walk, queue[n] is the original node that becomes node n
+        std::array<int16_t, NodeCount> queue{};
+        size_t queued = 1;
+        size_t edge = 0;
+
+        for (size_t n = 0; n < NodeCount; ++n) {
+            const auto& node = trie.nodes[queue[n]];
+
+            nodes[n].first_edge = edge;
+            if (node.is_end) {
+                auto value = static_cast<size_t>(node.cmd);
+                if (value + 1 >= (size_t{1} << command_bits)) {
+                    throw("Command values must fit in the bits left over");
+                }
+                nodes[n].command = value + 1;
+            }
+
+            for (size_t c = 0; c < node.children.size(); ++c) {
+                if (node.children[c] != -1) {
+                    nodes[edge + 1].label = c;
+                    ++edge;
+                    queue[queued++] = node.children[c];
+                }
+            }
+        }
+
+        nodes[NodeCount].first_edge = edge;
+    }
+
+    constexpr std::optional<CommandEnum> find(std::string_view& str) const {
+        size_t node = 0;
+        uint32_t consumed = 0;
+
+        for (char ch : str) {
+            if (!is_valid_command_char(ch))
+                break;
+
+            ++consumed;
+
+            const unsigned label = lower(ch) - 'a';
+            size_t edge = nodes[node].first_edge;
+            const size_t last_edge = nodes[node + 1].first_edge;
+            while (edge < last_edge && nodes[edge + 1].label < label) {
+                ++edge;
+            }
+
+            if (edge == last_edge || nodes[edge + 1].label != label) {
+                return std::nullopt;
+            }
+            node = edge + 1;
+        }
+
+        if (nodes[node].command) {
+            str.remove_prefix(consumed);
+            return std::optional(static_cast<CommandEnum>(nodes[node].command - 1));
+        }
+
+        return std::nullopt;
+    }
+};
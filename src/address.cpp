@@ -1,22 +1,31 @@
+#include <cstring>
 #include <format>
+#include <limits>
+#include <memory>
 #include <optional>
 #include <print>
-#include <regex>
+#include <stdexcept>
 #include <string_view>
+#include <utility>
 
 #include "address.hpp"
 #include "mep2_errors.hpp"
 #include "string_utils.hpp"
 
-bool is_mciid(std::string_view line) {
-    // MCI IDs are in the form of:
-    // 123-4567, 123-456-7890, 1234567, 1234567890
-
-    static const std::regex mciid_regex(R"(^(\d{3}-\d{4}|\d{3}-\d{3}-\d{4}|\d{7}|\d{10})$)");
-    return std::regex_match(line.begin(), line.end(), mciid_regex);
+static_assert(match_mciid("123-4567")->view() == "123-4567");
+static_assert(match_mciid("1234567")->view() == "123-4567");
+static_assert(match_mciid("1234567890")->view() == "123-456-7890");
+static_assert(match_mciid("000-123-4567")->view() == "123-4567");
+static_assert(match_mciid("0001234567")->view() == "123-4567");
+static_assert(!is_mciid("123-45678"));
+static_assert(!is_mciid("1234-567"));
+
+// Everything wrong with an address is malformed data
+static std::unexpected<PduError> malformed(std::string context) {
+    return pdu_error(Mep2ErrorCode::Malformed_Data, std::move(context));
 }
 
-std::optional<std::string_view> parse_mciid(std::string_view line) {
+PduResult<std::optional<MciId>> parse_mciid(std::string_view line) {
     bool explicit_mciid = false;
     if (line.starts_with("MCI ID:")) {
         line.remove_prefix(7);
@@ -25,47 +34,39 @@ std::optional<std::string_view> parse_mciid(std::string_view line) {
         explicit_mciid = true;
     }
 
-    if (is_mciid(line)) {
-        return line;
+    auto mciid = match_mciid(line);
+    if (mciid) {
+        return mciid;
     }
 
     if (explicit_mciid) {
-        throw PduMalformedDataError("Invalid MCI ID after MCI ID:");
+        return malformed("Invalid MCI ID after MCI ID:");
     }
 
     return std::nullopt;
 }
 
 std::string canonicalize_mciid(std::string_view line) {
-    if (!is_mciid(line)) {
+    auto mciid = match_mciid(line);
+    if (!mciid) {
         throw std::invalid_argument("Invalid MCI ID format");
     }
 
-    // In the form of 123-4567
-    // Note that we can't exit here if size is 12 as an ID in the form of
-    // 000-123-4567 is not in canonical form
-    if (line.length() == 8) {
-        return std::string(line);
-    }
-
-    // In the form of 123-456-7890 or 1234567890
-    // Strip off any leading 000 or 0000-
-    if (line.length() >= 10 && line.starts_with("000")) {
-        line.remove_prefix(line[3] == '-' ? 4 : 3);
-    }
-
-    // All done, if we are size 8 or 12 at this point we have
-    // either 123-4567 or 123-456-7890
-    if (line.length() == 8 || line.length() == 12) {
-        return std::string(line);
-    }
+    return mciid->str();
+}
 
-    // We have numbers only, add the dashes
-    if (line.length() == 7) {
-        return std::format("{}-{}", line.substr(0, 3), line.substr(3));
-    } else {
-        return std::format("{}-{}-{}", line.substr(0, 3), line.substr(3, 3), line.substr(6));
-    }
+RawAddress RawAddress::allocated_from(std::pmr::memory_resource* resource) {
+    return RawAddress{
+        ._name = std::pmr::string(resource),
+        ._id = std::pmr::string(resource),
+        ._organization = std::pmr::string(resource),
+        ._location = std::pmr::string(resource),
+        ._unresolved_org_loc_1 = std::pmr::string(resource),
+        ._unresolved_org_loc_2 = std::pmr::string(resource),
+        ._alert = std::pmr::string(resource),
+        ._ems = std::pmr::string(resource),
+        ._mbx = std::pmr::vector<std::pmr::string>(resource),
+    };
 }
 
 bool RawAddress::operator==(const RawAddress& rhs) const {
@@ -104,9 +105,9 @@ bool RawAddress::operator==(const RawAddress& rhs) const {
     return true;
 }
 
-void RawAddress::parse_org_or_loc(std::string_view line) {
+PduResult<void> RawAddress::parse_org_or_loc(std::string_view line) {
     if (is_mciid(line)) {
-        throw PduMalformedDataError("Location/Organization cannot be an MCI ID");
+        return malformed("Location/Organization cannot be an MCI ID");
     }
 
     if (line.starts_with("Loc:")) {
@@ -114,7 +115,7 @@ void RawAddress::parse_org_or_loc(std::string_view line) {
         strip(line);
 
         if (!line.length()) {
-            throw PduMalformedDataError("Location cannot be empty");
+            return malformed("Location cannot be empty");
         }
         _location = line;
     } else if (line.starts_with("Org:")) {
@@ -122,12 +123,12 @@ void RawAddress::parse_org_or_loc(std::string_view line) {
         strip(line);
 
         if (!line.length()) {
-            throw PduMalformedDataError("Organization cannot be empty");
+            return malformed("Organization cannot be empty");
         }
         _organization = line;
     } else {
         if (!line.length()) {
-            throw PduMalformedDataError("Organization/Location cannot be empty");
+            return malformed("Organization/Location cannot be empty");
         }
 
         if (_unresolved_org_loc_1.empty()) {
@@ -136,20 +137,22 @@ void RawAddress::parse_org_or_loc(std::string_view line) {
             _unresolved_org_loc_2 = line;
         }
     }
+
+    return {};
 }
 
-void RawAddress::parse_options(std::string_view& line) {
+PduResult<void> RawAddress::parse_options(std::string_view& line) {
     // Line is rstipped so the last character should be a ')' if this has
     // options
     if (!line.ends_with(')'))
-        return;
+        return {};
 
     if (std::count(line.cbegin(), line.cend(), '(') != 1) {
-        throw PduMalformedDataError("Malformed options, too many parenthesis");
+        return malformed("Malformed options, too many parenthesis");
     }
 
     if (std::count(line.cbegin(), line.cend(), ')') != 1) {
-        throw PduMalformedDataError("Malformed options, too many parenthesis");
+        return malformed("Malformed options, too many parenthesis");
     }
 
     size_t options_start = line.find_first_of('(');
@@ -170,7 +173,7 @@ void RawAddress::parse_options(std::string_view& line) {
         size_t delim = options.find_first_of(',');
 
         if (delim == options.length() - 1) {
-            throw PduMalformedDataError("Malformed options, trailing comma");
+            return malformed("Malformed options, trailing comma");
         }
 
         std::string_view option = options;
@@ -182,7 +185,7 @@ void RawAddress::parse_options(std::string_view& line) {
         }
 
         if (!option.length()) {
-            throw PduMalformedDataError("Malformed options, empty option");
+            return malformed("Malformed options, empty option");
         }
 
         // Whitespace should be ignored
@@ -207,64 +210,75 @@ void RawAddress::parse_options(std::string_view& line) {
         } else if (option == "NO RECEIPT") {
             _no_receipt = true;
         } else {
-            throw PduMalformedDataError(
-                std::format("Malformed options, unknown option '{}'", option));
+            return malformed(std::format("Malformed options, unknown option '{}'", option));
         }
         _has_options = true;
     }
+
+    return {};
 }
 
-void RawAddress::parse_first_line(std::string_view line) {
+PduResult<void> RawAddress::parse_first_line(std::string_view line) {
     size_t num_slashes = std::count(line.cbegin(), line.cend(), '/');
     if (num_slashes > 2) {
-        throw PduMalformedDataError("Too many fields");
+        return malformed("Too many fields");
     }
 
     rstrip(line);
 
     if (!line.length()) {
-        throw PduMalformedDataError("Empty address");
+        return malformed("Empty address");
     }
 
     // Check to see if we have recipient options
-    parse_options(line);
+    if (auto options = parse_options(line); !options) {
+        return options;
+    }
 
     // No slashes, must just be a name or id.
     if (num_slashes == 0) {
         auto mciid = parse_mciid(line);
-        if (mciid.has_value()) {
-            _id = canonicalize_mciid(*mciid);
+        if (!mciid) {
+            return std::unexpected(std::move(mciid.error()));
+        }
+
+        if (mciid->has_value()) {
+            _id = (*mciid)->view();
         } else {
             if (!line.length()) {
-                throw PduMalformedDataError("Name cannot be empty");
+                return malformed("Name cannot be empty");
             }
             _name = line;
         }
 
-        return;
+        return {};
     }
 
     size_t first_slash = line.find('/');
     std::string_view first_part = line.substr(0, first_slash);
     if (!first_part.length()) {
-        throw PduMalformedDataError("Name/ID field invalid");
+        return malformed("Name/ID field invalid");
     }
     rstrip(first_part);
     auto mciid = parse_mciid(first_part);
-    if (mciid.has_value()) {
+    if (!mciid) {
+        return std::unexpected(std::move(mciid.error()));
+    }
+
+    if (mciid->has_value()) {
         // Handle "MCIID / Org or Loc"
-        _id = canonicalize_mciid(*mciid);
+        _id = (*mciid)->view();
     } else {
         // Handle "Name / MCIid" or "Name / Org or Loc"
         if (!line.length()) {
-            throw PduMalformedDataError("Name cannot be empty");
+            return malformed("Name cannot be empty");
         }
         _name = first_part;
     }
 
     line.remove_prefix(first_slash + 1);
     if (!line.length()) {
-        throw PduMalformedDataError("First Organization/Location field invalid");
+        return malformed("First Organization/Location field invalid");
     }
 
     strip(line);
@@ -272,16 +286,19 @@ void RawAddress::parse_first_line(std::string_view line) {
     if (num_slashes == 1) {
         if (_id.empty()) {
             auto mciid = parse_mciid(line);
+            if (!mciid) {
+                return std::unexpected(std::move(mciid.error()));
+            }
+
             // Deal with "User name / MCIID"
-            if (mciid.has_value()) {
-                _id = canonicalize_mciid(*mciid);
-                return;
+            if (mciid->has_value()) {
+                _id = (*mciid)->view();
+                return {};
             }
         }
 
         // Deal with "MCIID / Org or Loc"
-        parse_org_or_loc(line);
-        return;
+        return parse_org_or_loc(line);
     }
 
     // Deal with Username, id / Org or Loc / Org or Loc
@@ -292,40 +309,42 @@ void RawAddress::parse_first_line(std::string_view line) {
     strip(third_part);
 
     if (is_mciid(second_part) || is_mciid(third_part)) {
-        throw PduMalformedDataError("Organization/Location cannot be an MCI ID");
+        return malformed("Organization/Location cannot be an MCI ID");
     }
 
-    parse_org_or_loc(second_part);
-    parse_org_or_loc(third_part);
+    if (auto second = parse_org_or_loc(second_part); !second) {
+        return second;
+    }
+    return parse_org_or_loc(third_part);
 }
 
-void RawAddress::parse_field(std::string_view field, std::string_view information) {
+PduResult<void> RawAddress::parse_field(std::string_view field, std::string_view information) {
     // Shortest theoretical field is MBX:
 
     if (field.length() < 4) {
-        throw PduMalformedDataError("Unknown field type");
+        return malformed("Unknown field type");
     }
 
     if (icompare(field, "ems:")) {
         if (!_ems.empty()) {
-            throw PduMalformedDataError("Multiple EMS directive in address");
+            return malformed("Multiple EMS directive in address");
         }
 
         if (!information.length()) {
-            throw PduMalformedDataError("EMS cannot be empty");
+            return malformed("EMS cannot be empty");
         }
 
         _ems = information;
     } else if (icompare(field, "mbx:")) {
         if (_ems.empty()) {
-            throw PduMalformedDataError("MBX without EMS");
+            return malformed("MBX without EMS");
         }
 
         if (!information.length()) {
-            throw PduMalformedDataError("MBX cannot be empty");
+            return malformed("MBX cannot be empty");
         }
 
-        _mbx.push_back(std::string(information));
+        _mbx.emplace_back(information);
 
         size_t mbx_len = 0;
         for (auto& m : _mbx) {
@@ -333,59 +352,240 @@ void RawAddress::parse_field(std::string_view field, std::string_view informatio
         }
 
         if (mbx_len > 305) {
-            throw PduMalformedDataError("MBX routing info larger than 305 characters");
+            return malformed("MBX routing info larger than 305 characters");
         }
     } else {
-        throw PduMalformedDataError(std::format("Unknown address field {}", field));
+        return malformed(std::format("Unknown address field {}", field));
     }
+
+    return {};
 }
 
 const std::string RawAddress::str() const {
-    std::stringstream ss;
-    if (_name.empty()) {
-        ss << _id;
+    std::string out;
+    format_to(out);
+    return out;
+}
+
+static AddressOptions options_of(const RawAddress& address) {
+    return AddressOptions{
+        .has_options = address._has_options,
+        .board = address._board,
+        .instant = address._instant,
+        .list = address._list,
+        .owner = address._owner,
+        .onite = address._onite,
+        .print = address._print,
+        .receipt = address._receipt,
+        .no_receipt = address._no_receipt,
+    };
+}
+
+// What both RawAddress::format_to() and PackedAddress::format_to() append
+static void format_address_to(std::string& out, std::string_view name, std::string_view id,
+                              std::string_view location, std::string_view organization,
+                              std::string_view unresolved_org_loc_1,
+                              std::string_view unresolved_org_loc_2, AddressOptions options) {
+    if (name.empty()) {
+        out += id;
     } else {
-        ss << _name;
+        out += name;
 
-        if (!_id.empty()) {
-            ss << " / " << _id;
+        if (!id.empty()) {
+            out += " / ";
+            out += id;
         } else {
-            if (!_location.empty())
-                ss << " / Loc: " << _location;
-            if (!_organization.empty())
-                ss << " / Org: " << _organization;
-
-            if (!_unresolved_org_loc_1.empty())
-                ss << " / " << _unresolved_org_loc_1;
-            if (!_unresolved_org_loc_2.empty())
-                ss << " / " << _unresolved_org_loc_2;
+            if (!location.empty()) {
+                out += " / Loc: ";
+                out += location;
+            }
+            if (!organization.empty()) {
+                out += " / Org: ";
+                out += organization;
+            }
+
+            if (!unresolved_org_loc_1.empty()) {
+                out += " / ";
+                out += unresolved_org_loc_1;
+            }
+            if (!unresolved_org_loc_2.empty()) {
+                out += " / ";
+                out += unresolved_org_loc_2;
+            }
         }
     }
 
-    static const std::array<std::pair<bool RawAddress::*, const char*>, 8> options = {
-        {{&RawAddress::_board, "BOARD"},
-         {&RawAddress::_instant, "INSTANT"},
-         {&RawAddress::_list, "LIST"},
-         {&RawAddress::_owner, "OWNER"},
-         {&RawAddress::_onite, "ONITE"},
-         {&RawAddress::_print, "PRINT"},
-         {&RawAddress::_receipt, "RECEIPT"},
-         {&RawAddress::_no_receipt, "NO RECEIPT"}}};
-
-    if (_has_options) {
+    struct Flag {
+        bool set;
+        const char* name;
+    };
+    const std::array<Flag, 8> flags = {{
+        {options.board, "BOARD"},
+        {options.instant, "INSTANT"},
+        {options.list, "LIST"},
+        {options.owner, "OWNER"},
+        {options.onite, "ONITE"},
+        {options.print, "PRINT"},
+        {options.receipt, "RECEIPT"},
+        {options.no_receipt, "NO RECEIPT"},
+    }};
+
+    if (options.has_options) {
         bool first = true;
-        ss << " (";
-        for (auto v : options) {
-            if (this->*v.first) {
+        out += " (";
+        for (auto v : flags) {
+            if (v.set) {
                 if (!first)
-                    ss << ", ";
+                    out += ", ";
                 else
                     first = false;
-                ss << v.second;
+                out += v.name;
             }
         }
-        ss << ")";
+        out += ")";
+    }
+}
+
+void RawAddress::format_to(std::string& out) const {
+    format_address_to(out, _name, _id, _location, _organization, _unresolved_org_loc_1,
+                      _unresolved_org_loc_2, options_of(*this));
+}
+
+PackedAddress::PackedAddress(const RawAddress& address) : _options(options_of(address)) {
+    const std::array<std::string_view, fixed_fields> fields = {
+        address._name,
+        address._id,
+        address._organization,
+        address._location,
+        address._unresolved_org_loc_1,
+        address._unresolved_org_loc_2,
+        address._alert,
+        address._ems,
+    };
+
+    if (address._mbx.size() > std::numeric_limits<uint16_t>::max()) {
+        throw std::length_error("Too many MBX lines in address");
+    }
+    _mbx_count = address._mbx.size();
+
+    size_t length = 0;
+    for (std::string_view field : fields) {
+        length += field.size();
+    }
+    for (const auto& mbx : address._mbx) {
+        length += mbx.size();
+    }
+    if (length > std::numeric_limits<uint16_t>::max()) {
+        throw std::length_error("Address too long");
+    }
+
+    const size_t header = field_count() * sizeof(uint16_t);
+    _data = std::make_unique_for_overwrite<char[]>(header + length);
+
+    uint16_t end = 0;
+    auto append = [&, i = size_t{0}](std::string_view field) mutable {
+        std::memcpy(_data.get() + header + end, field.data(), field.size());
+        end += static_cast<uint16_t>(field.size());
+        std::memcpy(_data.get() + i++ * sizeof(uint16_t), &end, sizeof(end));
+    };
+    for (std::string_view field : fields) {
+        append(field);
+    }
+    for (const auto& mbx : address._mbx) {
+        append(mbx);
+    }
+
+    // The field ends tell "ab" "c" from "a" "bc". Addresses differing only
+    // in their options are rare enough to leave to operator==.
+    _hash = std::hash<std::string_view>{}(std::string_view(_data.get(), header + length));
+}
+
+PackedAddress::PackedAddress(const PackedAddress& other)
+    : _hash(other._hash), _mbx_count(other._mbx_count), _options(other._options) {
+    if (other._data) {
+        _data = std::make_unique_for_overwrite<char[]>(other.data_size());
+        std::memcpy(_data.get(), other._data.get(), other.data_size());
+    }
+}
+
+PackedAddress::PackedAddress(PackedAddress&& other) noexcept
+    : _data(std::move(other._data)), _hash(std::exchange(other._hash, 0)),
+      _mbx_count(std::exchange(other._mbx_count, 0)),
+      _options(std::exchange(other._options, AddressOptions{})) {}
+
+PackedAddress& PackedAddress::operator=(PackedAddress&& other) noexcept {
+    if (this != &other) {
+        _data = std::move(other._data);
+        _hash = std::exchange(other._hash, 0);
+        _mbx_count = std::exchange(other._mbx_count, 0);
+        _options = std::exchange(other._options, AddressOptions{});
+    }
+    return *this;
+}
+
+PackedAddress& PackedAddress::operator=(const PackedAddress& other) {
+    if (this != &other) {
+        *this = PackedAddress(other);
+    }
+    return *this;
+}
+
+uint16_t PackedAddress::field_end(size_t i) const {
+    if (!_data) {
+        return 0;
+    }
+
+    uint16_t end;
+    std::memcpy(&end, _data.get() + i * sizeof(uint16_t), sizeof(end));
+    return end;
+}
+
+std::string_view PackedAddress::slice(size_t i) const {
+    if (!_data) {
+        return {};
     }
 
-    return ss.str();
+    const uint16_t begin = i ? field_end(i - 1) : 0;
+    const char* chars = _data.get() + field_count() * sizeof(uint16_t);
+    return std::string_view(chars + begin, field_end(i) - begin);
+}
+
+RawAddress PackedAddress::unpack(std::pmr::memory_resource* resource) const {
+    RawAddress address = RawAddress::allocated_from(resource);
+    address._name = name();
+    address._id = id();
+    address._organization = organization();
+    address._location = location();
+    address._unresolved_org_loc_1 = unresolved_org_loc_1();
+    address._unresolved_org_loc_2 = unresolved_org_loc_2();
+    address._alert = alert();
+    address._ems = ems();
+
+    address._mbx.reserve(_mbx_count);
+    for (size_t i = 0; i < _mbx_count; ++i) {
+        address._mbx.emplace_back(mbx(i));
+    }
+
+    address._has_options = _options.has_options;
+    address._board = _options.board;
+    address._instant = _options.instant;
+    address._list = _options.list;
+    address._owner = _options.owner;
+    address._onite = _options.onite;
+    address._print = _options.print;
+    address._receipt = _options.receipt;
+    address._no_receipt = _options.no_receipt;
+
+    return address;
+}
+
+void PackedAddress::format_to(std::string& out) const {
+    format_address_to(out, name(), id(), location(), organization(), unresolved_org_loc_1(),
+                      unresolved_org_loc_2(), _options);
+}
+
+bool PackedAddress::operator==(const PackedAddress& rhs) const {
+    return _hash == rhs._hash && _mbx_count == rhs._mbx_count && _options == rhs._options &&
+           data_size() == rhs.data_size() &&
+           (!_data || std::memcmp(_data.get(), rhs._data.get(), data_size()) == 0);
 }
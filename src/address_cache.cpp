@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "address_cache.hpp"
+#include "string_utils.hpp"
+
+// Between fields, so that moving text from one field to the next makes a
+// different key
+static constexpr char field_separator = '\x1f';
+
+// Appends text without spaces at either end and with runs of spaces and tabs
+// inside made a single space, in lower case unless fold_case is false
+static void append_normalized(std::string& out, std::string_view text, bool fold_case = true) {
+    bool space = false;
+    bool empty = true;
+    for (char c : text) {
+        if (c == ' ' || c == '\t') {
+            space = true;
+            continue;
+        }
+
+        if (space && !empty) {
+            out += ' ';
+        }
+        out += fold_case ? lower(c) : c;
+        space = false;
+        empty = false;
+    }
+    out += field_separator;
+}
+
+AddressKey AddressKey::from(const RawAddress& address) {
+    AddressKey key;
+    std::string& out = key.normalized;
+    out.reserve(address._name.size() + address._id.size() + address._organization.size() +
+                address._location.size() + address._ems.size() + 16);
+
+    if (auto mciid = match_mciid(address._id)) {
+        out += mciid->view();
+        out += field_separator;
+    } else {
+        append_normalized(out, address._id);
+    }
+    append_normalized(out, address._name);
+    append_normalized(out, address._organization);
+    append_normalized(out, address._location);
+    append_normalized(out, address._unresolved_org_loc_1);
+    append_normalized(out, address._unresolved_org_loc_2);
+    append_normalized(out, address._ems);
+    // Mailboxes of other systems may well tell case apart
+    for (const auto& mbx : address._mbx) {
+        append_normalized(out, mbx, false);
+    }
+
+    key.hash = std::hash<std::string_view>{}(out);
+    return key;
+}
+
+AddressCache::AddressCache(const AddressCacheOptions& options)
+    : _shard_capacity(std::max<size_t>(options.capacity / shard_count, 1)), _ttl(options.ttl),
+      _negative_ttl(options.negative_ttl) {}
+
+std::optional<Resolution> AddressCache::find(const AddressKey& key) {
+    Shard& shard = shard_for(key);
+    std::lock_guard lock(shard.mutex);
+
+    auto it = shard.index.find(EntryRef{key.normalized, key.hash});
+    if (it == shard.index.end()) {
+        return std::nullopt;
+    }
+
+    auto entry = it->second;
+    if (entry->expires <= clock::now()) {
+        shard.index.erase(it);
+        shard.lru.erase(entry);
+        return std::nullopt;
+    }
+
+    shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+    return entry->resolution;
+}
+
+void AddressCache::insert(const AddressKey& key, Resolution resolution) {
+    const auto ttl = resolution ? _ttl : _negative_ttl;
+    if (ttl <= std::chrono::seconds::zero()) {
+        return;
+    }
+    const auto expires = clock::now() + ttl;
+
+    Shard& shard = shard_for(key);
+    std::lock_guard lock(shard.mutex);
+
+    if (auto it = shard.index.find(EntryRef{key.normalized, key.hash}); it != shard.index.end()) {
+        auto entry = it->second;
+        entry->resolution = std::move(resolution);
+        entry->expires = expires;
+        shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+        return;
+    }
+
+    if (shard.lru.size() >= _shard_capacity) {
+        const Entry& oldest = shard.lru.back();
+        shard.index.erase(EntryRef{oldest.normalized, oldest.hash});
+        shard.lru.pop_back();
+    }
+
+    shard.lru.push_front(Entry{
+        .normalized = key.normalized,
+        .hash = key.hash,
+        .resolution = std::move(resolution),
+        .expires = expires,
+    });
+    const Entry& entry = shard.lru.front();
+    shard.index.emplace(EntryRef{entry.normalized, entry.hash}, shard.lru.begin());
+}
+
+void AddressCache::clear() {
+    for (Shard& shard : _shards) {
+        std::lock_guard lock(shard.mutex);
+        shard.index.clear();
+        shard.lru.clear();
+    }
+}
+
+size_t AddressCache::size() const {
+    size_t size = 0;
+    for (const Shard& shard : _shards) {
+        std::lock_guard lock(shard.mutex);
+        size += shard.lru.size();
+    }
+    return size;
+}
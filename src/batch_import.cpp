@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include <asio/experimental/parallel_group.hpp>
+#include <asio/use_awaitable.hpp>
+
+#include "async_utils.hpp"
+#include "batch_import.hpp"
+#include "mep2_pdu_parser.hpp"
+#include "string_utils.hpp"
+
+using asio::use_awaitable;
+
+// As in PduFramer, a line ends at a '\r' and the '\n' that may follow it
+static std::string_view next_line(std::string_view& data) {
+    size_t length = data.find('\r');
+    length = length == std::string_view::npos ? data.size() : length + 1;
+    if (length < data.size() && data[length] == '\n') {
+        ++length;
+    }
+
+    std::string_view line = data.substr(0, length);
+    data.remove_prefix(length);
+    return line;
+}
+
+// The type of the PDU a line starts, empty if it doesn't start one
+static std::string_view pdu_word(std::string_view line) {
+    if (!line.starts_with('/')) {
+        return std::string_view();
+    }
+
+    line.remove_prefix(1);
+    return line.substr(0, line.find_first_of(" *\r\n"));
+}
+
+std::vector<TranscriptMessage> split_transcript(std::string_view transcript) {
+    std::vector<TranscriptMessage> messages;
+
+    // The envelope or text PDU being read
+    const char* pdu_start = nullptr;
+    bool pdu_is_envelope = false;
+    // Whether text PDUs still belong to the last message
+    bool message_open = false;
+
+    auto finish_pdu = [&](const char* end) {
+        std::string_view pdu(pdu_start, end - pdu_start);
+        if (pdu_is_envelope) {
+            messages.push_back(TranscriptMessage{.envelope = pdu});
+            message_open = true;
+        } else {
+            if (!message_open) {
+                messages.emplace_back();
+                message_open = true;
+            }
+            messages.back().texts.push_back(pdu);
+        }
+        pdu_start = nullptr;
+    };
+
+    while (!transcript.empty()) {
+        const char* line_start = transcript.data();
+        std::string_view word = pdu_word(next_line(transcript));
+        if (word.empty()) {
+            continue;
+        }
+
+        if (iequals(word, "end")) {
+            // Ends of the PDUs skipped over don't change anything
+            if (pdu_start) {
+                finish_pdu(transcript.data());
+            }
+            continue;
+        }
+
+        const bool envelope = iequals(word, "env");
+        if (!envelope && !iequals(word, "text")) {
+            // A PDU without its end is cut short by the next one, parsing it
+            // then reports what is wrong with it
+            if (!pdu_start && !iequals(word, "comment")) {
+                message_open = false;
+            }
+            continue;
+        }
+
+        if (pdu_start) {
+            finish_pdu(line_start);
+        }
+        pdu_start = line_start;
+        pdu_is_envelope = envelope;
+    }
+
+    if (pdu_start) {
+        finish_pdu(transcript.data());
+    }
+
+    return messages;
+}
+
+// Parses the single PDU in data, the text of a text PDU is decoded onto
+// text as it goes
+static PduResult<PduVariant> parse_pdu(PduParser& parser, std::string_view data,
+                                       std::string* text) {
+    StringDecoder decoder;
+    std::string decoded;
+
+    parser.reset();
+    bool first = true;
+    while (!data.empty()) {
+        std::string_view line = next_line(data);
+
+        if (text && !first && !line.starts_with('/')) {
+            try {
+                decoder.decode(line, decoded);
+            } catch (const std::invalid_argument& e) {
+                return pdu_error(Mep2ErrorCode::Malformed_Data, e.what());
+            }
+            text->append(decoded);
+        }
+        first = false;
+
+        if (auto parsed = parser.try_parse_line(line); !parsed) {
+            return std::unexpected(std::move(parsed.error()));
+        }
+    }
+
+    if (!parser.is_complete()) {
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "PDU without an end");
+    }
+    return parser.extract_pdu();
+}
+
+PduResult<ImportedMessage> parse_message(const TranscriptMessage& message) {
+    // The envelope is copied out of the arena before the next message
+    thread_local PduParser parser(PduParser::default_arena_size);
+    ImportedMessage imported;
+
+    if (!message.envelope.empty()) {
+        auto pdu = parse_pdu(parser, message.envelope, nullptr);
+        if (!pdu) {
+            return std::unexpected(std::move(pdu.error()));
+        }
+        imported.metadata.set_envelope(std::get<EnvPdu>(*pdu));
+    }
+
+    for (std::string_view text : message.texts) {
+        if (auto pdu = parse_pdu(parser, text, &imported.text); !pdu) {
+            return std::unexpected(std::move(pdu.error()));
+        }
+    }
+
+    return imported;
+}
+
+awaitable<ImportResult> import_transcript(MailStore& store, std::string_view transcript,
+                                          const ImportOptions& options) {
+    const std::vector<TranscriptMessage> messages = split_transcript(transcript);
+    ImportResult result;
+
+    // Each lane takes the next message, has it parsed on the pool and stores
+    // it. The lanes run on the store's thread, only parsing happens elsewhere.
+    size_t next = 0;
+    auto lane = [&]() -> awaitable<void> {
+        while (next < messages.size()) {
+            const size_t index = next++;
+            auto message = co_await run_blocking(
+                store.blocking_pool(), [&pdus = messages[index]] { return parse_message(pdus); });
+            if (!message) {
+                result.failed.emplace_back(index, std::move(message.error()));
+                continue;
+            }
+
+            MailStoreFile file = store.create_file();
+            file.metadata() = std::move(message->metadata);
+            file.metadata().folder = options.folder;
+            if (!message->text.empty()) {
+                co_await file.write(message->text);
+            }
+
+            if (co_await file.close()) {
+                ++result.imported;
+            } else {
+                result.failed.emplace_back(
+                    index, PduError{Mep2ErrorCode::System_Error, "Failed to store message"});
+            }
+        }
+    };
+
+    auto executor = co_await asio::this_coro::executor;
+    std::vector<decltype(asio::co_spawn(executor, lane(), asio::deferred))> lanes;
+    for (size_t i = 0; i < std::max<size_t>(options.in_flight, 1); ++i) {
+        lanes.push_back(asio::co_spawn(executor, lane(), asio::deferred));
+    }
+
+    auto [order, exceptions] = co_await asio::experimental::make_parallel_group(std::move(lanes))
+                                   .async_wait(asio::experimental::wait_for_all(), use_awaitable);
+    for (const auto& exception : exceptions) {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+
+    co_return result;
+}
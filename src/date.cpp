@@ -1,14 +1,14 @@
+#include <array>
 #include <chrono>
-#include <ctime>
-#include <cwchar>
-#include <spanstream>
-#include <stdexcept>
+#include <format>
+#include <iterator>
+#include <optional>
 #include <string>
 #include <string_view>
-#include <unordered_map>
 
 #include "date.hpp"
-#include <print>
+
+using namespace std::chrono_literals;
 
 /*
 * These are the timezones defined by the MEP2 protocol, problem is that
@@ -26,64 +26,210 @@
 * One could argue that this is actually a privacy improvement, however.
 */
 
-static const std::unordered_map<std::string_view, std::string> mep2_to_iana = {
+struct Mep2Zone {
+    std::string_view name;
+    std::chrono::minutes offset;
+};
+
+static constexpr auto mep2_zones = std::to_array<Mep2Zone>({
     // clang-format off
     // MEP2 timezones
-    {"AHS", "Etc/GMT+10"}, {"AHD", "Etc/GMT+9"}, 
-    {"YST", "Etc/GMT+9"},  {"YDT", "Etc/GMT+8"},
-    {"PST", "Etc/GMT+8"},  {"PDT", "Etc/GMT+7"}, 
-    {"MST", "Etc/GMT+7"},  {"MDT", "Etc/GMT+6"},
-    {"CST", "Etc/GMT+6"},  {"CDT", "Etc/GMT+5"}, 
-    {"EST", "Etc/GMT+5"},  {"EDT", "Etc/GMT+4"},
-    {"AST", "Etc/GMT+4"},  {"GMT", "Etc/GMT"},   
-    {"BST", "Etc/GMT-1"},  {"WES", "Etc/GMT-1"},
-    {"WED", "Etc/GMT-2"},  {"EMT", "Etc/GMT-2"}, 
-    {"MTS", "Etc/GMT-3"},  {"MTD", "Etc/GMT-4"},
-    {"JST", "Etc/GMT-9"},  {"EAD", "Etc/GMT-10"},
-    
+    {"AHS", -10h}, {"AHD", -9h},
+    {"YST", -9h},  {"YDT", -8h},
+    {"PST", -8h},  {"PDT", -7h},
+    {"MST", -7h},  {"MDT", -6h},
+    {"CST", -6h},  {"CDT", -5h},
+    {"EST", -5h},  {"EDT", -4h},
+    {"AST", -4h},  {"GMT", 0h},
+    {"BST", 1h},   {"WES", 1h},
+    {"WED", 2h},   {"EMT", 2h},
+    {"MTS", 3h},   {"MTD", 4h},
+    {"JST", 9h},   {"EAD", 10h},
+
     // Sierra Solutions Mailroom timezones (TIMEZONES.TXT)
-    {"AKT", "Etc/GMT+9"}, {"HST", "Etc/GMT+10"},
-    {"MST", "Etc/GMT-3"}, {"SNG", "Etc/GMT-8"},
+    // Their MST clashes with the MEP2 one, the first entry wins.
+    {"AKT", -9h}, {"HST", -10h},
+    {"MST", 3h},  {"SNG", 8h},
     // clang-format on
-};
+});
+
+static_assert(mep2_zones.size() <= UINT8_MAX);
+
+static constexpr std::array<std::string_view, 7> weekday_names = {"sun", "mon", "tue", "wed",
+                                                                  "thu", "fri", "sat"};
+static constexpr std::array<std::string_view, 12> month_names = {
+    "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec"};
+
+static constexpr std::array<std::string_view, 2> am_pm_names = {"am", "pm"};
+
+static constexpr std::optional<uint8_t> find_zone(std::string_view zone) {
+    for (size_t i = 0; i < mep2_zones.size(); ++i) {
+        if (mep2_zones[i].name == zone) {
+            return i;
+        }
+    }
+
+    return std::nullopt;
+}
+
+static_assert(mep2_zones[*find_zone("MST")].offset == -7h);
+
+// Case insensitive lookup of a name as long as the field
+template <size_t N>
+static constexpr std::optional<unsigned> find_name(std::string_view field,
+                                                   const std::array<std::string_view, N>& names) {
+    for (size_t i = 0; i < N; ++i) {
+        bool match = field.size() == names[i].size();
+        for (size_t j = 0; match && j < field.size(); ++j) {
+            char c = field[j];
+            if (c >= 'A' && c <= 'Z') {
+                c += 'a' - 'A';
+            }
+
+            if (c != names[i][j]) {
+                match = false;
+                break;
+            }
+        }
+
+        if (match) {
+            return i;
+        }
+    }
+
+    return std::nullopt;
+}
+
+// Fixed width number, a leading space is allowed where the field may be
+// padded rather than zero filled
+static constexpr std::optional<unsigned> parse_number(std::string_view field, bool space_padded) {
+    unsigned value = 0;
+    for (size_t i = 0; i < field.length(); ++i) {
+        char c = field[i];
+        if (space_padded && i == 0 && c == ' ') {
+            continue;
+        }
+
+        if (c < '0' || c > '9') {
+            return std::nullopt;
+        }
+
+        value = value * 10 + (c - '0');
+    }
+
+    return value;
+}
+
+static constexpr bool is_separator(char c) { return c == ' ' || c == '\t'; }
 
-void Date::parse(std::string_view line) {
+static std::unexpected<PduError> date_parse_error(std::string_view line, size_t position) {
+    return pdu_error(
+        Mep2ErrorCode::Malformed_Data,
+        std::format("Failed to parse date and time at position: {} data: '{}'", position, line));
+}
+
+PduResult<void> Date::parse(std::string_view line) {
+    // Dates are always in the form of:
+    // Sun Aug 11, 2024 12:00 AM GMT
+    // 0123456789012345678901234567
     if (line.length() != 29) {
-        throw std::invalid_argument("Failed to parse date and time");
+        return pdu_error(Mep2ErrorCode::Malformed_Data, "Failed to parse date and time");
+    }
+
+    for (size_t position : {3, 7, 11, 16, 22, 25}) {
+        if (!is_separator(line[position])) {
+            return date_parse_error(line, position);
+        }
+    }
+
+    if (line[10] != ',') {
+        return date_parse_error(line, 10);
+    }
+
+    if (line[19] != ':') {
+        return date_parse_error(line, 19);
+    }
+
+    auto weekday = find_name(line.substr(0, 3), weekday_names);
+    if (!weekday) {
+        return date_parse_error(line, 0);
+    }
+
+    auto month = find_name(line.substr(4, 3), month_names);
+    if (!month) {
+        return date_parse_error(line, 4);
+    }
+
+    auto day = parse_number(line.substr(8, 2), true);
+    if (!day) {
+        return date_parse_error(line, 8);
     }
 
-    std::ispanstream ss{line};
-    std::chrono::local_time<std::chrono::seconds> tp;
+    auto year = parse_number(line.substr(12, 4), false);
+    if (!year) {
+        return date_parse_error(line, 12);
+    }
 
-    ss >> std::chrono::parse("%a %B %2d, %4Y %2I:%2M %p", tp);
+    auto hour = parse_number(line.substr(17, 2), true);
+    if (!hour || *hour < 1 || *hour > 12) {
+        return date_parse_error(line, 17);
+    }
 
-    if (ss.fail()) {
-        ss.clear();
-        throw std::invalid_argument(
-            std::format("Failed to parse date and time at position: {} data: '{}'",
-                        std::to_string(ss.tellg()), line));
+    auto minute = parse_number(line.substr(20, 2), false);
+    if (!minute || *minute > 59) {
+        return date_parse_error(line, 20);
     }
 
-    std::string_view zone = line.substr(26);
-    auto zp = mep2_to_iana.find(zone);
-    if (zp == mep2_to_iana.end()) {
-        throw std::invalid_argument(std::format("Invalid timezone specifier {}", zone));
+    auto am_pm = find_name(line.substr(23, 2), am_pm_names);
+    if (!am_pm) {
+        return date_parse_error(line, 23);
     }
+    const bool pm = *am_pm == 1;
 
-    _orig_zone = std::string(zone);
-    auto lt = std::chrono::local_time<std::chrono::minutes>{
-        std::chrono::duration_cast<std::chrono::minutes>(tp.time_since_epoch())};
+    std::string_view zone_name = line.substr(26);
+    auto zone = find_zone(zone_name);
+    if (!zone) {
+        return pdu_error(Mep2ErrorCode::Malformed_Data,
+                         std::format("Invalid timezone specifier {}", zone_name));
+    }
 
-    _zone_time = std::chrono::zoned_time{zp->second, lt};
-    _gmt_time = std::chrono::zoned_time{"Etc/GMT", _zone_time};
+    std::chrono::year_month_day ymd{std::chrono::year(*year), std::chrono::month(*month + 1),
+                                    std::chrono::day(*day)};
+    if (!ymd.ok()) {
+        return date_parse_error(line, 8);
+    }
+
+    std::chrono::sys_days days{ymd};
+    if (std::chrono::weekday(days) != std::chrono::weekday(*weekday)) {
+        return date_parse_error(line, 0);
+    }
+
+    // 12 AM is midnight, 12 PM is noon
+    std::chrono::hours hours{*hour % 12 + (pm ? 12 : 0)};
+    std::chrono::minutes local = days.time_since_epoch() + hours + std::chrono::minutes(*minute);
+
+    _orig_zone = *zone;
+    _gmt_time = std::chrono::sys_seconds{local - mep2_zones[*zone].offset};
+    return {};
 }
 
+std::string_view Date::zone_name() const { return mep2_zones[_orig_zone].name; }
+
+std::chrono::minutes Date::zone_offset() const { return mep2_zones[_orig_zone].offset; }
+
 const std::string Date::to_gmt_string() const {
     return std::format("{:%a %b %d, %Y %I:%M %p GMT}", _gmt_time);
 }
 
 const std::string Date::to_orig_string() const {
-    return std::format("{:%a %b %d, %Y %I:%M %p} {}", _zone_time, _orig_zone);
+    std::string out;
+    format_orig_to(out);
+    return out;
+}
+
+void Date::format_orig_to(std::string& out) const {
+    std::chrono::local_seconds local{_gmt_time.time_since_epoch() + zone_offset()};
+    std::format_to(std::back_inserter(out), "{:%a %b %d, %Y %I:%M %p} {}", local, zone_name());
 }
 
 bool Date::operator==(const Date& rhs) const {
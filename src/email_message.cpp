@@ -0,0 +1,174 @@
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "email_message.hpp"
+
+using folder_id = QueryPdu::folder_id;
+using priority_id = EnvelopeHeaderPdu::priority_id;
+
+static_assert(static_cast<uint16_t>(EmailRecord::Folder::OUTBOX) ==
+              static_cast<uint16_t>(folder_id::outbox));
+static_assert(static_cast<uint16_t>(EmailRecord::Folder::TRASH) ==
+              static_cast<uint16_t>(folder_id::trash));
+static_assert(static_cast<uint16_t>(EmailRecord::Priority::ONITE) ==
+              static_cast<uint16_t>(priority_id::onite));
+
+// Only ever given whole strings, which are NUL terminated
+static capnp::Text::Reader to_text(std::string_view str) {
+    return capnp::Text::Reader(str.data(), str.size());
+}
+
+static void build_address(RecordAddress::Builder record, const RawAddress& address) {
+    record.setName(to_text(address._name));
+    record.setId(to_text(address._id));
+    record.setOrganization(to_text(address._organization));
+    record.setLocation(to_text(address._location));
+    record.setUnresolvedOrgLoc1(to_text(address._unresolved_org_loc_1));
+    record.setUnresolvedOrgLoc2(to_text(address._unresolved_org_loc_2));
+    record.setAlert(to_text(address._alert));
+    record.setEms(to_text(address._ems));
+
+    auto mbx = record.initMbx(address._mbx.size());
+    for (size_t i = 0; i < address._mbx.size(); ++i) {
+        mbx.set(i, to_text(address._mbx[i]));
+    }
+
+    record.setHasOptions(address._has_options);
+    record.setBoard(address._board);
+    record.setInstant(address._instant);
+    record.setList(address._list);
+    record.setOwner(address._owner);
+    record.setOnite(address._onite);
+    record.setPrint(address._print);
+    record.setReceipt(address._receipt);
+    record.setNoReceipt(address._no_receipt);
+}
+
+static void build_address(RecordAddress::Builder record, const PackedAddress& address) {
+    record.setName(to_text(address.name()));
+    record.setId(to_text(address.id()));
+    record.setOrganization(to_text(address.organization()));
+    record.setLocation(to_text(address.location()));
+    record.setUnresolvedOrgLoc1(to_text(address.unresolved_org_loc_1()));
+    record.setUnresolvedOrgLoc2(to_text(address.unresolved_org_loc_2()));
+    record.setAlert(to_text(address.alert()));
+    record.setEms(to_text(address.ems()));
+
+    auto mbx = record.initMbx(address.mbx_count());
+    for (size_t i = 0; i < address.mbx_count(); ++i) {
+        mbx.set(i, to_text(address.mbx(i)));
+    }
+
+    const AddressOptions options = address.options();
+    record.setHasOptions(options.has_options);
+    record.setBoard(options.board);
+    record.setInstant(options.instant);
+    record.setList(options.list);
+    record.setOwner(options.owner);
+    record.setOnite(options.onite);
+    record.setPrint(options.print);
+    record.setReceipt(options.receipt);
+    record.setNoReceipt(options.no_receipt);
+}
+
+static void build_addresses(capnp::List<RecordAddress>::Builder record,
+                            const std::vector<PackedAddress>& addresses) {
+    for (size_t i = 0; i < addresses.size(); ++i) {
+        build_address(record[i], addresses[i]);
+    }
+}
+
+static std::vector<PackedAddress> pack_addresses(const std::pmr::vector<RawAddress>& addresses) {
+    return std::vector<PackedAddress>(addresses.begin(), addresses.end());
+}
+
+static void build_date(RecordDate::Builder record, const Date& date) {
+    record.setGmtSeconds(date._gmt_time.time_since_epoch().count());
+    record.setZone(date._orig_zone);
+}
+
+void MessageMetadata::set_envelope(const EnvPdu& env) {
+    envelope = env;
+    envelope->clear_recipients();
+    to = pack_addresses(env.get_to_address());
+    cc = pack_addresses(env.get_cc_address());
+
+    from = env.has_from_address() ? std::string(env.get_from_address()._name) : std::string();
+    subject = env.has_subject() ? std::string(env.get_subject()) : std::string();
+    date = env.has_date() ? env.get_date()._gmt_time : std::chrono::sys_seconds();
+}
+
+void EmailMessage::build(EmailRecord::Builder record, const MessageMetadata& metadata) {
+    record.setFolder(static_cast<EmailRecord::Folder>(metadata.folder));
+    record.setSize(metadata.size);
+
+    if (!metadata.envelope) {
+        record.initFrom().setName(to_text(metadata.from));
+        record.setSubject(to_text(metadata.subject));
+        record.initDate().setGmtSeconds(metadata.date.time_since_epoch().count());
+        return;
+    }
+
+    const EnvPdu& env = *metadata.envelope;
+    record.setPriority(static_cast<EmailRecord::Priority>(env.get_priority_id()));
+
+    if (env.has_from_address()) {
+        build_address(record.initFrom(), env.get_from_address());
+    }
+    build_addresses(record.initTo(metadata.to.size()), metadata.to);
+    build_addresses(record.initCc(metadata.cc.size()), metadata.cc);
+
+    if (env.has_date()) {
+        build_date(record.initDate(), env.get_date());
+    }
+    if (env.has_source_date()) {
+        build_date(record.initSourceDate(), env.get_source_date());
+    }
+    if (env.has_subject()) {
+        record.setSubject(to_text(env.get_subject()));
+    }
+    if (env.has_message_id()) {
+        record.setMessageId(to_text(env.get_message_id()));
+    }
+
+    const auto& source_ids = env.get_source_message_id();
+    auto source_ids_record = record.initSourceMessageIds(source_ids.size());
+    for (size_t i = 0; i < source_ids.size(); ++i) {
+        source_ids_record.set(i, to_text(source_ids[i]));
+    }
+
+    const auto& u_fields = env.get_u_fields();
+    auto u_fields_record = record.initUFields(u_fields.size());
+    for (size_t i = 0; i < u_fields.size(); ++i) {
+        u_fields_record[i].setName(to_text(u_fields[i].first));
+        u_fields_record[i].setValue(to_text(u_fields[i].second));
+    }
+
+    // Records are built on the store's blocking pool, each of its threads
+    // renders into a buffer of its own
+    static thread_local std::string header;
+    header.clear();
+    env.format_to(header, metadata.to, metadata.cc);
+    record.setHeader(to_text(header));
+}
+
+EmailMessage::EmailMessage(std::string_view record)
+    : _reader(kj::arrayPtr(reinterpret_cast<const capnp::word*>(record.data()),
+                           record.size() / sizeof(capnp::word))),
+      _record(_reader.getRoot<EmailRecord>()) {}
+
+folder_id EmailMessage::folder() const { return static_cast<folder_id>(_record.getFolder()); }
+
+std::string_view EmailMessage::from() const {
+    return to_string_view(_record.getFrom().getName());
+}
+
+std::string_view EmailMessage::subject() const { return to_string_view(_record.getSubject()); }
+
+std::string_view EmailMessage::header() const { return to_string_view(_record.getHeader()); }
+
+std::chrono::sys_seconds EmailMessage::date() const {
+    return std::chrono::sys_seconds(std::chrono::seconds(_record.getDate().getGmtSeconds()));
+}
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+
+#include <kj/io.h>
+
+#include "mail_index.hpp"
+#include "string_utils.hpp"
+
+using folder_id = QueryPdu::folder_id;
+
+static void append_be(std::string& out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+// Flips the sign bit so dates before the epoch sort first
+static uint64_t date_bits(std::chrono::sys_seconds date) {
+    return static_cast<uint64_t>(date.time_since_epoch().count()) ^ (1ULL << 63);
+}
+
+static std::string folder_key(folder_id folder) {
+    return std::string(1, static_cast<char>(folder));
+}
+
+// The first key past every key of folder
+static std::string folder_end(folder_id folder) {
+    return std::string(1, static_cast<char>(static_cast<uint8_t>(folder) + 1));
+}
+
+static std::string text_key(folder_id folder, std::string_view text) {
+    std::string key = folder_key(folder);
+    text = text.substr(0, MailIndex::max_text_key);
+    std::ranges::transform(text, std::back_inserter(key), lower);
+    return key;
+}
+
+static std::string number_key(folder_id folder, uint64_t value) {
+    std::string key = folder_key(folder);
+    append_be(key, value, 8);
+    return key;
+}
+
+static std::string to_lower(std::string_view sv) {
+    std::string result(sv);
+    std::ranges::transform(result, result.begin(), lower);
+    return result;
+}
+
+MessageQuery MessageQuery::from_pdu(const QueryPdu& pdu) {
+    return MessageQuery{
+        .folder = pdu.get_folder_id(),
+        .from = to_lower(pdu.get_from()),
+        .subject = to_lower(pdu.get_subject()),
+        .min_size = pdu.get_min_size(),
+        .max_size = pdu.get_max_size(),
+        .before = pdu.get_before(),
+        .after = pdu.get_after(),
+    };
+}
+
+bool MessageQuery::matches(const EmailMessage& message) const {
+    const size_t size = message.size();
+    const std::chrono::sys_seconds date = message.date();
+
+    return message.folder() == folder && icompare(message.from(), from) &&
+           icompare(message.subject(), subject) && (!min_size || size >= *min_size) &&
+           (!max_size || size <= *max_size) && (!after || date > *after) &&
+           (!before || date < *before);
+}
+
+void MailIndex::open(lmdb::txn& txn) {
+    _main = lmdb::dbi::open(txn, "main", MDB_CREATE);
+    _from = lmdb::dbi::open(txn, "from_index", MDB_CREATE | MDB_DUPSORT);
+    _subjects = lmdb::dbi::open(txn, "subject_index", MDB_CREATE | MDB_DUPSORT);
+    _dates = lmdb::dbi::open(txn, "date_index", MDB_CREATE | MDB_DUPSORT);
+    _sizes = lmdb::dbi::open(txn, "size_index", MDB_CREATE | MDB_DUPSORT);
+}
+
+void MailIndex::insert(lmdb::txn& txn, std::string_view filename,
+                       const MessageMetadata& metadata) {
+    capnp::MallocMessageBuilder builder(EmailMessage::first_segment_words);
+    EmailMessage::build(builder.initRoot<EmailRecord>(), metadata);
+
+    // Serialize straight into the space LMDB sets aside for the record
+    const MDB_val key{filename.size(), const_cast<char*>(filename.data())};
+    MDB_val value{capnp::computeSerializedSizeInWords(builder) * sizeof(capnp::word), nullptr};
+    lmdb::dbi_put(txn, _main.handle(), &key, &value, MDB_RESERVE);
+
+    kj::ArrayOutputStream output(
+        kj::arrayPtr(static_cast<kj::byte*>(value.mv_data), value.mv_size));
+    capnp::writeMessage(output, builder);
+
+    // Nobody can search for an empty field, leave those out
+    if (!metadata.from.empty()) {
+        _from.put(txn, text_key(metadata.folder, metadata.from), filename);
+    }
+    if (!metadata.subject.empty()) {
+        _subjects.put(txn, text_key(metadata.folder, metadata.subject), filename);
+    }
+    _dates.put(txn, number_key(metadata.folder, date_bits(metadata.date)), filename);
+    _sizes.put(txn, number_key(metadata.folder, metadata.size), filename);
+}
+
+std::vector<std::string> MailIndex::query(lmdb::txn& txn, const MessageQuery& query) {
+    // Keys from low, either up to but not including high or for as long as
+    // they start with low
+    lmdb::dbi* dbi = nullptr;
+    std::string low;
+    std::string high;
+    bool prefix = false;
+
+    // Whatever the chosen range doesn't take care of is checked against the
+    // main record
+    MessageQuery rest = query;
+
+    auto text_range = [&](lmdb::dbi& index, std::string& field) {
+        dbi = &index;
+        low = text_key(query.folder, field);
+        prefix = true;
+        // A truncated key only narrows things down
+        if (field.size() <= max_text_key) {
+            field.clear();
+        }
+    };
+
+    auto date_range = [&] {
+        dbi = &_dates;
+        low = number_key(query.folder, query.after ? date_bits(*query.after) + 1 : 0);
+        high = query.before ? number_key(query.folder, date_bits(*query.before))
+                            : folder_end(query.folder);
+        rest.after.reset();
+        rest.before.reset();
+    };
+
+    auto size_range = [&] {
+        constexpr uint64_t limit = std::numeric_limits<uint64_t>::max();
+
+        dbi = &_sizes;
+        low = number_key(query.folder, query.min_size.value_or(0));
+        high = query.max_size && *query.max_size < limit
+                   ? number_key(query.folder, *query.max_size + 1)
+                   : folder_end(query.folder);
+        rest.min_size.reset();
+        rest.max_size.reset();
+    };
+
+    // Senders and subjects tend to be far more selective than a window of
+    // dates or sizes, and a bounded window more so than an open ended one.
+    if (!query.from.empty()) {
+        text_range(_from, rest.from);
+    } else if (!query.subject.empty()) {
+        text_range(_subjects, rest.subject);
+    } else if (query.after && query.before) {
+        date_range();
+    } else if (query.min_size && query.max_size) {
+        size_range();
+    } else if (query.after || query.before || !(query.min_size || query.max_size)) {
+        // Without any filter this lists the whole folder in date order
+        date_range();
+    } else {
+        size_range();
+    }
+
+    const bool check_record = !rest.from.empty() || !rest.subject.empty() || rest.min_size ||
+                              rest.max_size || rest.before || rest.after;
+
+    std::vector<std::string> filenames;
+    auto cursor = lmdb::cursor::open(txn, *dbi);
+
+    std::string_view key = low;
+    std::string_view filename;
+    for (bool found = cursor.get(key, filename, MDB_SET_RANGE); found;
+         found = cursor.get(key, filename, MDB_NEXT)) {
+        if (prefix ? !key.starts_with(low) : key >= high) {
+            break;
+        }
+
+        if (check_record) {
+            bool matches = false;
+            try {
+                read(txn, filename, [&](const EmailMessage& message) {
+                    matches = rest.matches(message);
+                });
+            } catch (const kj::Exception&) {
+                // A damaged record doesn't match anything
+            }
+
+            if (!matches) {
+                continue;
+            }
+        }
+
+        filenames.emplace_back(filename);
+    }
+
+    return filenames;
+}
+
+size_t MailIndex::size(lmdb::txn& txn) { return _main.stat(txn).ms_entries; }
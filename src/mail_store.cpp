@@ -1,15 +1,27 @@
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
 #include <cerrno>
+#include <cstring>
 #include <filesystem>
+#include <format>
 #include <print>
 #include <random>
+#include <stdexcept>
 #include <string_view>
+#include <vector>
 
 #include <asio/use_awaitable.hpp>
 
+#include "async_utils.hpp"
 #include "mail_store.hpp"
+#include "mep2_errors.hpp"
+#include "metrics.hpp"
 #include "string_utils.hpp"
 
 using asio::use_awaitable;
@@ -27,23 +39,45 @@ static std::string generate_filename(int length) {
     return result;
 }
 
+struct MailStore::CommitBatch {
+    CommitBatch(asio::io_context& io_service)
+        : done(io_service, asio::steady_timer::time_point::max()) {}
+
+    std::vector<MailStoreFile*> files;
+    // errno value for each file, 0 if it was committed
+    std::vector<int> errors;
+    // Files linked under their final name, taken away again if the batch
+    // fails before it is indexed
+    std::vector<bool> published;
+    bool indexed{false};
+    // Cancelled once the batch is committed, which wakes all its waiters
+    asio::steady_timer done;
+};
+
 MailStore::MailStore(asio::io_context& io_service, const std::string&& path, size_t max_size)
-    : _io_service(io_service), _path(path), _tmp_path(_path / "tmp"), _max_size(max_size),
-      _db_env(lmdb::env::create()) {
+    : MailStore(io_service, std::move(path), MailStoreOptions{.max_size = max_size}) {}
+
+MailStore::MailStore(asio::io_context& io_service, const std::string&& path,
+                     const MailStoreOptions& options)
+    : _io_service(io_service), _blocking_pool(std::max<size_t>(options.blocking_threads, 1)),
+      _path(path), _tmp_path(_path / "tmp"), _options(options), _db_env(lmdb::env::create()) {
 
     // MIGHT BLOCK
     std::filesystem::create_directories(_tmp_path);
     std::filesystem::create_directories(_path / "db");
 
-    _db_env.set_mapsize(1UL * 1024UL * 1024UL * 1024UL);
-    _db_env.set_max_dbs(5);
-    _db_env.open((_path / "db").c_str(), 0, 0664);
+    _db_env.set_mapsize(_options.map_size);
+    _db_env.set_max_dbs(8);
+    _db_env.set_max_readers(_options.max_readers);
+    _db_env.open((_path / "db").c_str(), MDB_NOTLS, 0664);
+
+    // A process that died mid-read would otherwise keep its reader slots
+    _db_env.reader_check();
 
     // Open databases
     auto txn = lmdb::txn::begin(_db_env);
     try {
-        _db_main = lmdb::dbi::open(txn, "main", MDB_CREATE);
-        _db_subjects = lmdb::dbi::open(txn, "subject_index", MDB_CREATE | MDB_DUPSORT);
+        _index.open(txn);
         txn.commit();
     } catch (const lmdb::error& e) {
         txn.abort();
@@ -51,122 +85,351 @@ MailStore::MailStore(asio::io_context& io_service, const std::string&& path, siz
     }
 }
 
+MailStore::~MailStore() {
+    // Let any unlinks of abandoned files finish
+    _blocking_pool.join();
+}
+
+bool MailStore::ReadTxn::holds_map_lock(const MailStore& store) {
+    for (const ReadTxn* txn = _innermost; txn; txn = txn->_outer) {
+        if (&txn->_store == &store) {
+            return true;
+        }
+    }
+    return false;
+}
+
+MailStore::ReadTxn::ReadTxn(MailStore& store)
+    : _store(store), _outer(_innermost),
+      _map_lock(holds_map_lock(store) ? std::shared_lock<std::shared_mutex>()
+                                      : std::shared_lock<std::shared_mutex>(store._map_mutex)),
+      _txn(store.begin_read()) {
+    _innermost = this;
+}
+
+MailStore::ReadTxn::~ReadTxn() {
+    _innermost = _outer;
+    _txn.reset();
+
+    std::lock_guard lock(_store._read_txns_mutex);
+    if (_store._read_txns.size() < _store._options.read_txn_cache) {
+        _store._read_txns.push_back(std::move(_txn));
+    }
+    // Otherwise the transaction is aborted and its slot freed
+}
+
+lmdb::txn MailStore::begin_read() {
+    {
+        std::lock_guard lock(_read_txns_mutex);
+        if (!_read_txns.empty()) {
+            lmdb::txn txn = std::move(_read_txns.back());
+            _read_txns.pop_back();
+            txn.renew();
+            return txn;
+        }
+    }
+
+    try {
+        return lmdb::txn::begin(_db_env, nullptr, MDB_RDONLY);
+    } catch (const lmdb::runtime_error& e) {
+        if (e.code() != MDB_READERS_FULL) {
+            throw;
+        }
+    }
+
+    // Slots of readers that have died are only freed on request
+    if (!_db_env.reader_check()) {
+        throw std::runtime_error(std::format("Out of LMDB readers in {}", _path));
+    }
+
+    return lmdb::txn::begin(_db_env, nullptr, MDB_RDONLY);
+}
+
+size_t MailStore::map_size() {
+    MDB_envinfo info;
+    lmdb::env_info(_db_env, &info);
+    return info.me_mapsize;
+}
+
+bool MailStore::grow_map(size_t full_size) {
+    std::unique_lock lock(_map_mutex);
+
+    // Another writer got here first
+    size_t size = map_size();
+    if (size != full_size) {
+        return true;
+    }
+
+    size_t grown = size * 2;
+    if (_options.max_map_size) {
+        grown = std::min(grown, _options.max_map_size);
+    }
+    if (grown <= size) {
+        return false;
+    }
+
+    _db_env.set_mapsize(grown);
+    return true;
+}
+
 // Might throw
-MailStoreFile MailStore::create_file() const {
+MailStoreFile MailStore::create_file() {
     const std::string filename = generate_filename(10);
     const std::filesystem::path tmp_path = _tmp_path / filename;
     const std::filesystem::path final_path = _path / filename;
 
-    return MailStoreFile(_io_service, filename, tmp_path, final_path, _max_size);
+#ifdef O_TMPFILE
+    if (_use_tmpfile) {
+        // The file has no name until close() links it into place, so there
+        // is nothing to clean up if we never get there
+        int fd = open(_path.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0664);
+        if (fd >= 0) {
+            return MailStoreFile(*this, fd, filename, final_path, _options.max_size);
+        }
+
+        if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+            throw std::runtime_error(
+                std::format("Error creating file in {}: {}", _path, strerror(errno)));
+        }
+
+        // Not supported by this filesystem, and it isn't going to start
+        _use_tmpfile = false;
+    }
+#endif
+
+    return MailStoreFile(*this, filename, tmp_path, final_path, _options.max_size);
 }
 
 // Might throw
-MailStoreFile MailStore::open_file(const std::string_view filename) const {
+MailStoreFile MailStore::open_file(const std::string_view filename) {
     const std::filesystem::path path = _path / filename;
 
-    return MailStoreFile(_io_service, filename, path);
+    return MailStoreFile(*this, filename, path);
 }
 
-MailStoreFile::MailStoreFile(asio::io_context& io_service, const std::string& filename,
-                             const std::filesystem::path& tmp_path,
-                             const std::filesystem::path& final_path, size_t max_size)
-    : _file(io_service, tmp_path,
-            asio::stream_file::write_only | asio::stream_file::create |
-                asio::stream_file::exclusive),
-      _filename(filename), _tmp_path(tmp_path), _final_path(final_path), _max_size(max_size),
-      _new{true} {}
+size_t MailStore::message_count() {
+    ReadTxn txn(*this);
+    return _index.size(txn.get());
+}
 
-MailStoreFile::MailStoreFile(asio::io_context& io_service, const std::string_view filename,
-                             const std::filesystem::path& path)
-    : _file(io_service, path, asio::stream_file::read_only), _filename(filename), _final_path(path),
-      _max_size{0}, _new{false} {}
+std::vector<std::string> MailStore::query(const MessageQuery& query) {
+    ReadTxn txn(*this);
+    return _index.query(txn.get(), query);
+}
+
+awaitable<void> MailStore::commit(MailStoreFile& file) {
+    // Only ever called from the store's own thread, so nothing can flush the
+    // batch between joining it and waiting on it
+    if (!_open_batch) {
+        _open_batch = std::make_shared<CommitBatch>(_io_service);
+        co_spawn(_io_service, flush(_open_batch), asio::detached);
+    }
+
+    std::shared_ptr<CommitBatch> batch = _open_batch;
+    size_t index = batch->files.size();
+    batch->files.push_back(&file);
 
-MailStoreFile::~MailStoreFile() {
     asio::error_code ec;
+    co_await batch->done.async_wait(asio::redirect_error(use_awaitable, ec));
 
-    if (_finished)
-        return;
+    if (int error = batch->errors[index]) {
+        throw std::runtime_error(
+            std::format("Error committing {}: {}", file._final_path, strerror(error)));
+    }
+}
 
-    if (_new) {
-        // MIGHT BLOCK
-        unlink(_tmp_path.c_str());
+awaitable<void> MailStore::flush(std::shared_ptr<CommitBatch> batch) {
+    asio::steady_timer window(_io_service, _options.commit_window);
+    asio::error_code ec;
+    co_await window.async_wait(asio::redirect_error(use_awaitable, ec));
+
+    // Files closing from here on go into the next batch
+    _open_batch.reset();
+
+    try {
+        co_await run_blocking(_blocking_pool, [this, &batch] {
+            try {
+                commit_batch(*batch);
+            } catch (...) {
+                // Anything, such as a kj::Exception from building a record
+                fail_batch(*batch, EIO);
+            }
+        });
+    } catch (...) {
+        fail_batch(*batch, EIO);
     }
 
-    ec = _file.close(ec);
-    _finished = true;
+    // Waiters must always be woken
+    batch->done.cancel();
 }
 
-struct Combined {
-    Combined(std::string_view first, std::string_view second) : _first(first), _second(second) {}
+void MailStore::fail_batch(CommitBatch& batch, int error_code) {
+    if (batch.indexed) {
+        return;
+    }
 
-    unsigned char operator[](size_t x) const {
-        if (x < _first.size()) {
-            return _first[x];
-        } else {
-            return _second[x - _first.size()];
+    batch.errors.resize(batch.files.size(), 0);
+    batch.published.resize(batch.files.size(), false);
+    for (size_t i = 0; i < batch.files.size(); ++i) {
+        // Left linked without an index entry a file would never be cleaned
+        // up, and the master sending it again would store a second copy
+        if (batch.published[i]) {
+            batch.files[i]->unpublish();
+            batch.published[i] = false;
+        }
+        if (!batch.errors[i]) {
+            batch.errors[i] = error_code;
         }
     }
+}
 
-    size_t size() const { return _first.size() + _second.size(); }
+void MailStore::commit_batch(CommitBatch& batch) {
+    batch.errors.assign(batch.files.size(), 0);
+    batch.published.assign(batch.files.size(), false);
 
-    std::string_view _first;
-    std::string_view _second;
-};
+    for (size_t i = 0; i < batch.files.size(); ++i) {
+        MailStoreFile& file = *batch.files[i];
+        int error = 0;
+        if (_options.durable && fdatasync(file._file.native_handle())) {
+            error = errno;
+        }
+
+        if (!error) {
+            error = file.publish();
+        }
+
+        batch.errors[i] = error;
+        batch.published[i] = !error;
+    }
 
-static std::string mep2_decode(std::string_view input, std::string& leftover) {
-    std::string result;
+    // One sync of the directory makes every new entry in it durable
+    if (_options.durable) {
+        int dir = open(_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir < 0 || fsync(dir)) {
+            const int error = errno;
+            if (dir >= 0) {
+                ::close(dir);
+            }
+            fail_batch(batch, error);
+            return;
+        }
 
-    Combined c(leftover, input);
+        ::close(dir);
+    }
 
-    size_t total_size = c.size();
-    size_t i = 0;
+    index_batch(batch);
+}
 
-    result.reserve(total_size);
+void MailStore::index_batch(CommitBatch& batch) {
+    for (;;) {
+        size_t full_size;
+        try {
+            std::shared_lock lock(_map_mutex);
+            full_size = map_size();
 
-    for (i = 0; i < total_size; ++i) {
-        if (c[i] == '%') {
-            if (i + 2 < total_size) {
-                // Check for transparent newline
-                if (c[i + 1] == '\r' && c[i + 2] == '\n') {
-                    i += 2; // Skip the transparent newline
+            auto txn = lmdb::txn::begin(_db_env);
+            for (size_t i = 0; i < batch.files.size(); ++i) {
+                if (batch.errors[i]) {
                     continue;
                 }
 
-                // Regular percent encoding
-                char decoded_char = (hex_to_char(c[i + 1]) << 4) | hex_to_char(c[i + 2]);
-                result.push_back(decoded_char);
-                i += 2;
-            } else {
-                // % encoded value, but not enough space
-                break;
+                MailStoreFile& file = *batch.files[i];
+                file._metadata.size = file._size;
+                _index.insert(txn, file._filename, file._metadata);
             }
-        } else {
-            result.push_back(c[i]);
+            txn.commit();
+            batch.indexed = true;
+            return;
+        } catch (const lmdb::map_full_error&) {
+            // The transaction is gone, redo it once there is room
+        } catch (const lmdb::error&) {
+            fail_batch(batch, EIO);
+            return;
+        }
+
+        if (!grow_map(full_size)) {
+            fail_batch(batch, ENOSPC);
+            return;
         }
     }
+}
 
-    std::string new_leftover;
-    for (size_t k = i; k < total_size; ++k) {
-        new_leftover.push_back(c[k]);
+MailStoreFile::MailStoreFile(MailStore& store, const std::string& filename,
+                             const std::filesystem::path& tmp_path,
+                             const std::filesystem::path& final_path, size_t max_size)
+    : _store(store), _file(store._io_service, tmp_path,
+                           asio::stream_file::write_only | asio::stream_file::create |
+                               asio::stream_file::exclusive),
+      _filename(filename), _tmp_path(tmp_path), _final_path(final_path), _max_size(max_size),
+      _new{true} {}
+
+MailStoreFile::MailStoreFile(MailStore& store, int fd, const std::string& filename,
+                             const std::filesystem::path& final_path, size_t max_size)
+    : _store(store), _file(store._io_service, fd), _filename(filename), _final_path(final_path),
+      _max_size(max_size), _new{true} {}
+
+MailStoreFile::MailStoreFile(MailStore& store, const std::string_view filename,
+                             const std::filesystem::path& path)
+    : _store(store), _file(store._io_service, path, asio::stream_file::read_only),
+      _filename(filename), _final_path(path), _max_size{0}, _new{false} {}
+
+MailStoreFile::~MailStoreFile() {
+    asio::error_code ec;
+
+    if (_finished)
+        return;
+
+    // An O_TMPFILE file simply disappears when closed
+    if (_new && !_tmp_path.empty()) {
+        // Nobody waits for this, the file was abandoned
+        asio::post(_store._blocking_pool, [tmp_path = _tmp_path] { unlink(tmp_path.c_str()); });
     }
 
-    leftover = std::move(new_leftover);
-    return result;
+    ec = _file.close(ec);
+    _finished = true;
+}
+
+void MailStoreFile::check_size(size_t length) const {
+    if (_max_size && _size + length > _max_size) {
+        throw InsufficientSpaceError(std::format("Message larger than {} bytes", _max_size));
+    }
 }
 
 awaitable<size_t> MailStoreFile::write(std::string_view sv) {
+    check_size(sv.size());
+
+    const auto started = metrics_clock::now();
     size_t size =
         co_await asio::async_write(_file, asio::buffer(sv.data(), sv.size()), use_awaitable);
+    _size += size;
+
+    // Whichever thread the write resumed on
+    Metrics::local().write_latency.observe(metrics_clock::now() - started);
     co_return size;
 }
 
 awaitable<size_t> MailStoreFile::write_encoded(std::string_view sv) {
-    std::string decoded = mep2_decode(sv, _leftover);
-    // size_t size =
-    co_await asio::async_write(_file, asio::dynamic_buffer(decoded), use_awaitable);
+    _decoder.decode(sv, _decoded);
+    check_size(_decoded.size());
+
+    const auto started = metrics_clock::now();
+    _size += co_await asio::async_write(_file, asio::buffer(_decoded), use_awaitable);
+
+    ThreadMetrics& metrics = Metrics::local();
+    metrics.write_latency.observe(metrics_clock::now() - started);
+    metrics.bytes_decoded.add(sv.size());
     co_return sv.size();
 }
 
+awaitable<void> MailStoreFile::write_text(std::string_view text) {
+    try {
+        co_await write_encoded(text);
+    } catch (const std::invalid_argument& e) {
+        // From the decoder, the master sent a bad % code
+        throw PduMalformedDataError(e.what());
+    }
+}
+
 awaitable<std::string> MailStoreFile::read(size_t size) {
     asio::error_code ec;
     std::string data;
@@ -183,29 +446,144 @@ awaitable<std::string> MailStoreFile::read(size_t size) {
     co_return data;
 }
 
-bool MailStoreFile::close() {
+void MailStoreFile::Unmap::operator()(const char* map) const {
+    munmap(const_cast<char*>(map), length);
+}
+
+size_t MailStoreFile::file_length() {
+    struct stat st;
+    if (fstat(_file.native_handle(), &st)) {
+        throw std::runtime_error(std::format("Error reading {}: {}", _final_path, strerror(errno)));
+    }
+
+    return st.st_size;
+}
+
+std::string_view MailStoreFile::view() {
+    if (_map) {
+        return std::string_view(_map.get(), _map.get_deleter().length);
+    }
+
+    const size_t length = file_length();
+    if (length == 0) {
+        // Nothing to map
+        return std::string_view();
+    }
+
+    void* map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, _file.native_handle(), 0);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error(std::format("Error mapping {}: {}", _final_path, strerror(errno)));
+    }
+
+    // Read front to back, and have the kernel start on it now rather than
+    // fault it in a page at a time
+    madvise(map, length, MADV_SEQUENTIAL);
+    madvise(map, length, MADV_WILLNEED);
+
+    _map = std::unique_ptr<const char, Unmap>(static_cast<const char*>(map), Unmap{length});
+    return std::string_view(_map.get(), length);
+}
+
+awaitable<size_t> MailStoreFile::send_encoded(asio::ip::tcp::socket& socket) {
+    std::string_view data = view();
+    std::array<char, send_chunk_size> chunk;
+    size_t sent = 0;
+
+    while (!data.empty()) {
+        size_t length = _encoder.encode(data, chunk);
+        sent += co_await asio::async_write(socket, asio::buffer(chunk.data(), length),
+                                           use_awaitable);
+    }
+
+    Metrics::local().bytes_encoded.add(sent);
+    co_return sent;
+}
+
+awaitable<size_t> MailStoreFile::send_raw(asio::ip::tcp::socket& socket) {
+    const size_t length = file_length();
+    off_t offset = 0;
+
+    // sendfile() must not block the io_context, wait for room instead
+    socket.native_non_blocking(true);
+
+    while (static_cast<size_t>(offset) < length) {
+        ssize_t sent = sendfile(socket.native_handle(), _file.native_handle(), &offset,
+                                length - offset);
+        if (sent > 0) {
+            continue;
+        }
+
+        if (sent == 0) {
+            // The file is shorter than it was a moment ago
+            break;
+        }
+
+        if (errno == EAGAIN) {
+            co_await socket.async_wait(asio::socket_base::wait_write, use_awaitable);
+        } else if (errno != EINTR) {
+            throw asio::system_error(asio::error_code(errno, asio::error::get_system_category()));
+        }
+    }
+
+    co_return offset;
+}
+
+int MailStoreFile::link_anonymous(int fd, const std::string& final_path) {
+#ifdef O_TMPFILE
+    if (!linkat(fd, "", AT_FDCWD, final_path.c_str(), AT_EMPTY_PATH)) {
+        return 0;
+    }
+
+    // AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, going through /proc doesn't
+    if (errno != ENOENT && errno != EPERM) {
+        return errno;
+    }
+
+    const std::string proc_path = std::format("/proc/self/fd/{}", fd);
+    if (!linkat(AT_FDCWD, proc_path.c_str(), AT_FDCWD, final_path.c_str(), AT_SYMLINK_FOLLOW)) {
+        return 0;
+    }
+
+    return errno;
+#else
+    return ENOTSUP;
+#endif
+}
+
+int MailStoreFile::publish() {
+    if (_tmp_path.empty()) {
+        return link_anonymous(_file.native_handle(), _final_path);
+    }
+
+    if (link(_tmp_path.c_str(), _final_path.c_str())) {
+        return errno;
+    }
+
+    unlink(_tmp_path.c_str());
+    return 0;
+}
+
+void MailStoreFile::unpublish() { unlink(_final_path.c_str()); }
+
+awaitable<bool> MailStoreFile::close() {
     asio::error_code ec;
 
     if (_finished)
-        return true;
+        co_return true;
 
     if (_new) {
-        // MIGHT BLOCK
-        if (link(_tmp_path.c_str(), _final_path.c_str())) {
-            throw std::runtime_error(
-                std::format("Error linking {}: {}", _final_path, strerror(errno)));
-        }
-
-        // MIGHT BLOCK
-        unlink(_tmp_path.c_str());
+        const auto started = metrics_clock::now();
+        co_await _store.commit(*this);
+        Metrics::local().commit_latency.observe(metrics_clock::now() - started);
     }
 
+    _map.reset();
     ec = _file.close(ec);
     if (ec) {
-        return false;
+        co_return false;
     }
 
     _finished = true;
 
-    return true;
+    co_return true;
 }
@@ -0,0 +1,122 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <format>
+#include <print>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <asio.hpp>
+
+#include "batch_import.hpp"
+#include "mail_store.hpp"
+
+using asio::awaitable;
+
+// A transcript mapped read only for as long as it is imported
+class MappedFile {
+  public:
+    explicit MappedFile(const char* path) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error(std::format("Error opening {}: {}", path, strerror(errno)));
+        }
+
+        struct stat st;
+        if (fstat(fd, &st)) {
+            const int error = errno;
+            close(fd);
+            throw std::runtime_error(std::format("Error reading {}: {}", path, strerror(error)));
+        }
+
+        _length = st.st_size;
+        if (_length) {
+            _map = mmap(nullptr, _length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        const int error = errno;
+        close(fd);
+        if (_map == MAP_FAILED) {
+            throw std::runtime_error(std::format("Error mapping {}: {}", path, strerror(error)));
+        }
+
+        // Split front to back, parsed in whichever order the pool gets to it
+        if (_length) {
+            madvise(_map, _length, MADV_WILLNEED);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (_length) {
+            munmap(_map, _length);
+        }
+    }
+
+    std::string_view view() const {
+        return _length ? std::string_view(static_cast<const char*>(_map), _length)
+                       : std::string_view();
+    }
+
+  private:
+    void* _map{nullptr};
+    size_t _length{0};
+};
+
+static awaitable<bool> import_files(MailStore& store, int count, char** paths) {
+    bool ok = true;
+
+    for (int i = 0; i < count; ++i) {
+        MappedFile transcript(paths[i]);
+        ImportResult result = co_await import_transcript(store, transcript.view());
+
+        for (const auto& [index, error] : result.failed) {
+            std::println(stderr, "{}: message {}: {}", paths[i], index, error.message());
+        }
+        std::println("{}: imported {} messages, {} failed", paths[i], result.imported,
+                     result.failed.size());
+        ok = ok && result.failed.empty();
+    }
+
+    co_return ok;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::println(stderr, "Usage: {} <store path> <transcript>...", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    asio::io_context io_context(1);
+    int status = EXIT_FAILURE;
+
+    try {
+        // Historic mail is taken whatever its size. Messages are parsed on
+        // the store's blocking pool, sized to keep every core busy.
+        MailStore store(io_context, argv[1],
+                        MailStoreOptions{.blocking_threads = std::thread::hardware_concurrency()});
+
+        asio::co_spawn(io_context, import_files(store, argc - 2, argv + 2),
+                       [&status](std::exception_ptr e, bool ok) {
+                           if (e) {
+                               std::rethrow_exception(e);
+                           }
+                           status = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+                       });
+        io_context.run();
+    } catch (const std::exception& e) {
+        std::println(stderr, "Import failed: {}", e.what());
+        return EXIT_FAILURE;
+    }
+
+    return status;
+}
@@ -1,4 +1,5 @@
-#include <sstream>
+#include <charconv>
+#include <optional>
 #include <stdexcept>
 #include <string_view>
 
@@ -8,11 +9,35 @@
 #include "mep2_pdu_parser.hpp"
 #include "string_utils.hpp"
 
-void QueryPdu::parse_options(std::string_view options) {
+// Scratch space for decoding lines that don't need to keep the result.
+// Reusing it means decoding a line doesn't allocate once it has grown.
+static std::string& decode_buffer() {
+    static thread_local std::string buffer;
+    return buffer;
+}
+
+// Sizes are a plain byte count
+static std::optional<size_t> parse_size(std::string_view value) {
+    size_t size = 0;
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), size);
+    if (ec != std::errc() || end != value.data() + value.size()) {
+        return std::nullopt;
+    }
+
+    return size;
+}
+
+PduResult<void> QueryPdu::parse_options(std::string_view options) {
     while (options.length()) {
         std::string_view option;
 
-        size_t delim = options.find_first_of(',');
+        // Dates contain a comma, so a delimiter only counts outside of the
+        // value's parenthesis
+        size_t delim = options.find_first_of(",(");
+        if (delim != std::string_view::npos && options[delim] == '(') {
+            size_t close = options.find(')', delim);
+            delim = options.find(',', close == std::string_view::npos ? delim : close);
+        }
         if (delim == std::string_view::npos) {
             option = options;
             options.remove_prefix(options.length());
@@ -34,7 +59,7 @@ void QueryPdu::parse_options(std::string_view options) {
             // The minimal value size is 3 '(x)'
             // while 0 length is valid, that is only true if there was no '='
             if (value.length() <= 3) {
-                throw PduSyntaxError("Value length invalid");
+                return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Value length invalid");
             }
         }
 
@@ -45,7 +70,7 @@ void QueryPdu::parse_options(std::string_view options) {
                 _priority = true;
                 continue;
             } else {
-                throw PduSyntaxError("Missing value");
+                return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Missing value");
             }
         }
 
@@ -55,13 +80,15 @@ void QueryPdu::parse_options(std::string_view options) {
             value.remove_prefix(1);
             value.remove_suffix(1);
         } else {
-            throw PduSyntaxError("Value must be enclosed in parenthesis");
+            return pdu_error(Mep2ErrorCode::PDU_Syntax_Error,
+                             "Value must be enclosed in parenthesis");
         }
 
         // There cannot be any ( or ) symbols inside the values
         if (value.find('(') != std::string_view::npos ||
             value.find(')') != std::string_view::npos) {
-            throw PduSyntaxError("Value cannot contain parenthesis");
+            return pdu_error(Mep2ErrorCode::PDU_Syntax_Error,
+                             "Value cannot contain parenthesis");
         }
 
         // println("Key {} value {}", keyword, value);
@@ -76,84 +103,129 @@ void QueryPdu::parse_options(std::string_view options) {
             } else if (value == "TRASH") {
                 _folder = folder_id::trash;
             } else {
-                throw PduMalformedDataError("Unknown folder type in folder query");
+                return pdu_error(Mep2ErrorCode::Malformed_Data,
+                                 "Unknown folder type in folder query");
             }
         } else if (keyword == "SUBJECT") {
-            try {
-                _subject = decode_string(value);
-            } catch (std::invalid_argument& e) {
-                throw PduMalformedDataError("Invalid %% code in subject query");
+            if (decode_string(value, _subject) != DecodeStatus::ok) {
+                return pdu_error(Mep2ErrorCode::Malformed_Data,
+                                 "Invalid %% code in subject query");
             }
 
             if (!is_printable(_subject)) {
-                throw PduMalformedDataError("Invalid characters in subject query");
+                return pdu_error(Mep2ErrorCode::Malformed_Data,
+                                 "Invalid characters in subject query");
             }
         } else if (keyword == "FROM") {
-            try {
-                _from = decode_string(value);
-            } catch (std::invalid_argument& e) {
-                throw PduMalformedDataError("Invalid %% code in from query");
+            if (decode_string(value, _from) != DecodeStatus::ok) {
+                return pdu_error(Mep2ErrorCode::Malformed_Data, "Invalid %% code in from query");
             }
 
             if (!is_printable(_from)) {
-                throw PduMalformedDataError("Invalid characters in from query");
+                return pdu_error(Mep2ErrorCode::Malformed_Data,
+                                 "Invalid characters in from query");
+            }
+        } else if (keyword == "MAXSIZE" || keyword == "MINSIZE") {
+            auto size = parse_size(value);
+            if (!size) {
+                return pdu_error(Mep2ErrorCode::Malformed_Data, "Invalid size in size query");
+            }
+
+            (keyword == "MAXSIZE" ? _max_size : _min_size) = *size;
+        } else if (keyword == "BEFORE" || keyword == "AFTER") {
+            Date date;
+            if (!date.parse(value)) {
+                return pdu_error(Mep2ErrorCode::Malformed_Data, "Invalid date in date query");
             }
-        } else if (keyword == "MAXSIZE") {
-            // Unimplemented
-        } else if (keyword == "MINSIZE") {
-            // Unimplemented
-        } else if (keyword == "BEFORE") {
-            // Unimplemented
-        } else if (keyword == "AFTER") {
-            // Unimplemented
+
+            (keyword == "BEFORE" ? _before : _after) = date._gmt_time;
         } else {
-            throw PduSyntaxError("Unknown keyword");
+            return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Unknown keyword");
         }
     }
+
+    return {};
 }
 
-void CommentPdu::_parse_line(std::string_view line) {
+PduResult<void> CommentPdu::_parse_line(std::string_view line) {
     // We don't actually care about the data, only that it doesn't contain
     // illegal characters
-    try {
-        std::string line_decoded = decode_string(line);
-        std::string_view sv_line_decoded(line_decoded);
-        sv_line_decoded = strip_pdu_crlf(sv_line_decoded);
-        // We might want to log the decoded comment
+    std::string& line_decoded = decode_buffer();
+    DecodeStatus status = decode_string(line, line_decoded);
+    if (status != DecodeStatus::ok) {
+        return pdu_error(Mep2ErrorCode::Malformed_Data, decode_status_message(status));
+    }
 
-    } catch (std::invalid_argument& e) {
-        throw PduMalformedDataError(e.what());
+    auto sv_line_decoded = strip_pdu_crlf(line_decoded);
+    if (!sv_line_decoded) {
+        return std::unexpected(std::move(sv_line_decoded.error()));
     }
+    // We might want to log the decoded comment
+
+    return {};
 }
 
 const std::string EnvPdu::str() const {
-    std::stringstream ss;
-    if (has_date()) {
-        ss << "Date: " << get_date().to_orig_string() << "\r\n";
-    }
-
-    if (has_from_address()) {
-        ss << "From: " << get_from_address().str() << "\r\n";
-    }
-    
-    for (auto a: get_to_address()) {
-		ss << "To: " << a.str() << "\r\n";
-	}
-	
-	for (auto a: get_cc_address()) {
-		ss << "Cc: " << a.str() << "\r\n";
-	}
-	
-	if (has_subject()) {
-		ss << "Subject: " << encode_string(get_subject()) << "\r\n";
-	}
-    return ss.str();
+    std::string out;
+    format_to(out);
+    return out;
 }
 
-void EnvelopeHeaderPdu::parse_options(std::string_view options) {
+// Addresses are RawAddress or PackedAddress, whichever the recipients are
+template <typename Addresses>
+static void format_envelope_to(const EnvPdu& env, std::string& out, const Addresses& to,
+                               const Addresses& cc) {
+    if (env.has_date()) {
+        out += "Date: ";
+        env.get_date().format_orig_to(out);
+        out += "\r\n";
+    }
+
+    if (env.has_from_address()) {
+        out += "From: ";
+        env.get_from_address().format_to(out);
+        out += "\r\n";
+    }
+
+    for (const auto& a : to) {
+        out += "To: ";
+        a.format_to(out);
+        out += "\r\n";
+    }
+
+    for (const auto& a : cc) {
+        out += "Cc: ";
+        a.format_to(out);
+        out += "\r\n";
+    }
+
+    if (env.has_subject()) {
+        out += "Subject: ";
+        encode_string_to(env.get_subject(), out);
+        out += "\r\n";
+    }
+}
+
+void EnvPdu::format_to(std::string& out) const {
+    format_envelope_to(*this, out, get_to_address(), get_cc_address());
+}
+
+void EnvPdu::format_to(std::string& out, std::span<const PackedAddress> to,
+                       std::span<const PackedAddress> cc) const {
+    format_envelope_to(*this, out, to, cc);
+}
+
+void EnvPdu::clear_recipients() {
+    _to_address.clear();
+    _to_address.shrink_to_fit();
+    _cc_address.clear();
+    _cc_address.shrink_to_fit();
+}
+
+PduResult<void> EnvelopeHeaderPdu::parse_options(std::string_view options) {
     // This is fine, no priority query
     if (!options.length()) {
-        return;
+        return {};
     }
 
     if (options == "POSTAL") {
@@ -161,62 +233,110 @@ void EnvelopeHeaderPdu::parse_options(std::string_view options) {
     } else if (options == "ONITE") {
         _priority = priority_id::onite;
     } else {
-        throw PduMalformedDataError("Unknown priority");
+        return pdu_error(Mep2ErrorCode::Malformed_Data, "Unknown priority");
     }
+
+    return {};
 }
 
-EnvelopeHeaderPdu::header_field split_envelope_line(std::string_view line, std::string_view& field,
-                                                    std::string_view& information) {
+using header_field = EnvelopeHeaderPdu::header_field;
+
+// Classifies a field name including its ':'. Dispatching on the length
+// first leaves at most two names to compare against.
+static constexpr std::optional<header_field> classify_envelope_field(std::string_view name) {
+    switch (name.length()) {
+    case 3:
+        if (iequals(name, "to:")) {
+            return header_field::to;
+        } else if (iequals(name, "cc:")) {
+            return header_field::cc;
+        }
+        break;
+    case 5:
+        if (iequals(name, "from:")) {
+            return header_field::from;
+        } else if (iequals(name, "date:")) {
+            return header_field::date;
+        }
+        break;
+    case 8:
+        if (iequals(name, "subject:")) {
+            return header_field::subject;
+        }
+        break;
+    case 9:
+        if (iequals(name, "handling:")) {
+            return header_field::handling;
+        }
+        break;
+    case 11:
+        if (iequals(name, "message-id:")) {
+            return header_field::message_id;
+        }
+        break;
+    case 12:
+        if (iequals(name, "source-date:")) {
+            return header_field::source_date;
+        }
+        break;
+    case 18:
+        if (iequals(name, "source-message-id:")) {
+            return header_field::source_message_id;
+        }
+        break;
+    }
 
-    line = strip_pdu_crlf(line);
+    if (icompare(name, "u-")) {
+        return header_field::U;
+    }
 
-    if (!line.length()) {
-        throw PduMalformedDataError("Empty envelope line");
+    return std::nullopt;
+}
+
+static_assert(classify_envelope_field("To:") == header_field::to);
+static_assert(classify_envelope_field("SOURCE-DATE:") == header_field::source_date);
+static_assert(classify_envelope_field("U-Custom:") == header_field::U);
+static_assert(!classify_envelope_field("Tx:"));
+
+PduResult<header_field> split_envelope_line(std::string_view line, std::string_view& field,
+                                            std::string_view& information) {
+
+    auto stripped = strip_pdu_crlf(line);
+    if (!stripped) {
+        return std::unexpected(std::move(stripped.error()));
     }
+    line = *stripped;
 
-    if (std::count(line.cbegin(), line.cend(), ':') < 1) {
-        throw PduMalformedDataError("Missing : in envelope line");
+    if (!line.length()) {
+        return pdu_error(Mep2ErrorCode::Malformed_Data, "Empty envelope line");
     }
 
-    EnvelopeHeaderPdu::header_field f;
     size_t colon = line.find_first_of(':');
+    if (colon == std::string_view::npos) {
+        return pdu_error(Mep2ErrorCode::Malformed_Data, "Missing : in envelope line");
+    }
+
     field = line.substr(0, colon + 1);
     information = line.substr(colon + 1);
 
+    auto f = classify_envelope_field(field);
+
     // we don't care about trailing whitespace, but we do care about leading
     // whitespace as address continuations must start with whitespace
     rstrip(field);
     // We don't care about whitespace at the start or end of an address pair
     strip(information);
 
-    if (icompare(line, "from:")) {
-        f = EnvelopeHeaderPdu::header_field::from;
-    } else if (icompare(line, "to:")) {
-        f = EnvelopeHeaderPdu::header_field::to;
-    } else if (icompare(line, "cc:")) {
-        f = EnvelopeHeaderPdu::header_field::cc;
-    } else if (icompare(line, "date:")) {
-        f = EnvelopeHeaderPdu::header_field::date;
-    } else if (icompare(line, "source-date:")) {
-        f = EnvelopeHeaderPdu::header_field::source_date;
-    } else if (icompare(line, "message-id:")) {
-        f = EnvelopeHeaderPdu::header_field::message_id;
-    } else if (icompare(line, "source-message-id:")) {
-        f = EnvelopeHeaderPdu::header_field::source_message_id;
-    } else if (icompare(line, "subject:")) {
-        f = EnvelopeHeaderPdu::header_field::subject;
-    } else if (icompare(line, "handling:")) {
-        f = EnvelopeHeaderPdu::header_field::handling;
-    } else if (icompare(line, "u-")) {
-        f = EnvelopeHeaderPdu::header_field::U;
-    } else if (line.starts_with(' ') || line.starts_with('\t')) {
+    if (f) {
+        return *f;
+    }
+
+    if (line.starts_with(' ') || line.starts_with('\t')) {
         lstrip(field);
-        f = EnvelopeHeaderPdu::header_field::address_cont;
-    } else {
-        throw PduMalformedDataError("Invalid header type");
+        return header_field::address_cont;
     }
 
-    return f;
+    return pdu_error(Mep2ErrorCode::Malformed_Data, "Invalid header type");
 }
 
 void EnvelopeHeaderPdu::finish_current_address() {
@@ -237,23 +357,28 @@ void EnvelopeHeaderPdu::finish_current_address() {
         break;
     }
 
+    // Nothing of the previous address may carry over to the next one
+    _current_address = RawAddress::allocated_from(_resource.get());
     _address_parse_state = address_parse_state::idle;
 }
 
-void EnvelopeHeaderPdu::parse_envelope_line(std::string_view line, bool address_only) {
+PduResult<void> EnvelopeHeaderPdu::parse_envelope_line(std::string_view line, bool address_only) {
     if (!line.length()) {
-        throw PduMalformedDataError("Empty address line");
+        return pdu_error(Mep2ErrorCode::Malformed_Data, "Empty address line");
     }
 
     std::string_view field;
     std::string_view information;
-    header_field type = split_envelope_line(line, field, information);
+    auto split = split_envelope_line(line, field, information);
+    if (!split) {
+        return std::unexpected(std::move(split.error()));
+    }
+    header_field type = *split;
 
-    std::string information_decoded;
-    try {
-        information_decoded = decode_string(information);
-    } catch (std::invalid_argument& e) {
-        throw PduMalformedDataError(e.what());
+    std::string& information_decoded = decode_buffer();
+    DecodeStatus status = decode_string(information, information_decoded);
+    if (status != DecodeStatus::ok) {
+        return pdu_error(Mep2ErrorCode::Malformed_Data, decode_status_message(status));
     }
 
     if (address_only) {
@@ -263,7 +388,7 @@ void EnvelopeHeaderPdu::parse_envelope_line(std::string_view line, bool address_
         case header_field::cc:
             break;
         default:
-            throw PduMalformedDataError("Invalid addressing type");
+            return pdu_error(Mep2ErrorCode::Malformed_Data, "Invalid addressing type");
         }
     }
 
@@ -276,15 +401,17 @@ void EnvelopeHeaderPdu::parse_envelope_line(std::string_view line, bool address_
         // We only accept ems and mbx lines as part of an address
     case header_field::address_cont: {
         if (_address_parse_state == address_parse_state::idle) {
-            throw PduMalformedDataError("Invalid start of address");
+            return pdu_error(Mep2ErrorCode::Malformed_Data, "Invalid start of address");
         }
 
-        // Only throw this error if everything else appears okay
+        // Only report this error if everything else appears okay
         if (!is_printable(information_decoded)) {
-            throw PduMalformedDataError("Invalid characters in address");
+            return pdu_error(Mep2ErrorCode::Malformed_Data, "Invalid characters in address");
         }
 
-        _current_address.parse_field(field, information_decoded);
+        if (auto parsed = _current_address.parse_field(field, information_decoded); !parsed) {
+            return parsed;
+        }
         break;
     }
         // A To: or Cc: is the start of a new address
@@ -300,27 +427,32 @@ void EnvelopeHeaderPdu::parse_envelope_line(std::string_view line, bool address_
             break;
         case header_field::from:
             if (_from_address.has_value()) {
-                throw PduEnvelopeDataError("Multiple FROM: addresses");
+                return pdu_error(Mep2ErrorCode::Envelope_Problem, "Multiple FROM: addresses");
             }
             _address_parse_state = address_parse_state::parsing_from;
             break;
         default:
-            throw UnableToPerformError("Unknown error parsing envelope data");
+            return pdu_error(Mep2ErrorCode::Unable_To_Perform,
+                             "Unknown error parsing envelope data");
         }
 
-        // Only throw this error if everything else appears okay
+        // Only report this error if everything else appears okay
         if (!is_printable(information_decoded)) {
-            throw PduMalformedDataError("Invalid characters in address");
+            return pdu_error(Mep2ErrorCode::Malformed_Data, "Invalid characters in address");
         }
 
-        _current_address.parse_first_line(information_decoded);
+        if (auto parsed = _current_address.parse_first_line(information_decoded); !parsed) {
+            return parsed;
+        }
         break;
     }
 
     case header_field::date:
     case header_field::source_date: {
         Date d;
-        d.parse(information_decoded);
+        if (auto parsed = d.parse(information_decoded); !parsed) {
+            return parsed;
+        }
         if (type == header_field::date)
             _date.emplace(std::move(d));
         if (type == header_field::source_date)
@@ -329,12 +461,12 @@ void EnvelopeHeaderPdu::parse_envelope_line(std::string_view line, bool address_
     }
 
     case header_field::subject: {
-        _subject = std::string(information_decoded.substr(0, 255));
+        _subject.emplace(std::string_view(information_decoded).substr(0, 255), _resource.get());
         break;
     }
 
     case header_field::message_id: {
-        _message_id = std::string(information_decoded.substr(0, 100));
+        _message_id.emplace(std::string_view(information_decoded).substr(0, 100), _resource.get());
         break;
     }
 
@@ -342,7 +474,7 @@ void EnvelopeHeaderPdu::parse_envelope_line(std::string_view line, bool address_
         if (_source_message_id.size() == 5) {
             _source_message_id.erase(_source_message_id.begin());
         }
-        _source_message_id.push_back(std::string(information_decoded.substr(0, 78)));
+        _source_message_id.emplace_back(std::string_view(information_decoded).substr(0, 78));
         break;
     }
 
@@ -353,8 +485,8 @@ void EnvelopeHeaderPdu::parse_envelope_line(std::string_view line, bool address_
 
         // remove ":"
         field.remove_suffix(1);
-        _u_fields.push_back(
-            {std::string(field.substr(0, 20)), std::string(information_decoded.substr(0, 78))});
+        _u_fields.emplace_back(field.substr(0, 20),
+                               std::string_view(information_decoded).substr(0, 78));
         break;
     }
 
@@ -365,26 +497,30 @@ void EnvelopeHeaderPdu::parse_envelope_line(std::string_view line, bool address_
 
     // We saw *something* valid
     _envelope_data = true;
+
+    return {};
 }
 
-void EnvelopeHeaderPdu::_finalize() {
+PduResult<void> EnvelopeHeaderPdu::_finalize() {
     finish_current_address();
 
 #ifndef FUZZING_BUILD
     if (!_envelope_data) {
-        throw PduNoEnvelopeDataError();
+        return pdu_error(Mep2ErrorCode::Envelope_No_Data);
     }
 
     if (_to_address.empty()) {
-        throw PduToRequiredError();
+        return pdu_error(Mep2ErrorCode::Envelope_No_To);
     }
 #endif
+
+    return {};
 }
 
-void TextPdu::parse_options(std::string_view options) {
+PduResult<void> TextPdu::parse_options(std::string_view options) {
     // This is fine, default to ascii
     if (!options.length()) {
-        return;
+        return {};
     }
 
     // Parse type field
@@ -432,27 +568,43 @@ void TextPdu::parse_options(std::string_view options) {
         _content_type = content_type::racal;
         _content_type_handling = content_type::binary;
     } else {
-        throw PduMalformedDataError("Unknown text type");
+        return pdu_error(Mep2ErrorCode::Malformed_Data, "Unknown text type");
     }
 
     // Parse description
     size_t delim = options.find_first_of(':');
     if (delim == std::string_view::npos) {
-        return;
+        return {};
     }
 
     if (delim == options.length()) {
-        return;
+        return {};
     }
 
     std::string_view description = options.substr(delim + 1);
     strip(description);
 
     if (!description.length()) {
-        return;
+        return {};
+    }
+
+    std::string& description_decoded = decode_buffer();
+    DecodeStatus status = decode_string(description, description_decoded);
+    if (status != DecodeStatus::ok) {
+        return pdu_error(Mep2ErrorCode::Malformed_Data, decode_status_message(status));
     }
 
-    _description = decode_string(description);
+    _description.emplace(description_decoded, _resource.get());
+
+    return {};
 }
 
-void TextPdu::_parse_line(std::string_view line) {}
+PduResult<void> TextPdu::_parse_line(std::string_view line) {
+    // Decoding is up to whoever stores the body, it doesn't change how the
+    // PDU parses
+    if (_body) {
+        _body->append(line);
+    }
+
+    return {};
+}
@@ -1,42 +1,46 @@
 #include <cstring>
 #include <exception>
 #include <format>
+#include <optional>
 #include <string_view>
 
 #include "mep2_errors.hpp"
 #include "mep2_pdu.hpp"
 #include "mep2_pdu_parser.hpp"
+#include "metrics.hpp"
 
 #include "string_utils.hpp"
 
-void validate_pdu_line(std::string_view line) {
+PduResult<void> validate_pdu_line(std::string_view line) {
     size_t len = line.length();
 
     // Shortest possible valid PDU is /ENV\r
     // All PDUs must start with a /
     if (len < 5) {
-        throw PduSyntaxError("PDU invalid: too short");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "PDU invalid: too short");
     }
 
     if (!line.starts_with('/')) {
-        throw PduSyntaxError("PDU invalid: doesn't start with a '/'");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "PDU invalid: doesn't start with a '/'");
     }
 
     if (std::count(line.cbegin(), line.cend(), '*') > 1) {
         // There can never be more than 1 star
-        throw PduSyntaxError("Stray '*' in PDU");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Stray '*' in PDU");
     }
 
     if (std::count(line.cbegin(), line.cend(), '/') > 1) {
         // There can never be more than 1 star
-        throw PduSyntaxError("Stray '/' in PDU");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Stray '/' in PDU");
     }
+
+    return {};
 }
 
-std::string_view strip_pdu_crlf(std::string_view line) {
+PduResult<std::string_view> strip_pdu_crlf(std::string_view line) {
     size_t pdu_end = line.find_first_of('\r');
     if (pdu_end == std::string_view::npos) {
-        throw PduSyntaxError("No carriage return in PDU");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "No carriage return in PDU");
     }
 
     line = line.substr(0, pdu_end);
@@ -44,98 +48,160 @@ std::string_view strip_pdu_crlf(std::string_view line) {
     return line;
 }
 
-void compare_text_checksum(const PduChecksum& checksum, std::string_view string_checksum) {
+PduResult<void> compare_text_checksum(const PduChecksum& checksum,
+                                      std::string_view string_checksum) {
     // the "ZZZZ" hash is to be ignored by the server. It is intended for
     // manual testing
     if (icompare(string_checksum, "zzzz")) {
-        return;
+        return {};
     }
 
-    try {
-        PduChecksum sender_checksum(string_checksum);
-        if (checksum != sender_checksum) {
-            throw PduChecksumError(std::format("Wanted: {:04X}, actual: {:04X}",
-                                               sender_checksum._checksum, checksum._checksum));
-        }
-    } catch (std::invalid_argument& e) {
+    auto sender_checksum = PduChecksum::from_string(string_checksum);
+    if (!sender_checksum) {
         // The sender checksum included invalid characters
-        throw PduSyntaxError("Checksum has invalid characters");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Checksum has invalid characters");
+    }
+
+    if (checksum != *sender_checksum) {
+        return pdu_error(Mep2ErrorCode::Checksum_Error,
+                         std::format("Wanted: {:04X}, actual: {:04X}", sender_checksum->_checksum,
+                                     checksum._checksum));
     }
+
+    return {};
 }
 
-void PduParser::validate_checksum(std::string_view line) {
+PduResult<void> PduParser::validate_checksum(std::string_view line) {
 #ifdef FUZZING_BUILD
-    return;
+    return {};
 #endif
     size_t star = line.find_first_of('*');
     if (star == std::string_view::npos) {
-        throw PduSyntaxError("PDU line does not have a *");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "PDU line does not have a *");
     }
 
     // The * must appear here, or there's no space for a checksum
     if (star != line.length() - 5) {
-        throw PduSyntaxError("Checksum too short");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Checksum too short");
     }
 
     std::string_view pdu_data = line.substr(0, star + 1);
     std::string_view sender_checksum = line.substr(star + 1, 4);
 
-    std::visit(
+    return std::visit(
         [pdu_data, sender_checksum](auto&& pdu) {
             pdu.get_checksum().add_line(pdu_data);
-            compare_text_checksum(pdu.get_checksum(), sender_checksum);
+            return compare_text_checksum(pdu.get_checksum(), sender_checksum);
         },
         _current_pdu);
 }
 
-PduType PduParser::parse_pdu_type(std::string_view& line_parse) {
+PduResult<PduType> PduParser::parse_pdu_type(std::string_view& line_parse) {
     auto pdu_type = _pdu_trie.find(line_parse);
     if (!pdu_type) {
-        throw PduSyntaxError("Unknown PDU type");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Unknown PDU type");
     }
 
-    return *pdu_type;
+    return PduType(*pdu_type);
 }
 
-PduType PduParser::parse_pdu_start(std::string_view& line_parse) {
+PduResult<PduType> PduParser::parse_pdu_start(std::string_view& line_parse) {
     // Eat leading '/'
     line_parse.remove_prefix(1);
     return parse_pdu_type(line_parse);
 }
 
 awaitable<void> PduParser::parse_line(std::string_view line) {
+    // The body has to be written before the /end line can tell how that
+    // went
+    if (!_text_chunk.empty() && (_text_chunk.size() >= text_chunk_size || line.starts_with('/'))) {
+        co_await flush_text();
+    }
+
+    auto result = try_parse_line(line);
+    if (!result) {
+        throw_pdu_error(result.error());
+    }
+}
+
+awaitable<void> PduParser::flush_text() {
+    auto written = co_await _text_sink->write_text(_text_chunk);
+    _text_chunk.clear();
+
+    // Stops the rest of the body from being collected until it is reported
+    if (!written && !_current_error) {
+        _current_error = std::move(written.error());
+    }
+}
+
+PduResult<void> PduParser::try_parse_line(std::string_view line) {
+    PduResult<void> result;
+
     switch (_state) {
     case state::idle:
-        parse_first_line(line);
+        // Only read once per PDU, not for every line of it
+        _started = metrics_clock::now();
+        result = parse_first_line(line);
         break;
 
     case state::parsing:
-        parse_information_line(line);
+        // Only parse_line passes the body on to the sink, here it would pile
+        // up for as long as the body goes on
+        if (_text_chunk.size() >= text_chunk_size) {
+            _text_chunk.clear();
+            if (!_current_error) {
+                _current_error.emplace(Mep2ErrorCode::System_Error,
+                                       "Text body too large to parse without parse_line");
+            }
+        }
+        result = parse_information_line(line);
         break;
 
     case state::complete:
 #ifndef FUZZING_BUILD
-        throw PduSyntaxError("Unexpected data after Pdu");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Unexpected data after Pdu");
 #endif
+        return {};
     }
 
-    co_return;
+    if (_state == state::complete && _current_type) {
+        ThreadMetrics& metrics = Metrics::local();
+        metrics.pdus[*_current_type].add();
+        metrics.parse_latency.observe(metrics_clock::now() - _started);
+    }
+
+    return result;
 }
 
-void PduParser::parse_first_line(std::string_view line) {
+PduResult<void> PduParser::parse_first_line(std::string_view line) {
     // Parses the first line of a PDU, in one of two forms:
     // /<pdu type> [ <options>]*ZZZZ\r\n  For single-line PDUs
     // /<pdu type> [ <options>]\r\n  For multi-line PDUs
     // Options is optional
 
-    validate_pdu_line(line);
-    std::string_view line_strip = strip_pdu_crlf(line);
+    if (auto valid = validate_pdu_line(line); !valid) {
+        return valid;
+    }
+
+    auto stripped = strip_pdu_crlf(line);
+    if (!stripped) {
+        return std::unexpected(std::move(stripped.error()));
+    }
+
+    std::string_view line_strip = *stripped;
     std::string_view line_parse = line_strip;
-    PduType type = parse_pdu_start(line_parse);
+    auto parsed_type = parse_pdu_start(line_parse);
+    if (!parsed_type) {
+        return std::unexpected(std::move(parsed_type.error()));
+    }
+    PduType type = *parsed_type;
 
     // Eat optional whitespace between pdu type and options or checksum
     lstrip(line_parse);
 
+    // Whatever is left of the previous PDU goes, and the arena with it
+    reset();
+
     switch (type.get_id()) {
     case PduType::type_id::busy:
         _current_pdu.emplace<BusyPdu>();
@@ -159,129 +225,180 @@ void PduParser::parse_first_line(std::string_view line) {
         _current_pdu.emplace<CommentPdu>();
         break;
     case PduType::type_id::verify:
-        _current_pdu.emplace<VerifyPdu>();
+        _current_pdu.emplace<VerifyPdu>(resource());
         break;
     case PduType::type_id::env:
-        _current_pdu.emplace<EnvPdu>();
+        _current_pdu.emplace<EnvPdu>(resource());
         break;
     case PduType::type_id::text:
-        _current_pdu.emplace<TextPdu>();
+        if (_text_sink) {
+            _current_pdu.emplace<TextPdu>(resource()).collect_body(&_text_chunk);
+        } else {
+            _current_pdu.emplace<TextPdu>(resource());
+        }
         break;
     default:
-        throw PduSyntaxError("Unhandled PDU type");
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Unhandled PDU type");
     }
 
     _current_type.emplace(type);
 
     if (type.is_single_line()) {
-        validate_checksum(line_strip);
+        if (auto valid = validate_checksum(line_strip); !valid) {
+            return valid;
+        }
         // Done with the checksum
         line_parse = line_parse.substr(0, line_parse.find("*"));
     } else {
-        // Multi-line PDUs should not have a '*' at all on the first line.
-        if (line.find("*") != std::string_view::npos) {
-            throw PduSyntaxError("Unexpected checksum for multi-line PDU");
-        }
-
         // For a multi-line PDU any trailing whitespace or newlines are
         // part of the checksum
         std::visit([line](auto&& pdu) { pdu.get_checksum().add_line(line); }, _current_pdu);
+
+        // From here on the rest of the PDU, up to its /end, is read and
+        // dropped, so that its lines aren't taken for PDUs of their own and
+        // the error is reported once, at the /end
+        _state = state::parsing;
+
+        // Multi-line PDUs should not have a '*' at all on the first line.
+        if (line.find("*") != std::string_view::npos) {
+            _current_error.emplace(Mep2ErrorCode::PDU_Syntax_Error,
+                                   "Unexpected checksum for multi-line PDU");
+            return {};
+        }
     }
 
     // strip any trailing whitespace after the options, this is legal
     rstrip(line_parse);
 
     // Parse options
-    std::visit([line_parse](auto&& pdu) { pdu.parse_options(line_parse); }, _current_pdu);
+    auto options = std::visit(
+        [line_parse](auto&& pdu) { return pdu.parse_options(line_parse); }, _current_pdu);
+    if (!options) {
+        if (type.is_single_line()) {
+            return options;
+        }
+        _current_error = std::move(options.error());
+        return {};
+    }
 
     if (type.is_single_line()) {
         _state = state::complete;
-    } else {
-        _state = state::parsing;
     }
+
+    return {};
 }
 
-void PduParser::parse_information_line(std::string_view line) {
-    // We want to ensure that we only throw anything if the entire PDU has been
-    // parsed
+PduResult<void> PduParser::parse_information_line(std::string_view line) {
+    // We want to ensure that we only report anything if the entire PDU has
+    // been parsed
 
     if (line.length()) {
         if (line[0] == '/') {
             // Complete PDU parsing
-            parse_end_line(line);
+            if (auto end = parse_end_line(line); !end) {
+                return end;
+            }
 
-            // If we have any error codes for the PDU contents, throw them now
+            // If we have any error codes for the PDU contents, report them now
             if (_current_error.has_value()) {
-                std::rethrow_exception(*_current_error);
+                return std::unexpected(*_current_error);
             }
 
             // Let the PDU do a semantic check, if necessary
-            std::visit([](auto&& pdu) { pdu.finalize(); }, _current_pdu);
+            return std::visit([](auto&& pdu) { return pdu.finalize(); }, _current_pdu);
         } else {
-            try {
-                std::visit(
-                    [this, line](auto&& pdu) {
-                        pdu.get_checksum().add_line(line);
-                    // If we have an error code, we don't want to do any
-                    // more parsing
+            auto result = std::visit(
+                [this, line](auto&& pdu) -> PduResult<void> {
+                    pdu.get_checksum().add_line(line);
+                // If we have an error code, we don't want to do any
+                // more parsing
 #ifndef FUZZING_BUILD
-                        if (!_current_error.has_value()) {
-                            pdu.parse_line(line);
-                        }
+                    if (!_current_error.has_value()) {
+                        return pdu.parse_line(line);
+                    }
+                    return {};
 #else
-                        // While fuzzing we want to continue on
-                        pdu.parse_line(line);
+                    // While fuzzing we want to continue on
+                    return pdu.parse_line(line);
 #endif
-                    },
-                    _current_pdu);
-                // Store any errors for later
-            } catch (...) {
-                _current_error = std::current_exception();
+                },
+                _current_pdu);
+
+            // Store any errors for later
+            if (!result) {
+                _current_error = std::move(result.error());
             }
         }
     }
+
+    return {};
 }
 
-void PduParser::parse_end_line(std::string_view line) {
+PduResult<void> PduParser::parse_end_line(std::string_view line) {
     // Parses the /end pdu in the following form:
     // /end <pdu type>*<checksum>\r
 
-    validate_pdu_line(line);
-    std::string_view line_strip = strip_pdu_crlf(line);
+    if (auto valid = validate_pdu_line(line); !valid) {
+        return valid;
+    }
+
+    auto stripped = strip_pdu_crlf(line);
+    if (!stripped) {
+        return std::unexpected(std::move(stripped.error()));
+    }
+
+    std::string_view line_strip = *stripped;
     std::string_view line_parse = line_strip;
-    PduType type = parse_pdu_start(line_parse);
+    auto type = parse_pdu_start(line_parse);
+    if (!type) {
+        return std::unexpected(std::move(type.error()));
+    }
 
-    if (type.get_id() != PduType::type_id::end) {
-        throw PduSyntaxError("Unexpected PDU, expected end");
+    if (type->get_id() != PduType::type_id::end) {
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error, "Unexpected PDU, expected end");
     }
 
-    validate_checksum(line_strip);
+    if (auto valid = validate_checksum(line_strip); !valid) {
+        return valid;
+    }
 
     // Done with the checksum
     line_parse = line_parse.substr(0, line_parse.find("*"));
     // Strip all whitespace between /end and <type>
     lstrip(line_parse);
 
-    std::visit(
-        [&line_parse, this](auto&& pdu) {
+    auto end_matches = std::visit(
+        [&line_parse, this](auto&& pdu) -> PduResult<void> {
             // The start of the parser line should now be the type of the
             // end
-            PduType end_type = parse_pdu_type(line_parse);
-            if (end_type.get_id() != pdu.get_type().get_id()) {
-                throw PduSyntaxError(
+            auto end_type = parse_pdu_type(line_parse);
+            if (!end_type) {
+                return std::unexpected(std::move(end_type.error()));
+            }
+
+            if (end_type->get_id() != pdu.get_type().get_id()) {
+                return pdu_error(
+                    Mep2ErrorCode::PDU_Syntax_Error,
                     std::format("Unexpected PDU, expected end {}", pdu.get_type().get_name()));
             }
+
+            return {};
         },
         _current_pdu);
+    if (!end_matches) {
+        return end_matches;
+    }
 
     // There should be no more data left except optional whitespace
     lstrip(line_parse);
 
 #ifndef FUZZING_BUILD
     if (line_parse.length()) {
-        throw PduSyntaxError(std::format("Unexpected data after end type: '{}'", line_parse));
+        return pdu_error(Mep2ErrorCode::PDU_Syntax_Error,
+                         std::format("Unexpected data after end type: '{}'", line_parse));
     }
 #endif
 
     _state = state::complete;
+    return {};
 }
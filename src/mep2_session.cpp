@@ -0,0 +1,231 @@
+#include <format>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <variant>
+
+#include <asio/experimental/awaitable_operators.hpp>
+#include <asio/use_awaitable.hpp>
+
+#include "mep2_errors.hpp"
+#include "mep2_pdu.hpp"
+#include "mep2_session.hpp"
+#include "metrics.hpp"
+
+using asio::use_awaitable;
+using namespace asio::experimental::awaitable_operators;
+
+std::string format_reply(Mep2ErrorCode code, std::string_view context) {
+    // /reply
+    // <code> <message>
+    // /end reply*<checksum>
+    std::string message = Mep2ErrorMessages.at(code);
+    if (!context.empty()) {
+        message = std::format("{}: {}", message, context);
+    }
+
+    std::string reply = "/reply\r\n";
+    reply += std::format("{} {}\r\n", static_cast<int>(code), message);
+    reply += "/end reply*";
+
+    PduChecksum checksum;
+    checksum.add_line(reply);
+    reply += checksum.to_string();
+    reply += "\r\n";
+
+    return reply;
+}
+
+// The master hanging up is the normal way for a session to end
+static bool is_hangup(const asio::error_code& ec) {
+    return ec == asio::error::eof || ec == asio::error::connection_reset;
+}
+
+Mep2Session::Mep2Session(tcp::socket socket, MailStore& store)
+    : _socket(std::move(socket)), _store(store),
+      _parser(PduParser::default_arena_size, pipeline_depth + 2),
+      _channel(_socket.get_executor(), pipeline_depth) {
+    _parser.set_text_sink(&_channel);
+}
+
+awaitable<void> Mep2Session::run() {
+    try {
+        // Should either stage fail, the other one is cancelled
+        co_await (read_pdus() && handle_pdus());
+    } catch (const asio::system_error& e) {
+        if (!is_hangup(e.code())) {
+            throw;
+        }
+    }
+
+    asio::error_code ec;
+    _socket.shutdown(tcp::socket::shutdown_both, ec);
+    _socket.close(ec);
+}
+
+awaitable<void> Mep2Session::read_pdus() {
+    try {
+        for (;;) {
+            PduResult<PduVariant> pdu;
+            try {
+                co_await _framer.read_pdu(_socket, _parser);
+                pdu = _parser.extract_pdu();
+            } catch (const Mep2Error& e) {
+                // Whatever was parsed of a broken PDU can't be used
+                _parser.reset();
+                pdu = pdu_error(e);
+            }
+
+            // Waits while the channel is full
+            co_await _channel.send(std::move(pdu));
+        }
+    } catch (const asio::system_error& e) {
+        // After /term the handler closes the channel and stops reception
+        if (!is_hangup(e.code()) && e.code() != asio::experimental::error::channel_closed &&
+            e.code() != asio::experimental::error::channel_cancelled) {
+            throw;
+        }
+    }
+
+    // Whatever was read before the master hung up is still handled
+    _channel.close();
+}
+
+awaitable<void> Mep2Session::handle_pdus() {
+    while (auto item = co_await _channel.receive()) {
+        if (auto* chunk = std::get_if<PduChannel::BodyChunk>(&*item)) {
+            co_await write_body(chunk->text);
+            continue;
+        }
+
+        auto& pdu = std::get<PduResult<PduVariant>>(*item);
+        if (!pdu) {
+            // Part of the body is in the file already, the rest of it never
+            // will be
+            if (_in_body && !_message_error) {
+                _message_error = pdu.error();
+            }
+            _in_body = false;
+
+            co_await send_reply(pdu.error().code, pdu.error().context);
+            continue;
+        }
+
+        if (!co_await handle_pdu(*pdu)) {
+            break;
+        }
+    }
+
+    // Nothing after /term is read. A reader waiting for room in the channel
+    // is woken by the cancel, one waiting for data by the shutdown.
+    asio::error_code ec;
+    _socket.shutdown(tcp::socket::shutdown_receive, ec);
+    _channel.cancel();
+    _channel.close();
+}
+
+awaitable<bool> Mep2Session::handle_pdu(const PduVariant& pdu) {
+    if (const auto* envelope = std::get_if<EnvPdu>(&pdu)) {
+        open_message();
+        _message->metadata().set_envelope(*envelope);
+        co_await send_reply(Mep2ErrorCode::Success);
+        co_return true;
+    }
+
+    if (std::holds_alternative<TextPdu>(pdu)) {
+        // All of the body has been written by now, an empty one has none
+        _in_body = false;
+        if (!_message) {
+            open_message();
+        }
+
+        if (_message_error) {
+            co_await send_reply(_message_error->code, _message_error->context);
+        } else {
+            co_await send_reply(Mep2ErrorCode::Success);
+        }
+        co_return true;
+    }
+
+    if (std::holds_alternative<SendPdu>(pdu)) {
+        co_await send_message();
+        co_return true;
+    }
+
+    if (!std::holds_alternative<CommentPdu>(pdu)) {
+        _message.reset();
+        _message_error.reset();
+    }
+
+    co_await send_reply(Mep2ErrorCode::Success);
+    co_return !std::holds_alternative<TermPdu>(pdu);
+}
+
+awaitable<void> Mep2Session::write_body(std::string_view text) {
+    // Text without an envelope before it makes a message of its own
+    if (!_in_body && !_message) {
+        open_message();
+    }
+    _in_body = true;
+
+    if (_message_error) {
+        co_return;
+    }
+
+    // Waits for the disk, the reader goes on until the channel is full
+    try {
+        co_await _message->write_text(text);
+    } catch (const Mep2Error& e) {
+        _message_error.emplace(e.code(), e.context());
+    } catch (const std::system_error&) {
+        _message_error.emplace(Mep2ErrorCode::System_Error, "Failed to write message");
+    }
+}
+
+awaitable<void> Mep2Session::send_message() {
+    if (!_message) {
+        co_await send_reply(Mep2ErrorCode::Protocol_Violation, "No message to send");
+        co_return;
+    }
+
+    // Either way the message is done with, the next one starts afresh
+    std::unique_ptr<MailStoreFile> message = std::move(_message);
+    std::optional<PduError> error = std::move(_message_error);
+    _message_error.reset();
+
+    if (error) {
+        co_await send_reply(error->code, error->context);
+        co_return;
+    }
+
+    // The store's error names its paths, which are none of the master's
+    // business
+    bool stored = false;
+    try {
+        stored = co_await message->close();
+    } catch (const std::runtime_error&) {
+    }
+
+    if (stored) {
+        co_await send_reply(Mep2ErrorCode::Success);
+    } else {
+        co_await send_reply(Mep2ErrorCode::System_Error, "Failed to store message");
+    }
+}
+
+void Mep2Session::open_message() {
+    // Elided straight into place, as MailStoreFile has no move constructor
+    _message.reset(new MailStoreFile(_store.create_file()));
+    _message_error.reset();
+}
+
+awaitable<void> Mep2Session::send_reply(Mep2ErrorCode code, std::string_view context) {
+    Metrics::local().count_reply(code);
+
+    std::string reply = format_reply(code, context);
+    co_await asio::async_write(_socket, asio::buffer(reply), use_awaitable);
+}
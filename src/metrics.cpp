@@ -0,0 +1,137 @@
+#include <deque>
+#include <format>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "metrics.hpp"
+
+namespace {
+
+std::mutex registry_mutex;
+// Never shrinks, so the blocks stay where they are
+std::deque<ThreadMetrics> registry;
+std::vector<ThreadMetrics*> unused;
+
+// Gives the block of a thread back when the thread exits
+struct Release {
+    ThreadMetrics* metrics = nullptr;
+
+    ~Release() {
+        if (metrics) {
+            std::lock_guard lock(registry_mutex);
+            unused.push_back(metrics);
+        }
+    }
+};
+
+struct HistogramTotal {
+    std::array<uint64_t, Histogram::bucket_count> buckets{};
+    uint64_t sum_ns = 0;
+
+    void add(const Histogram& histogram) {
+        for (size_t i = 0; i < buckets.size(); ++i) {
+            buckets[i] += histogram.bucket(i);
+        }
+        sum_ns += histogram.sum_ns();
+    }
+};
+
+void render_counter(std::string& out, std::string_view name, std::string_view help,
+                    uint64_t value) {
+    std::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} counter\n{} {}\n", name,
+                   help, name, name, value);
+}
+
+void render_histogram(std::string& out, std::string_view name, std::string_view help,
+                      const HistogramTotal& total) {
+    std::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} histogram\n", name, help,
+                   name);
+
+    // Buckets are cumulative, bucket i ends at 2^i ns
+    uint64_t count = 0;
+    for (size_t i = 0; i + 1 < total.buckets.size(); ++i) {
+        count += total.buckets[i];
+        const double le = static_cast<double>(uint64_t{1} << i) * 1e-9;
+        std::format_to(std::back_inserter(out), "{}_bucket{{le=\"{:g}\"}} {}\n", name, le, count);
+    }
+    count += total.buckets.back();
+
+    std::format_to(std::back_inserter(out),
+                   "{}_bucket{{le=\"+Inf\"}} {}\n{}_sum {:g}\n{}_count {}\n", name, count, name,
+                   static_cast<double>(total.sum_ns) * 1e-9, name, count);
+}
+
+} // namespace
+
+ThreadMetrics& Metrics::acquire() {
+    static thread_local Release release;
+
+    std::lock_guard lock(registry_mutex);
+    if (unused.empty()) {
+        release.metrics = &registry.emplace_back();
+    } else {
+        release.metrics = unused.back();
+        unused.pop_back();
+    }
+    return *release.metrics;
+}
+
+std::string Metrics::render() {
+    std::array<uint64_t, PduType::type_count> pdus{};
+    std::array<uint64_t, ThreadMetrics::max_reply_code> replies{};
+    uint64_t bytes_decoded = 0;
+    uint64_t bytes_encoded = 0;
+    HistogramTotal parse_latency;
+    HistogramTotal write_latency;
+    HistogramTotal commit_latency;
+
+    {
+        std::lock_guard lock(registry_mutex);
+        for (const ThreadMetrics& metrics : registry) {
+            for (size_t i = 0; i < pdus.size(); ++i) {
+                pdus[i] += metrics.pdus[i].get();
+            }
+            for (size_t i = 0; i < replies.size(); ++i) {
+                replies[i] += metrics.replies[i].get();
+            }
+            bytes_decoded += metrics.bytes_decoded.get();
+            bytes_encoded += metrics.bytes_encoded.get();
+            parse_latency.add(metrics.parse_latency);
+            write_latency.add(metrics.write_latency);
+            commit_latency.add(metrics.commit_latency);
+        }
+    }
+
+    std::string out;
+    auto it = std::back_inserter(out);
+
+    out += "# HELP mep2_pdus_total PDUs parsed, by type\n# TYPE mep2_pdus_total counter\n";
+    for (size_t i = 0; i < pdus.size(); ++i) {
+        const PduType type(static_cast<PduType::type_id>(i));
+        std::format_to(it, "mep2_pdus_total{{type=\"{}\"}} {}\n", type.get_name(), pdus[i]);
+    }
+
+    out += "# HELP mep2_replies_total Replies sent, by code\n# TYPE mep2_replies_total counter\n";
+    for (size_t i = 0; i < replies.size(); ++i) {
+        // Most codes are never used, only list the ones that were
+        if (replies[i]) {
+            std::format_to(it, "mep2_replies_total{{code=\"{}\"}} {}\n", i, replies[i]);
+        }
+    }
+
+    render_counter(out, "mep2_text_decoded_bytes_total", "Message text bytes received",
+                   bytes_decoded);
+    render_counter(out, "mep2_text_encoded_bytes_total", "Message text bytes sent",
+                   bytes_encoded);
+    render_histogram(out, "mep2_pdu_parse_seconds", "Time from the first line of a PDU to its last",
+                     parse_latency);
+    render_histogram(out, "mep2_store_write_seconds", "Time taken by a write to a stored message",
+                     write_latency);
+    render_histogram(out, "mep2_store_commit_seconds", "Time waited for a stored message commit",
+                     commit_latency);
+
+    return out;
+}
@@ -0,0 +1,42 @@
+#include <algorithm>
+#include <cstddef>
+
+#include "pdu_arena.hpp"
+
+static constexpr size_t buffer_alignment = alignof(std::max_align_t);
+
+PduArena::PduArena(size_t size, std::pmr::memory_resource* upstream)
+    : _upstream(upstream), _size(std::max<size_t>(size, 1)),
+      _buffer(static_cast<std::byte*>(_upstream->allocate(_size, buffer_alignment))) {
+    _resource.emplace(_buffer, _size, this);
+}
+
+PduArena::~PduArena() {
+    _resource.reset();
+    _upstream->deallocate(_buffer, _size, buffer_alignment);
+}
+
+void PduArena::release() {
+    // Hands back whatever came from upstream
+    _resource.reset();
+
+    if (_overflow && _size < max_buffer_size) {
+        size_t size = std::min(_size + _overflow, max_buffer_size);
+        auto* buffer = static_cast<std::byte*>(_upstream->allocate(size, buffer_alignment));
+        _upstream->deallocate(_buffer, _size, buffer_alignment);
+        _buffer = buffer;
+        _size = size;
+    }
+    _overflow = 0;
+
+    _resource.emplace(_buffer, _size, this);
+}
+
+void* PduArena::do_allocate(size_t bytes, size_t alignment) {
+    _overflow += bytes;
+    return _upstream->allocate(bytes, alignment);
+}
+
+void PduArena::do_deallocate(void* p, size_t bytes, size_t alignment) {
+    _upstream->deallocate(p, bytes, alignment);
+}
@@ -0,0 +1,31 @@
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <asio/as_tuple.hpp>
+#include <asio/use_awaitable.hpp>
+
+#include "pdu_channel.hpp"
+
+using asio::use_awaitable;
+
+awaitable<void> PduChannel::send(PduResult<PduVariant> pdu) {
+    co_await _channel.async_send(asio::error_code(), item(std::move(pdu)), use_awaitable);
+}
+
+awaitable<PduResult<void>> PduChannel::write_text(std::string_view text) {
+    // The parser reuses its chunk as soon as this returns
+    co_await _channel.async_send(asio::error_code(), item(BodyChunk{std::string(text)}),
+                                 use_awaitable);
+    co_return PduResult<void>{};
+}
+
+awaitable<std::optional<PduChannel::item>> PduChannel::receive() {
+    auto [ec, received] = co_await _channel.async_receive(asio::as_tuple(use_awaitable));
+    if (ec) {
+        co_return std::nullopt;
+    }
+
+    co_return std::move(received);
+}
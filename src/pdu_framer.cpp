@@ -0,0 +1,79 @@
+#include <cstring>
+#include <string_view>
+
+#include "mep2_errors.hpp"
+#include "pdu_framer.hpp"
+
+void PduFramer::carry(std::string_view data, bool line_complete) {
+    if (_discarding) {
+        _discarding = !line_complete;
+        return;
+    }
+
+    if (_carry_length + data.length() > max_line_length) {
+        _carry_length = 0;
+        _discarding = !line_complete;
+        throw PduSyntaxError("Line too long");
+    }
+
+    std::memcpy(_carry.data() + _carry_length, data.data(), data.length());
+    _carry_length += data.length();
+}
+
+awaitable<bool> PduFramer::feed(PduParser& parser, std::string_view& data) {
+    while (!data.empty()) {
+        if (_pending_lf) {
+            _pending_lf = false;
+
+            if (data.front() == '\n') {
+                data.remove_prefix(1);
+                parser.add_trailing_lf();
+                continue;
+            }
+        }
+
+        size_t cr = data.find('\r');
+        if (cr == std::string_view::npos) {
+            // The rest of the line is still on its way
+            std::string_view partial = data;
+            data = std::string_view();
+            carry(partial, false);
+            break;
+        }
+
+        // We can't hold on to a trailing '\r' waiting to see if a '\n'
+        // follows; plenty of clients only send a '\r' and then wait for us.
+        size_t length = cr + 1;
+        if (length < data.length()) {
+            if (data[length] == '\n') {
+                ++length;
+            }
+        } else {
+            _pending_lf = true;
+        }
+
+        std::string_view line = data.substr(0, length);
+        data.remove_prefix(length);
+
+        if (_discarding || _carry_length) {
+            carry(line, true);
+
+            // This was the tail end of a line that was too long
+            if (!_carry_length) {
+                continue;
+            }
+
+            line = std::string_view(_carry.data(), _carry_length);
+            // The view stays valid until the next line is carried over
+            _carry_length = 0;
+        }
+
+        co_await parser.parse_line(line);
+
+        if (parser.is_complete()) {
+            co_return true;
+        }
+    }
+
+    co_return false;
+}
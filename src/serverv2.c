@@ -1,7 +0,0 @@
-// Simple Hello World program
-#include <stdio.h>
-
-int main([[maybe_unused]] int argc, [[maybe_unused]] char** argv) {
-    printf("Hello World\n");
-    return 0;
-}
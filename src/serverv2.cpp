@@ -0,0 +1,326 @@
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <asio.hpp>
+#include <asio/experimental/parallel_group.hpp>
+
+#include "date.hpp"
+#include "mail_store.hpp"
+#include "mep2_session.hpp"
+#include "metrics.hpp"
+
+using asio::awaitable;
+using asio::co_spawn;
+using asio::detached;
+using asio::use_awaitable;
+using asio::ip::tcp;
+
+static constexpr unsigned short default_port = 6000;
+// Far more threads than any machine has CPUs for
+static constexpr size_t max_shards = 1024;
+static constexpr size_t default_max_message_size = 2UL * 1024UL * 1024UL;
+// Far more than a scraper ever sends
+static constexpr size_t max_metrics_request_size = 8 * 1024;
+
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+static awaitable<void> serve(tcp::socket socket, MailStore& store) {
+    try {
+        Mep2Session session(std::move(socket), store);
+        co_await session.run();
+    } catch (const std::exception& e) {
+        std::println(stderr, "Session ended: {}", e.what());
+    }
+}
+
+// Answers a single HTTP request, whatever it asks for, with the metrics
+static awaitable<void> serve_metrics(tcp::socket socket) {
+    try {
+        std::string request;
+        co_await asio::async_read_until(
+            socket, asio::dynamic_buffer(request, max_metrics_request_size), "\r\n\r\n",
+            use_awaitable);
+
+        const std::string body = Metrics::render();
+        const std::string response =
+            std::format("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: {}\r\nConnection: close\r\n\r\n{}",
+                        body.size(), body);
+        co_await asio::async_write(socket, asio::buffer(response), use_awaitable);
+    } catch (const std::exception&) {
+        // Scrapers retry, nothing to do about it
+    }
+
+    asio::error_code ec;
+    socket.shutdown(tcp::socket::shutdown_both, ec);
+}
+
+static awaitable<void> accept_metrics(tcp::acceptor& acceptor) {
+    for (;;) {
+        asio::error_code ec;
+        tcp::socket socket =
+            co_await acceptor.async_accept(asio::redirect_error(use_awaitable, ec));
+        if (ec) {
+            std::println(stderr, "Metrics accept failed: {}", ec.message());
+            continue;
+        }
+
+        co_spawn(acceptor.get_executor(), serve_metrics(std::move(socket)), detached);
+    }
+}
+
+/*
+ * Everything one core needs to serve its share of the connections: its own
+ * io_context, acceptor and MailStore shard. The kernel spreads incoming
+ * connections over the SO_REUSEPORT acceptors, and a connection then stays on
+ * the shard that accepted it, so shards never need to synchronise.
+ *
+ * A shard is warmed up on its own thread before it accepts, see warm_up().
+ */
+class ServerShard {
+  public:
+    ServerShard(const tcp::endpoint& endpoint, const std::filesystem::path& store_path,
+                size_t max_size)
+        // Each io_context is only ever run from one thread
+        : _io_context(1), _work(_io_context.get_executor()), _endpoint(endpoint),
+          _store_path(store_path), _max_size(max_size), _acceptor(_io_context) {}
+
+    asio::io_context& get_io_context() { return _io_context; }
+
+    // Opens the store and starts listening, and gets everything the first
+    // session would otherwise set up out of the way. Connections wait in the
+    // backlog until start(). Shards warm up in parallel, each on its own
+    // thread, a shard that can't listen fails the lot.
+    awaitable<void> warm_up() {
+        _store.emplace(_io_context, _store_path.string(), _max_size);
+        // Reads through a cached transaction, which checks the index and
+        // leaves the transaction for the first query
+        _store->message_count();
+
+        // This thread's metrics block and the date formatting every /env
+        // goes through. The MEP2 zones are a table of fixed offsets, there
+        // is no time zone database to load.
+        Metrics::local();
+        Date date;
+        [[maybe_unused]] auto parsed = date.parse("Sun Aug 11, 2024 07:03 PM EST");
+        date.to_orig_string();
+
+        _acceptor.open(_endpoint.protocol());
+        _acceptor.set_option(tcp::acceptor::reuse_address(true));
+        _acceptor.set_option(reuse_port(true));
+        _acceptor.bind(_endpoint);
+        _acceptor.listen();
+        co_return;
+    }
+
+    // Once every shard is warm
+    void start() { co_spawn(_io_context, accept(), detached); }
+
+    void run(int cpu) {
+        if (cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+
+        _io_context.run();
+    }
+
+    void stop() { _io_context.stop(); }
+
+  private:
+    awaitable<void> accept() {
+        for (;;) {
+            asio::error_code ec;
+            tcp::socket socket =
+                co_await _acceptor.async_accept(asio::redirect_error(use_awaitable, ec));
+            if (ec) {
+                // Most likely out of file descriptors, keep going with the
+                // sessions we have
+                std::println(stderr, "Accept failed: {}", ec.message());
+                continue;
+            }
+
+            co_spawn(_io_context, serve(std::move(socket), *_store), detached);
+        }
+    }
+
+    asio::io_context _io_context;
+    // Keeps run() going between warming up and starting
+    asio::executor_work_guard<asio::io_context::executor_type> _work;
+    const tcp::endpoint _endpoint;
+    const std::filesystem::path _store_path;
+    const size_t _max_size;
+    std::optional<MailStore> _store;
+    tcp::acceptor _acceptor;
+};
+
+// Warms up every shard at once, on their own threads, see
+// ServerShard::warm_up()
+static awaitable<void> warm_up(std::vector<std::unique_ptr<ServerShard>>& shards) {
+    std::vector<decltype(co_spawn(shards[0]->get_io_context(), shards[0]->warm_up(),
+                                  asio::deferred))>
+        warm_ups;
+    for (auto& shard : shards) {
+        warm_ups.push_back(co_spawn(shard->get_io_context(), shard->warm_up(), asio::deferred));
+    }
+
+    auto [order, exceptions] = co_await asio::experimental::make_parallel_group(std::move(warm_ups))
+                                   .async_wait(asio::experimental::wait_for_all(), use_awaitable);
+    for (const auto& exception : exceptions) {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+}
+
+// The CPUs we are allowed to run on, one shard is started for each
+static std::vector<int> available_cpus() {
+    std::vector<int> result;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &cpus)) {
+                result.push_back(cpu);
+            }
+        }
+    }
+
+    return result;
+}
+
+// A whole number from min to max, nullopt otherwise
+static std::optional<size_t> parse_argument(std::string_view arg, size_t min, size_t max) {
+    size_t value = 0;
+    auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+    if (ec != std::errc() || end != arg.data() + arg.size() || value < min || value > max) {
+        return std::nullopt;
+    }
+
+    return value;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 5) {
+        std::println(stderr, "Usage: {} <store path> [port] [shards] [metrics port]", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const std::filesystem::path store_path = argv[1];
+    constexpr size_t max_port = std::numeric_limits<unsigned short>::max();
+
+    unsigned short port = default_port;
+    if (argc > 2) {
+        auto parsed = parse_argument(argv[2], 0, max_port);
+        if (!parsed) {
+            std::println(stderr, "Invalid port: {}", argv[2]);
+            return EXIT_FAILURE;
+        }
+        port = static_cast<unsigned short>(*parsed);
+    }
+
+    std::vector<int> cpus = available_cpus();
+    size_t shard_count = std::max<size_t>(cpus.size(), 1);
+    if (argc > 3) {
+        auto parsed = parse_argument(argv[3], 1, max_shards);
+        if (!parsed) {
+            std::println(stderr, "Invalid shard count: {}, wanted 1 to {}", argv[3], max_shards);
+            return EXIT_FAILURE;
+        }
+        shard_count = *parsed;
+    }
+
+    std::optional<unsigned short> metrics_port;
+    if (argc > 4) {
+        auto parsed = parse_argument(argv[4], 0, max_port);
+        if (!parsed) {
+            std::println(stderr, "Invalid metrics port: {}", argv[4]);
+            return EXIT_FAILURE;
+        }
+        metrics_port = static_cast<unsigned short>(*parsed);
+    }
+
+    // Don't pin if there are more shards than CPUs to put them on
+    bool pin = shard_count <= cpus.size();
+
+    const auto started = std::chrono::steady_clock::now();
+
+    tcp::endpoint endpoint(tcp::v6(), port);
+    std::vector<std::unique_ptr<ServerShard>> shards;
+    std::optional<tcp::acceptor> metrics_acceptor;
+    try {
+        for (size_t i = 0; i < shard_count; ++i) {
+            shards.push_back(std::make_unique<ServerShard>(
+                endpoint, store_path / std::format("shard-{}", i), default_max_message_size));
+        }
+
+        // Scrapes are rare, the first shard can take them on the side. They
+        // are answered while warming up already.
+        if (metrics_port) {
+            const tcp::endpoint metrics_endpoint(tcp::v6(), *metrics_port);
+            metrics_acceptor.emplace(shards[0]->get_io_context(), metrics_endpoint);
+            co_spawn(shards[0]->get_io_context(), accept_metrics(*metrics_acceptor), detached);
+        }
+    } catch (const std::exception& e) {
+        std::println(stderr, "Failed to start server: {}", e.what());
+        return EXIT_FAILURE;
+    }
+
+    auto stop_all = [&shards] {
+        for (auto& shard : shards) {
+            shard->stop();
+        }
+    };
+
+    asio::signal_set signals(shards[0]->get_io_context(), SIGINT, SIGTERM);
+    signals.async_wait([&stop_all](const asio::error_code&, int) { stop_all(); });
+
+    // Written on the first shard's thread, read once all threads are done
+    int status = EXIT_SUCCESS;
+    co_spawn(shards[0]->get_io_context(), warm_up(shards), [&](std::exception_ptr e) {
+        if (e) {
+            try {
+                std::rethrow_exception(e);
+            } catch (const std::exception& error) {
+                std::println(stderr, "Failed to start server: {}", error.what());
+            }
+            status = EXIT_FAILURE;
+            stop_all();
+            return;
+        }
+
+        for (auto& shard : shards) {
+            shard->start();
+        }
+        const auto ready = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started);
+        std::println("Listening on port {} with {} shards, ready in {}", port, shard_count, ready);
+    });
+
+    std::vector<std::jthread> threads;
+    for (size_t i = 0; i < shard_count; ++i) {
+        threads.emplace_back([&shards, &cpus, pin, i] { shards[i]->run(pin ? cpus[i] : -1); });
+    }
+    threads.clear();
+
+    return status;
+}
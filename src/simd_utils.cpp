@@ -0,0 +1,110 @@
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "simd_utils.hpp"
+
+/*
+ * The checksum is only 16 bits wide, so every accumulator below is allowed
+ * to wrap: any carry out of the low 16 bits is lost in the end anyway.
+ */
+
+static uint16_t sum_7bit_tail(const unsigned char* data, size_t length) {
+    uint16_t sum = 0;
+    for (size_t i = 0; i < length; ++i) {
+        sum += data[i] & 0x7F;
+    }
+
+    return sum;
+}
+
+uint16_t sum_7bit_scalar(std::string_view sv) {
+    return sum_7bit_tail(reinterpret_cast<const unsigned char*>(sv.data()), sv.length());
+}
+
+#if defined(__x86_64__)
+
+static uint16_t sum_7bit_sse2(const unsigned char* data, size_t length) {
+    const __m128i mask = _mm_set1_epi8(0x7F);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        // Horizontal sum of each 8 byte half into a 64-bit lane
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_and_si128(v, mask), zero));
+    }
+
+    uint64_t sum = _mm_cvtsi128_si64(acc) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+    return static_cast<uint16_t>(sum + sum_7bit_tail(data + i, length - i));
+}
+
+__attribute__((target("avx2"))) static uint16_t sum_7bit_avx2(const unsigned char* data,
+                                                                size_t length) {
+    const __m256i mask = _mm256_set1_epi8(0x7F);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_and_si256(v, mask), zero));
+    }
+
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    uint64_t sum = _mm_cvtsi128_si64(half) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half));
+    return static_cast<uint16_t>(sum + sum_7bit_sse2(data + i, length - i));
+}
+
+// Most lines are well under this, and for those the cost of bringing up the
+// 256-bit unit outweighs the gain
+static constexpr size_t avx2_min_length = 1024;
+
+static bool have_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+uint16_t sum_7bit(std::string_view sv) {
+    static const bool avx2 = have_avx2();
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(sv.data());
+
+    if (avx2 && sv.length() >= avx2_min_length) {
+        return sum_7bit_avx2(data, sv.length());
+    }
+
+    // SSE2 is part of the x86-64 baseline
+    return sum_7bit_sse2(data, sv.length());
+}
+
+#elif defined(__aarch64__)
+
+// NEON is mandatory on AArch64, no need to check at runtime
+uint16_t sum_7bit(std::string_view sv) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(sv.data());
+    const size_t length = sv.length();
+    const uint8x16_t mask = vdupq_n_u8(0x7F);
+    uint16x8_t acc = vdupq_n_u16(0);
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        // Pairwise add adjacent bytes into the 16-bit lanes
+        acc = vpadalq_u8(acc, vandq_u8(vld1q_u8(data + i), mask));
+    }
+
+    uint16_t sum = vaddvq_u16(acc);
+    return static_cast<uint16_t>(sum + sum_7bit_tail(data + i, length - i));
+}
+
+#else
+
+uint16_t sum_7bit(std::string_view sv) { return sum_7bit_scalar(sv); }
+
+#endif
@@ -1,3 +1,5 @@
+#include <array>
+#include <cstdint>
 #include <stdexcept>
 #include <string>
 
@@ -12,22 +14,38 @@ inline void tab_fill(std::string& out) {
     }
 }
 
-inline unsigned char decode_percent(std::string_view sv) {
-    if (sv.length() != 3) {
-        throw std::invalid_argument("Invalid %% code");
+const char* decode_status_message(DecodeStatus status) {
+    switch (status) {
+    case DecodeStatus::ok:
+        return "Success";
+    case DecodeStatus::stray_slash:
+        return "Stray / in data";
+    case DecodeStatus::short_percent:
+        return "Invalid %% code: too little space";
+    case DecodeStatus::invalid_percent:
+        return "Invalid %% code";
     }
 
-    if (sv[0] != '%') {
-        throw std::runtime_error("expected %% code");
+    return "Unknown decode error";
+}
+
+inline DecodeStatus decode_percent(std::string_view sv, unsigned char& c) {
+    if (sv.length() != 3 || sv[0] != '%') {
+        return DecodeStatus::invalid_percent;
+    }
+
+    int hex1 = hex_value(sv[1]);
+    int hex2 = hex_value(sv[2]);
+    if (hex1 < 0 || hex2 < 0) {
+        return DecodeStatus::invalid_percent;
     }
-	
-    unsigned char hex1 = sv[1];
-    unsigned char hex2 = sv[2];
-    return (hex_to_char(hex1) << 4) | hex_to_char(hex2);
+
+    c = (hex1 << 4) | hex2;
+    return DecodeStatus::ok;
 }
 
-std::string decode_string(std::string_view sv) {
-    std::string result;
+DecodeStatus decode_string(std::string_view sv, std::string& result) {
+    result.clear();
     result.reserve(sv.length());
 
     /* Decoding has to occur in two phases:
@@ -44,22 +62,25 @@ std::string decode_string(std::string_view sv) {
 
         // It is always illegal for a / to appear unescaped
         if (c == '/') {
-            throw std::invalid_argument("Stray / in data");
+            return DecodeStatus::stray_slash;
         }
 
         // % decode
         if (c == '%') {
             if (i + 2 >= sv.length()) {
-                throw std::invalid_argument("Invalid %% code: too little space");
+                return DecodeStatus::short_percent;
             }
-            
+
             // transparent %\r\n, this is not actually part of the text
             if (sv[i + 1] == '\r' && sv[i + 2] == '\n') {
-				i += 2;
-				continue;
-			}
-			
-            c = decode_percent(sv.substr(i, 3));
+                i += 2;
+                continue;
+            }
+
+            DecodeStatus status = decode_percent(sv.substr(i, 3), c);
+            if (status != DecodeStatus::ok) {
+                return status;
+            }
             i += 2;
 
             // Also strip top bits when decoding
@@ -70,7 +91,11 @@ std::string decode_string(std::string_view sv) {
             if (c == 0x0D) {
                 if (i + 2 >= sv.length()) {
                     if (sv[i] == '%') {
-                        unsigned char c_lf = decode_percent(sv.substr(i, 3));
+                        unsigned char c_lf;
+                        status = decode_percent(sv.substr(i, 3), c_lf);
+                        if (status != DecodeStatus::ok) {
+                            return status;
+                        }
                         c_lf &= 0x7F;
 
                         if (c_lf == 0x0A) {
@@ -138,43 +163,142 @@ std::string decode_string(std::string_view sv) {
         }
     }
 
-    return result;
+    return DecodeStatus::ok;
 }
 
-std::string encode_string(std::string_view input) {
+std::string decode_string(std::string_view sv) {
     std::string result;
-    result.reserve(input.length() * 3); // Reserve space for worst-case scenario
-
-    // Characters that need to be encoded
-    static const std::array<unsigned char, 9> special_chars = {0x00, 0x0F, 0x11, 0x12, 0x13,
-                                                               0x15, 0x18, '%',  '/'};
-
-    auto encode_char = [&](unsigned char c) {
-        if (c & 0x80 ||
-            std::find(special_chars.begin(), special_chars.end(), c) != special_chars.end()) {
-            result += '%';
-            result += char_to_hex((c >> 4) & 0x0F);
-            result += char_to_hex(c & 0x0F);
+
+    DecodeStatus status = decode_string(sv, result);
+    if (status != DecodeStatus::ok) {
+        throw std::invalid_argument(decode_status_message(status));
+    }
+
+    return result;
+}
+
+// What each character is sent as, always copied whole so that encoding
+// doesn't need to branch on the character
+struct encoded_char {
+    std::array<char, 3> code;
+    uint8_t length;
+};
+
+static constexpr auto encoded_chars = [] {
+    constexpr std::array<unsigned char, 9> special_chars = {0x00, 0x0F, 0x11, 0x12, 0x13,
+                                                            0x15, 0x18, '%',  '/'};
+    std::array<encoded_char, 256> table{};
+
+    for (size_t c = 0; c < table.size(); ++c) {
+        if (c & 0x80 || std::ranges::find(special_chars, c) != special_chars.end()) {
+            table[c] = {{'%', static_cast<char>(char_to_hex(c >> 4)),
+                         static_cast<char>(char_to_hex(c & 0x0F))},
+                        3};
         } else {
-            result += c;
+            table[c] = {{static_cast<char>(c), 0, 0}, 1};
         }
-    };
+    }
 
-    size_t chars_since_cr = 0;
+    return table;
+}();
+
+size_t StringEncoder::encode(std::string_view& input, std::span<char> output) {
+    size_t in = 0;
+    size_t out = 0;
+
+    for (; in < input.size() && out + max_encoded_char <= output.size(); ++in) {
+        const unsigned char c = input[in];
 
-    for (char c : input) {
         if (c == '\r') {
-            encode_char(c);
-            chars_since_cr = 0;
+            _chars_since_cr = 0;
         } else {
-            if (chars_since_cr >= 200) {
-                result += "%\r\n";
-                chars_since_cr = 0;
+            if (_chars_since_cr >= max_line_length) [[unlikely]] {
+                std::memcpy(output.data() + out, "%\r\n", 3);
+                out += 3;
+                _chars_since_cr = 0;
             }
-            encode_char(c);
-            ++chars_since_cr;
+            ++_chars_since_cr;
+        }
+
+        const encoded_char& encoded = encoded_chars[c];
+        std::memcpy(output.data() + out, encoded.code.data(), encoded.code.size());
+        out += encoded.length;
+    }
+
+    input.remove_prefix(in);
+    return out;
+}
+
+static void decode_percent_code(std::string_view code, std::string& output) {
+    // Transparent newline, not part of the data
+    if (code[1] == '\r' && code[2] == '\n') {
+        return;
+    }
+
+    output.push_back((hex_to_char(code[1]) << 4) | hex_to_char(code[2]));
+}
+
+void StringDecoder::decode(std::string_view input, std::string& output) {
+    output.clear();
+    output.reserve(input.size() + _leftover_length);
+
+    if (_leftover_length) {
+        std::array<char, 3> code;
+        size_t needed = code.size() - _leftover_length;
+
+        if (input.size() < needed) {
+            std::copy(input.begin(), input.end(), _leftover.begin() + _leftover_length);
+            _leftover_length += input.size();
+            return;
+        }
+
+        std::copy_n(_leftover.begin(), _leftover_length, code.begin());
+        std::copy_n(input.begin(), needed, code.begin() + _leftover_length);
+        input.remove_prefix(needed);
+        _leftover_length = 0;
+
+        decode_percent_code(std::string_view(code.data(), code.size()), output);
+    }
+
+    while (!input.empty()) {
+        // memchr is vectorized, let it find the next code and copy
+        // everything up to it in one go
+        const void* percent = std::memchr(input.data(), '%', input.size());
+        if (percent == nullptr) {
+            output.append(input);
+            break;
         }
+
+        size_t run = static_cast<const char*>(percent) - input.data();
+        output.append(input.substr(0, run));
+        input.remove_prefix(run);
+
+        if (input.size() < 3) {
+            // % encoded value, but not enough space
+            std::copy(input.begin(), input.end(), _leftover.begin());
+            _leftover_length = input.size();
+            break;
+        }
+
+        decode_percent_code(input.substr(0, 3), output);
+        input.remove_prefix(3);
     }
+}
 
+std::string encode_string(std::string_view input) {
+    std::string result;
+    encode_string_to(input, result);
     return result;
-}
\ No newline at end of file
+}
+
+void encode_string_to(std::string_view input, std::string& out) {
+    StringEncoder encoder;
+
+    // Most data needs few % codes, grow for what it does need rather than
+    // reserving for the worst case up front
+    while (!input.empty()) {
+        const size_t length = out.size();
+        out.resize(length + input.size() + StringEncoder::max_encoded_char);
+        out.resize(length + encoder.encode(input, std::span(out).subspan(length)));
+    }
+}
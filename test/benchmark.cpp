@@ -0,0 +1,500 @@
+#include <array>
+#include <exception>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <asio.hpp>
+#include <benchmark/benchmark.h>
+
+#include "address.hpp"
+#include "date.hpp"
+#include "mail_store.hpp"
+#include "mep2_pdu_parser.hpp"
+#include "pdu_framer.hpp"
+#include "simd_utils.hpp"
+#include "string_utils.hpp"
+
+static std::string random_data(size_t length) {
+    std::mt19937 rng(length);
+    std::uniform_int_distribution<int> dist(0, 255);
+
+    std::string data(length, '\0');
+    for (auto& c : data) {
+        c = static_cast<char>(dist(rng));
+    }
+
+    return data;
+}
+
+// What a message body mostly looks like, lines of printable text
+static std::string text_data(size_t length) {
+    static constexpr std::string_view line =
+        "The quick brown fox jumps over the lazy dog, 100% of the time / mostly.\r\n";
+
+    std::string data;
+    data.reserve(length + line.length());
+    while (data.length() < length) {
+        data += line;
+    }
+    data.resize(length);
+
+    return data;
+}
+
+template <uint16_t (*Sum)(std::string_view)> static void BM_Checksum(benchmark::State& state) {
+    const std::string data = random_data(state.range(0));
+
+    // A fast wrong answer is no use to anyone
+    if (Sum(data) != sum_7bit_scalar(data)) {
+        state.SkipWithError("Checksum differs from the scalar implementation");
+        return;
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Sum(data));
+    }
+
+    state.SetBytesProcessed(state.iterations() * data.length());
+}
+
+BENCHMARK(BM_Checksum<sum_7bit_scalar>)->RangeMultiplier(8)->Range(8, 1 << 20);
+BENCHMARK(BM_Checksum<sum_7bit>)->RangeMultiplier(8)->Range(8, 1 << 20);
+
+// The PDUs of the SIMPLE_PDU_TEST cases in test.cpp
+static constexpr auto simple_pdus = std::to_array<std::string_view>({
+    "/create*ZZZZ\r\n",
+    "/CREATE*020D\r\n",
+    "/CrEaTe*026D\r\n",
+    "/send *0223\r\n",
+    "/send\t*020C\r\n",
+    "/send \t *024C\r\n",
+    "/send*0203\r",
+    "/send *0223\r",
+    "/send\t*020C\r",
+    "/send \t *024C\r",
+    "/send*0203 \r",
+    "/send *0223\t\r",
+    "/send\t*020C \t \r",
+    "/send \t *024C\t\t\t\t\r",
+    "/busy*021C\r\n",
+    "/create*02CD\r\n",
+    "/term*0211\r\n",
+    "/send*0203\r\n",
+    "/scan*01FE\r\n",
+    "/turn*0222\r\n",
+    "/verify\r\nTo: Gandalf\r\n/end verify*0B01\r\n",
+    "/env\r\nTo: Gandalf\r\n/end env*0869\r\n",
+    "/comment\r\nThis is a comment\r\n/end comment*0E1B\r\n",
+    "/text\r\n/end text*0580\r\n",
+});
+
+static std::vector<std::string_view> split_lines(std::string_view pdu) {
+    std::vector<std::string_view> lines;
+    while (!pdu.empty()) {
+        size_t end = pdu.find('\r') + 1;
+        if (end < pdu.length() && pdu[end] == '\n') {
+            ++end;
+        }
+        lines.push_back(pdu.substr(0, end));
+        pdu.remove_prefix(end);
+    }
+
+    return lines;
+}
+
+static void BM_ParseSimplePdus(benchmark::State& state) {
+    std::vector<std::vector<std::string_view>> corpus;
+    size_t bytes = 0;
+    for (auto pdu : simple_pdus) {
+        corpus.push_back(split_lines(pdu));
+        bytes += pdu.length();
+    }
+
+    PduParser parser;
+    for (auto _ : state) {
+        for (const auto& lines : corpus) {
+            for (auto line : lines) {
+                if (!parser.try_parse_line(line)) {
+                    state.SkipWithError("Failed to parse PDU");
+                    return;
+                }
+            }
+
+            PduVariant pdu = parser.extract_pdu();
+            benchmark::DoNotOptimize(pdu);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * corpus.size());
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+BENCHMARK(BM_ParseSimplePdus);
+
+/*
+ * The PDUs as they were before the hierarchy lost its virtual functions:
+ * every alternative of the variant carried a vtable pointer, and every call
+ * into a PDU went through it. Kept here to compare the two designs side by
+ * side on the same corpus, see BM_PduDispatch.
+ */
+class VirtualPdu {
+  public:
+    virtual ~VirtualPdu() = default;
+
+    virtual PduResult<void> parse_options(std::string_view options) = 0;
+    virtual PduResult<void> parse_line(std::string_view line) = 0;
+    virtual PduResult<void> finalize() = 0;
+};
+
+template <typename T> class VirtualPduOf : public VirtualPdu {
+  public:
+    PduResult<void> parse_options(std::string_view options) override {
+        return _pdu.parse_options(options);
+    }
+    PduResult<void> parse_line(std::string_view line) override { return _pdu.parse_line(line); }
+    PduResult<void> finalize() override { return _pdu.finalize(); }
+
+  private:
+    T _pdu;
+};
+
+template <typename> struct virtual_variant;
+template <typename... T> struct virtual_variant<std::variant<T...>> {
+    using type = std::variant<VirtualPduOf<T>...>;
+};
+using VirtualPduVariant = virtual_variant<PduVariant>::type;
+
+// Calls straight into the concrete PDU, as the parser does now
+struct StaticDispatch {
+    using variant = PduVariant;
+
+    template <typename F> static bool call(variant& pdu, F&& f) {
+        return std::visit([&](auto& alternative) { return f(alternative); }, pdu);
+    }
+};
+
+// Calls through the vtable, as the parser did before
+struct VirtualDispatch {
+    using variant = VirtualPduVariant;
+
+    template <typename F> static bool call(variant& pdu, F&& f) {
+        return std::visit([&](VirtualPdu& alternative) { return f(alternative); }, pdu);
+    }
+};
+
+template <typename Variant, size_t... I>
+static void emplace_alternative(Variant& pdu, size_t index, std::index_sequence<I...>) {
+    ((index == I ? (void)pdu.template emplace<I>() : void()), ...);
+}
+
+// A PDU of the corpus, by what the parser makes of it
+struct DispatchPdu {
+    size_t index;
+    std::vector<std::string_view> body;
+    bool multi_line;
+};
+
+/*
+ * The per-type parsing of the SIMPLE_PDU_TEST corpus, without the line
+ * handling around it that both designs share: the PDU of the right type is
+ * made, then its options, body lines and end go through Dispatch.
+ */
+template <typename Dispatch> static void BM_PduDispatch(benchmark::State& state) {
+    std::vector<DispatchPdu> corpus;
+    PduParser parser;
+    for (auto text : simple_pdus) {
+        const auto lines = split_lines(text);
+        for (auto line : lines) {
+            if (!parser.try_parse_line(line)) {
+                state.SkipWithError("Failed to parse PDU");
+                return;
+            }
+        }
+
+        const bool multi_line = lines.size() > 1;
+        corpus.push_back(DispatchPdu{
+            .index = parser.extract_pdu().index(),
+            .body = multi_line ? std::vector(lines.begin() + 1, lines.end() - 1)
+                               : std::vector<std::string_view>(),
+            .multi_line = multi_line,
+        });
+    }
+
+    typename Dispatch::variant pdu;
+    constexpr auto alternatives = std::make_index_sequence<std::variant_size_v<PduVariant>>();
+    for (auto _ : state) {
+        for (const auto& entry : corpus) {
+            emplace_alternative(pdu, entry.index, alternatives);
+
+            bool ok = Dispatch::call(pdu, [](auto& p) { return p.parse_options("").has_value(); });
+            for (auto line : entry.body) {
+                ok &= Dispatch::call(pdu,
+                                     [line](auto& p) { return p.parse_line(line).has_value(); });
+            }
+            if (entry.multi_line) {
+                ok &= Dispatch::call(pdu, [](auto& p) { return p.finalize().has_value(); });
+            }
+
+            if (!ok) {
+                state.SkipWithError("Failed to parse PDU");
+                return;
+            }
+            benchmark::DoNotOptimize(pdu);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * corpus.size());
+}
+
+BENCHMARK(BM_PduDispatch<StaticDispatch>);
+BENCHMARK(BM_PduDispatch<VirtualDispatch>);
+
+// An envelope with state.range(0) recipients, parsed with and without the
+// parser's arena
+template <bool Arena> static void BM_ParseEnvelope(benchmark::State& state) {
+    std::vector<std::string> lines = {"/env\r\n", "Subject: A fine subject\r\n"};
+    size_t bytes = 0;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        lines.push_back("To: Recipient number " + std::to_string(i) +
+                        " %2F Org: An organization\r\n");
+        lines.push_back(" EMS: INTERNET\r\n");
+        lines.push_back(" MBX: recipient" + std::to_string(i) + "@example.com\r\n");
+    }
+    lines.push_back("/end env*zzzz\r\n");
+    for (const auto& line : lines) {
+        bytes += line.length();
+    }
+
+    PduParser parser = Arena ? PduParser(PduParser::default_arena_size) : PduParser();
+    for (auto _ : state) {
+        for (const auto& line : lines) {
+            if (!parser.try_parse_line(line)) {
+                state.SkipWithError("Failed to parse PDU");
+                return;
+            }
+        }
+
+        PduVariant pdu = parser.extract_pdu();
+        benchmark::DoNotOptimize(pdu);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+BENCHMARK(BM_ParseEnvelope<false>)->RangeMultiplier(8)->Range(1, 512);
+BENCHMARK(BM_ParseEnvelope<true>)->RangeMultiplier(8)->Range(1, 512);
+
+// A /text PDU of state.range(0) bytes of encoded text
+static void BM_ParseText(benchmark::State& state) {
+    // Cut off wherever the size ends, but still a line of its own
+    std::string body = encode_string(text_data(state.range(0))) + "\r\n";
+    std::vector<std::string_view> lines = {"/text ASCII:A description\r\n"};
+    for (auto line : split_lines(body)) {
+        lines.push_back(line);
+    }
+    lines.push_back("/end text*zzzz\r\n");
+
+    size_t bytes = 0;
+    for (auto line : lines) {
+        bytes += line.length();
+    }
+
+    PduParser parser(PduParser::default_arena_size);
+    for (auto _ : state) {
+        for (auto line : lines) {
+            if (!parser.try_parse_line(line)) {
+                state.SkipWithError("Failed to parse PDU");
+                return;
+            }
+        }
+
+        PduVariant pdu = parser.extract_pdu();
+        benchmark::DoNotOptimize(pdu);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+BENCHMARK(BM_ParseText)->RangeMultiplier(16)->Range(256, 1 << 20);
+
+// Encoding and decoding, of text and of the binary data that needs the most
+// % codes
+template <std::string (*Data)(size_t)> static void BM_EncodeString(benchmark::State& state) {
+    const std::string data = Data(state.range(0));
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(encode_string(data));
+    }
+
+    state.SetBytesProcessed(state.iterations() * data.length());
+}
+
+BENCHMARK(BM_EncodeString<text_data>)->RangeMultiplier(16)->Range(256, 1 << 20);
+BENCHMARK(BM_EncodeString<random_data>)->RangeMultiplier(16)->Range(256, 1 << 20);
+
+// A single envelope or option value, these are never longer than a line
+template <std::string (*Data)(size_t)> static void BM_DecodeString(benchmark::State& state) {
+    const std::string encoded = encode_string(Data(state.range(0)));
+    std::string decoded;
+
+    for (auto _ : state) {
+        if (decode_string(encoded, decoded) != DecodeStatus::ok) {
+            state.SkipWithError("Failed to decode");
+            return;
+        }
+        benchmark::DoNotOptimize(decoded);
+    }
+
+    state.SetBytesProcessed(state.iterations() * encoded.length());
+}
+
+BENCHMARK(BM_DecodeString<text_data>)->RangeMultiplier(4)->Range(16, 1024);
+BENCHMARK(BM_DecodeString<random_data>)->RangeMultiplier(4)->Range(16, 1024);
+
+// A stored /text body, arriving in reads of the framer's receive buffer
+template <std::string (*Data)(size_t)> static void BM_StringDecoder(benchmark::State& state) {
+    const std::string encoded = encode_string(Data(state.range(0)));
+    std::string decoded;
+
+    for (auto _ : state) {
+        StringDecoder decoder;
+        std::string_view input = encoded;
+        while (!input.empty()) {
+            std::string_view piece = input.substr(0, PduFramer::receive_buffer_size);
+            input.remove_prefix(piece.length());
+            decoder.decode(piece, decoded);
+            benchmark::DoNotOptimize(decoded);
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * encoded.length());
+}
+
+BENCHMARK(BM_StringDecoder<text_data>)->RangeMultiplier(16)->Range(256, 1 << 20);
+BENCHMARK(BM_StringDecoder<random_data>)->RangeMultiplier(16)->Range(256, 1 << 20);
+
+static constexpr auto dates = std::to_array<std::string_view>({
+    "Sun Aug 11, 2024 12:00 AM GMT",
+    "Sun Aug 11, 2024 12:00 PM EDT",
+    "sun aug 11, 2024 09:41 am PST",
+    "Thu Jan 01, 1970 12:00 AM EAD",
+    "Fri Feb 29, 2036 11:59 PM JST",
+});
+
+static void BM_DateParse(benchmark::State& state) {
+    for (auto _ : state) {
+        for (auto date : dates) {
+            Date d;
+            benchmark::DoNotOptimize(d.parse(date));
+            benchmark::DoNotOptimize(d);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * dates.size());
+}
+
+BENCHMARK(BM_DateParse);
+
+// Every form that is accepted, and near misses of each
+static constexpr auto mciids = std::to_array<std::string_view>({
+    "123-4567",
+    "1234567",
+    "123-456-7890",
+    "1234567890",
+    "000-123-4567",
+    "123-45678",
+    "1234-567",
+    "123-456-789O",
+    "Gandalf the Grey",
+});
+
+static void BM_IsMciid(benchmark::State& state) {
+    for (auto _ : state) {
+        for (auto id : mciids) {
+            benchmark::DoNotOptimize(is_mciid(id));
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * mciids.size());
+}
+
+BENCHMARK(BM_IsMciid);
+
+// The first line of an address in all its shapes, as left after decoding
+static constexpr auto addresses = std::to_array<std::string_view>({
+    "Gandalf the Grey",
+    "111-1111",
+    "Gandalf the Grey / MCI ID: 111-1111",
+    "Gandalf the Grey / Org: The Good Guys / Loc: Hobbiton",
+    "Gandalf the Grey / The Good Guys / Hobbiton",
+    "Gandalf the Grey (BOARD, INSTANT, LIST, OWNER, ONITE, PRINT, RECEIPT)",
+});
+
+static void BM_RawAddressFirstLine(benchmark::State& state) {
+    for (auto _ : state) {
+        for (auto line : addresses) {
+            RawAddress address;
+            benchmark::DoNotOptimize(address.parse_first_line(line));
+            benchmark::DoNotOptimize(address);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * addresses.size());
+}
+
+BENCHMARK(BM_RawAddressFirstLine);
+
+// Files of state.range(0) bytes stored one after the other, with and
+// without syncing each to disk. The store does its work on its own threads,
+// so only the wall clock time says anything.
+static void BM_MailStoreWriteClose(benchmark::State& state) {
+    const std::filesystem::path path =
+        std::filesystem::temp_directory_path() / "mep2_benchmark_store";
+    std::filesystem::remove_all(path);
+
+    const std::string data = text_data(state.range(0));
+    asio::io_context io_context;
+    {
+        MailStore store(io_context, path.string(),
+                        MailStoreOptions{
+                            .commit_window = std::chrono::microseconds(0),
+                            .durable = state.range(1) != 0,
+                        });
+
+        auto store_files = [&]() -> awaitable<void> {
+            for (auto _ : state) {
+                MailStoreFile file = store.create_file();
+                co_await file.write(data);
+                if (!co_await file.close()) {
+                    state.SkipWithError("Failed to store file");
+                    co_return;
+                }
+            }
+        };
+
+        asio::co_spawn(io_context, store_files, [](std::exception_ptr e) {
+            if (e) {
+                std::rethrow_exception(e);
+            }
+        });
+        io_context.run();
+    }
+    std::filesystem::remove_all(path);
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * data.length());
+}
+
+BENCHMARK(BM_MailStoreWriteClose)
+    ->ArgsProduct({{256, 16 << 10, 1 << 20}, {0, 1}})
+    ->ArgNames({"size", "durable"})
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
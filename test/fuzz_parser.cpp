@@ -11,10 +11,8 @@ extern "C" int LLVMFuzzerTestOneInput(const char* data, size_t size) {
         std::string_view line = sv.substr(0, l + 2);
         if (l == std::string_view::npos)
             break;
-        try {
-            // std::println("Parsing: {}", sv.substr(0, l + 1));
-            p.parse_line(line);
-        } catch (...) {
+        // std::println("Parsing: {}", sv.substr(0, l + 1));
+        if (!p.try_parse_line(line)) {
             return 0;
         }
 
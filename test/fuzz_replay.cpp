@@ -0,0 +1,190 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <print>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Runs a fuzz target over a corpus for speed rather than for bugs. Built
+ * from the same target source as the fuzzer, but without sanitizers,
+ * coverage or libFuzzer, so that the time goes to the code under test. Like
+ * the fuzzer it is built with FUZZING_BUILD, checksums aren't checked.
+ *
+ *   fuzz_parser_replay [-runs=N] [-slowest=N] <corpus dir or file>...
+ *
+ * Every input is run N times in a row, from a read only mapping of its file
+ * as libFuzzer would hand it over. Reports inputs/s and bytes/s over the
+ * whole corpus, and the inputs taking the longest per run, which is where
+ * anything quadratic shows up.
+ */
+
+extern "C" int LLVMFuzzerTestOneInput(const char* data, size_t size);
+// Only some targets have one
+extern "C" __attribute__((weak)) int LLVMFuzzerInitialize(int* argc, char*** argv);
+
+using replay_clock = std::chrono::steady_clock;
+
+namespace {
+
+struct InputTiming {
+    std::filesystem::path path;
+    size_t size;
+    // Per run, averaged over all of them
+    std::chrono::nanoseconds mean;
+};
+
+// Returns the time the runs took, or nullopt if the file can't be read
+std::optional<std::chrono::nanoseconds> replay_file(const std::filesystem::path& path,
+                                                    size_t runs, size_t& size) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::println(stderr, "Error opening {}: {}", path.string(), strerror(errno));
+        return std::nullopt;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        std::println(stderr, "Error reading {}: {}", path.string(), strerror(errno));
+        close(fd);
+        return std::nullopt;
+    }
+    size = st.st_size;
+
+    // An empty input is still an input, mmap just can't map it
+    const char* data = "";
+    void* map = MAP_FAILED;
+    if (size) {
+        map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (map == MAP_FAILED) {
+            std::println(stderr, "Error mapping {}: {}", path.string(), strerror(errno));
+            close(fd);
+            return std::nullopt;
+        }
+        data = static_cast<const char*>(map);
+    }
+    close(fd);
+
+    const auto started = replay_clock::now();
+    for (size_t i = 0; i < runs; ++i) {
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    const auto taken = replay_clock::now() - started;
+
+    if (map != MAP_FAILED) {
+        munmap(map, size);
+    }
+    return taken;
+}
+
+// Files in corpus order, directories are walked recursively
+std::vector<std::filesystem::path> corpus_files(const std::vector<std::string_view>& corpora) {
+    std::vector<std::filesystem::path> files;
+
+    for (std::string_view corpus : corpora) {
+        const std::filesystem::path path(corpus);
+        if (!std::filesystem::is_directory(path)) {
+            files.push_back(path);
+            continue;
+        }
+
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(path)) {
+            if (entry.is_regular_file()) {
+                files.push_back(entry.path());
+            }
+        }
+    }
+
+    // Stable from one run to the next, so that runs compare
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+bool parse_option(std::string_view arg, std::string_view name, size_t& value) {
+    if (!arg.starts_with(name)) {
+        return false;
+    }
+
+    value = std::strtoull(std::string(arg.substr(name.size())).c_str(), nullptr, 10);
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t runs = 100;
+    size_t slowest = 10;
+    std::vector<std::string_view> corpora;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (!parse_option(arg, "-runs=", runs) && !parse_option(arg, "-slowest=", slowest)) {
+            corpora.push_back(arg);
+        }
+    }
+
+    const std::string target = std::filesystem::path(argv[0]).filename().string();
+    if (corpora.empty() || !runs) {
+        std::println(stderr, "Usage: {} [-runs=N] [-slowest=N] <corpus dir or file>...", target);
+        return EXIT_FAILURE;
+    }
+
+    if (LLVMFuzzerInitialize) {
+        LLVMFuzzerInitialize(&argc, &argv);
+    }
+
+    std::vector<InputTiming> timings;
+    std::chrono::nanoseconds total{0};
+    size_t total_bytes = 0;
+    bool ok = true;
+
+    for (const auto& path : corpus_files(corpora)) {
+        size_t size = 0;
+        auto taken = replay_file(path, runs, size);
+        if (!taken) {
+            ok = false;
+            continue;
+        }
+
+        total += *taken;
+        total_bytes += size;
+        timings.push_back(InputTiming{.path = path, .size = size, .mean = *taken / runs});
+    }
+
+    if (timings.empty()) {
+        std::println(stderr, "{}: no inputs", target);
+        return EXIT_FAILURE;
+    }
+
+    const double seconds = std::chrono::duration<double>(total).count();
+    const double executions = static_cast<double>(timings.size() * runs);
+    std::println("{}: {} inputs, {} bytes, {} runs each", target, timings.size(), total_bytes,
+                 runs);
+    std::println("  {:.0f} inputs/s, {:.1f} MB/s", executions / seconds,
+                 static_cast<double>(total_bytes * runs) / seconds / 1e6);
+
+    slowest = std::min(slowest, timings.size());
+    std::partial_sort(timings.begin(), timings.begin() + slowest, timings.end(),
+                      [](const InputTiming& a, const InputTiming& b) { return a.mean > b.mean; });
+
+    std::println("Slowest inputs, per run:");
+    for (size_t i = 0; i < slowest; ++i) {
+        const InputTiming& timing = timings[i];
+        const double ns_per_byte = static_cast<double>(timing.mean.count()) /
+                                   static_cast<double>(std::max<size_t>(timing.size, 1));
+        std::println("  {:>10} ns {:>8} bytes {:>8.1f} ns/byte  {}", timing.mean.count(),
+                     timing.size, ns_per_byte, timing.path.string());
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,15 +1,13 @@
 #include <string>
+#include <string_view>
 
 #include "string_utils.hpp"
 
 extern "C" int LLVMFuzzerTestOneInput(const char* data, size_t size) {
-    std::string s(data, size);
+    static std::string out;
 
-    try {
-        decode_string(s);
-    } catch (...) {
-        return 0;
-    }
+    // The throwing decode_string() is a wrapper around this one
+    [[maybe_unused]] DecodeStatus status = decode_string(std::string_view(data, size), out);
 
     return 0;
 }
\ No newline at end of file
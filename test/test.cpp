@@ -1,21 +1,42 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstring>
+#include <deque>
 #include <exception>
 #include <filesystem>
 #include <fstream>
+#include <limits>
+#include <map>
+#include <memory_resource>
 #include <print>
+#include <random>
 #include <regex>
 #include <string_view>
+#include <thread>
+#include <unordered_set>
 #include <variant>
 
 #include <gtest/gtest.h>
 
 #include "address.hpp"
+#include "address_cache.hpp"
 #include "asio/awaitable.hpp"
+#include "asio/experimental/awaitable_operators.hpp"
+#include "batch_import.hpp"
 #include "date.hpp"
 #include "mail_store.hpp"
 #include "mep2_errors.hpp"
 #include "mep2_pdu.hpp"
 #include "mep2_pdu_parser.hpp"
+#include "mep2_session.hpp"
+#include "metrics.hpp"
+#include "pdu_channel.hpp"
+#include "pdu_framer.hpp"
+#include "simd_utils.hpp"
 #include "string_utils.hpp"
+#include "text_sink.hpp"
 
 #define CONCAT_IMPL(x, y) x##_##y
 #define MACRO_CONCAT(x, y) CONCAT_IMPL(x, y)
@@ -199,6 +220,21 @@ TEST_F(PduTypeFixture, Types) {
     }
 }
 
+TEST(Trie, compact) {
+    constexpr auto trie = create_pdu_trie();
+    constexpr auto compact = create_compact_pdu_trie();
+
+    for (std::string_view line :
+         {"busy", "comment", "create", "end", "env", "hdr", "init", "reply", "reset", "scan",
+          "send", "term", "text", "turn", "verify", "VeRiFy*ZZZZ", "env POSTAL", "Text\r\n", "",
+          "e", "en", "ends", "comments", "tex", "x", "*", "cre ate"}) {
+        std::string_view expected_rest = line;
+        std::string_view actual_rest = line;
+        EXPECT_EQ(trie.find(expected_rest), compact.find(actual_rest)) << line;
+        EXPECT_EQ(expected_rest, actual_rest) << line;
+    }
+}
+
 TEST(PDUHash, invalid) {
     EXPECT_THROW(PduChecksum("AABBCCDDEEFF"), std::invalid_argument);
     EXPECT_THROW(PduChecksum("ZZZZZZZZZZZZ"), std::invalid_argument);
@@ -244,6 +280,26 @@ TEST(PDUHash, conversions) {
     EXPECT_EQ(PduChecksum("AAAA").to_string(), std::string("AAAA"));
 }
 
+TEST(PDUHash, vectorized) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist(0, 255);
+
+    // Cover every tail length and misalignment around the vector widths, as
+    // well as blocks large enough to take the widest path
+    for (size_t length : {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 200, 1023, 1024, 1025, 70000}) {
+        std::string data(length + 3, '\0');
+        for (auto& c : data) {
+            c = static_cast<char>(dist(rng));
+        }
+
+        for (size_t offset = 0; offset < 4; ++offset) {
+            SCOPED_TRACE(testing::Message() << "with length " << length << " offset " << offset);
+            std::string_view sv = std::string_view(data).substr(offset, length);
+            EXPECT_EQ(sum_7bit(sv), sum_7bit_scalar(sv));
+        }
+    }
+}
+
 class StringDecodeFixture : public ::testing::Test {
   protected:
     void ExpectDecode(const std::string& in, const std::string& expected) {
@@ -283,6 +339,19 @@ TEST(StringDecode, invalid) {
     EXPECT_THROW(decode_string("Stray / in data"), std::invalid_argument);
 }
 
+TEST(StringDecode, status) {
+    std::string out;
+    EXPECT_EQ(decode_string("Invalid % code", out), DecodeStatus::invalid_percent);
+    EXPECT_EQ(decode_string("Invalid percent code %a", out), DecodeStatus::short_percent);
+    EXPECT_EQ(decode_string("Stray / in data", out), DecodeStatus::stray_slash);
+
+    // The output is replaced, not appended to
+    EXPECT_EQ(decode_string("Gandalf%2F111-1111", out), DecodeStatus::ok);
+    EXPECT_EQ(out, "Gandalf/111-1111");
+    EXPECT_EQ(decode_string("Frodo", out), DecodeStatus::ok);
+    EXPECT_EQ(out, "Frodo");
+}
+
 class StringEncodeFixture : public ::testing::Test {
   protected:
     void ExpectEncode(const std::string& in, const std::string& expected) {
@@ -305,6 +374,68 @@ TEST_F(StringEncodeFixture, ValidValues) {
     }
 }
 
+TEST(StringEncode, chunked) {
+    std::string data;
+    for (size_t i = 0; i < 5000; ++i) {
+        data.push_back(i % 700 == 699 ? '\r' : static_cast<char>(i * 13));
+    }
+    const std::string expected = encode_string(data);
+
+    // Long lines are broken in the same places however the output is split
+    for (size_t chunk_size :
+         {StringEncoder::max_encoded_char, size_t{7}, size_t{201}, size_t{4096}}) {
+        SCOPED_TRACE(testing::Message() << "with chunk size " << chunk_size);
+
+        StringEncoder encoder;
+        std::string_view input = data;
+        std::vector<char> chunk(chunk_size);
+        std::string encoded;
+
+        while (!input.empty()) {
+            size_t length = encoder.encode(input, chunk);
+            ASSERT_GT(length, 0);
+            encoded.append(chunk.data(), length);
+        }
+
+        EXPECT_EQ(encoded, expected);
+    }
+
+    // Too little room for even one character
+    StringEncoder encoder;
+    std::string_view input = data;
+    std::array<char, StringEncoder::max_encoded_char - 1> small;
+    EXPECT_EQ(encoder.encode(input, small), 0);
+    EXPECT_EQ(input.size(), data.size());
+}
+
+TEST(StringDecode, chunked) {
+    std::string data;
+    for (size_t i = 0; i < 5000; ++i) {
+        data.push_back(static_cast<char>(i * 13));
+    }
+    const std::string encoded = encode_string(data);
+
+    // Splitting the input inside a % code or a transparent newline makes no
+    // difference
+    for (size_t chunk_size : {size_t{1}, size_t{2}, size_t{3}, size_t{201}, size_t{4096}}) {
+        SCOPED_TRACE(testing::Message() << "with chunk size " << chunk_size);
+
+        StringDecoder decoder;
+        std::string decoded;
+        std::string piece;
+        for (size_t i = 0; i < encoded.size(); i += chunk_size) {
+            decoder.decode(std::string_view(encoded).substr(i, chunk_size), piece);
+            decoded += piece;
+        }
+
+        EXPECT_EQ(decoded, data);
+    }
+
+    StringDecoder decoder;
+    std::string decoded;
+    EXPECT_THROW(decoder.decode("%G1", decoded), std::invalid_argument);
+}
+
 TEST(is_mciid, invalid) {
     EXPECT_FALSE(is_mciid(""));
     EXPECT_FALSE(is_mciid("111-111-"));
@@ -325,29 +456,90 @@ TEST(is_mciid, valid) {
     EXPECT_TRUE(is_mciid("1111111111"));
 }
 
+TEST(is_mciid, canonical) {
+    EXPECT_EQ(canonicalize_mciid("123-4567"), "123-4567");
+    EXPECT_EQ(canonicalize_mciid("1234567"), "123-4567");
+    EXPECT_EQ(canonicalize_mciid("0001234567"), "123-4567");
+    EXPECT_EQ(canonicalize_mciid("000-123-4567"), "123-4567");
+    EXPECT_EQ(canonicalize_mciid("1234567890"), "123-456-7890");
+    EXPECT_EQ(canonicalize_mciid("123-456-7890"), "123-456-7890");
+    EXPECT_EQ(canonicalize_mciid("0001234"), "000-1234");
+    EXPECT_THROW(canonicalize_mciid("123-45678"), std::invalid_argument);
+}
+
+// The regex based implementation match_mciid replaced
+static std::optional<std::string> regex_canonicalize_mciid(std::string_view line) {
+    static const std::regex mciid_regex(R"(^(\d{3}-\d{4}|\d{3}-\d{3}-\d{4}|\d{7}|\d{10})$)");
+    if (!std::regex_match(line.begin(), line.end(), mciid_regex)) {
+        return std::nullopt;
+    }
+
+    if (line.length() >= 10 && line.starts_with("000")) {
+        line.remove_prefix(line[3] == '-' ? 4 : 3);
+    }
+
+    if (line.length() == 8 || line.length() == 12) {
+        return std::string(line);
+    } else if (line.length() == 7) {
+        return std::format("{}-{}", line.substr(0, 3), line.substr(3));
+    } else {
+        return std::format("{}-{}-{}", line.substr(0, 3), line.substr(3, 3), line.substr(6));
+    }
+}
+
+static void ExpectMatchesRegex(std::string& line, size_t remaining) {
+    auto expected = regex_canonicalize_mciid(line);
+    auto actual = match_mciid(line);
+    ASSERT_EQ(expected.has_value(), actual.has_value()) << line;
+    if (expected) {
+        ASSERT_EQ(*expected, actual->view()) << line;
+    }
+
+    if (!remaining) {
+        return;
+    }
+
+    for (char c : {'0', '7', '-'}) {
+        line.push_back(c);
+        ExpectMatchesRegex(line, remaining - 1);
+        line.pop_back();
+    }
+}
+
+TEST(is_mciid, matches_regex) {
+    // Every string of digits and dashes up to the longest MCI ID
+    std::string line;
+    ExpectMatchesRegex(line, MciId::max_length);
+    EXPECT_FALSE(match_mciid("123-45x7"));
+}
+
 class RawAddressFixture : public ::testing::Test {
   protected:
     void FirstLineExpectEqual(const std::string& line, const RawAddress& expected) {
         RawAddress a;
-        a.parse_first_line(line);
+        ASSERT_TRUE(a.parse_first_line(line));
         EXPECT_EQ(a._id, expected._id);
     }
 
     void FirstLineExpectEqualStr(const std::string& line, const std::string& expected) {
         RawAddress a;
-        a.parse_first_line(line);
+        ASSERT_TRUE(a.parse_first_line(line));
         EXPECT_EQ(a.str(), expected);
     }
 
     void FirstLineExpectMalformed(const std::string& line) {
         RawAddress a;
-        EXPECT_THROW(a.parse_first_line(line), PduMalformedDataError);
+        auto result = a.parse_first_line(line);
+        ASSERT_FALSE(result);
+        EXPECT_EQ(result.error().code, Mep2ErrorCode::Malformed_Data);
     }
 
     void SecondLineExpectMalformed(const std::string& field, const std::string& information) {
         RawAddress a;
-        a.parse_first_line("Gandalf the Gray");
-        EXPECT_THROW(a.parse_field(field, information), PduMalformedDataError);
+        ASSERT_TRUE(a.parse_first_line("Gandalf the Gray"));
+        auto result = a.parse_field(field, information);
+        ASSERT_FALSE(result);
+        EXPECT_EQ(result.error().code, Mep2ErrorCode::Malformed_Data);
     }
 };
 
@@ -477,37 +669,37 @@ TEST_F(RawAddressFixture, EqualsStr) {
 TEST(RawAddressSecond, invalid) {
     {
         RawAddress a;
-        a.parse_first_line("Gandalf the Gray");
-        EXPECT_THROW(a.parse_field("ems:", ""), PduMalformedDataError);
+        ASSERT_TRUE(a.parse_first_line("Gandalf the Gray"));
+        EXPECT_FALSE(a.parse_field("ems:", ""));
     }
 
     {
         RawAddress a;
-        a.parse_first_line("Gandalf the Gray");
-        EXPECT_THROW(a.parse_field("MBX:", "lama"), PduMalformedDataError);
+        ASSERT_TRUE(a.parse_first_line("Gandalf the Gray"));
+        EXPECT_FALSE(a.parse_field("MBX:", "lama"));
     }
 
     {
         RawAddress a;
-        a.parse_first_line("Gandalf the Gray");
-        a.parse_field("EMS:", "Some EMS");
-        EXPECT_THROW(a.parse_field("MBX:", ""), PduMalformedDataError);
+        ASSERT_TRUE(a.parse_first_line("Gandalf the Gray"));
+        ASSERT_TRUE(a.parse_field("EMS:", "Some EMS"));
+        EXPECT_FALSE(a.parse_field("MBX:", ""));
     }
 
     {
         RawAddress a;
-        a.parse_first_line("Gandalf the Gray");
-        a.parse_field("EMS:", "Some EMS");
-        EXPECT_THROW(a.parse_field("EMS:", "Another EMS"), PduMalformedDataError);
+        ASSERT_TRUE(a.parse_first_line("Gandalf the Gray"));
+        ASSERT_TRUE(a.parse_field("EMS:", "Some EMS"));
+        EXPECT_FALSE(a.parse_field("EMS:", "Another EMS"));
     }
 }
 
 TEST(RawAddressSecond, valid) {
     {
         RawAddress a;
-        a.parse_first_line("Gandalf the Gray");
-        a.parse_field("EMS:", "INTERNET");
-        a.parse_field("MBX:", "gandalf@hobbiton.org");
+        ASSERT_TRUE(a.parse_first_line("Gandalf the Gray"));
+        ASSERT_TRUE(a.parse_field("EMS:", "INTERNET"));
+        ASSERT_TRUE(a.parse_field("MBX:", "gandalf@hobbiton.org"));
 
         EXPECT_EQ(a._name, "Gandalf the Gray");
         EXPECT_EQ(a._ems, "INTERNET");
@@ -516,9 +708,9 @@ TEST(RawAddressSecond, valid) {
 
     {
         RawAddress a;
-        a.parse_first_line("Gandalf the Gray");
-        a.parse_field("EMS:", "CompuServe");
-        a.parse_field("MBX:", "CSI:GANDALF");
+        ASSERT_TRUE(a.parse_first_line("Gandalf the Gray"));
+        ASSERT_TRUE(a.parse_field("EMS:", "CompuServe"));
+        ASSERT_TRUE(a.parse_field("MBX:", "CSI:GANDALF"));
 
         EXPECT_EQ(a._name, "Gandalf the Gray");
         EXPECT_EQ(a._ems, "CompuServe");
@@ -527,11 +719,11 @@ TEST(RawAddressSecond, valid) {
 
     {
         RawAddress a;
-        a.parse_first_line("Gandalf the Gray");
-        a.parse_field("EMS:", "HOBBITONMAIL");
-        a.parse_field("MBX:", "OR=Hobbiton");
-        a.parse_field("MBX:", "UN=DT");
-        a.parse_field("MBX:", "GI=Gandalf");
+        ASSERT_TRUE(a.parse_first_line("Gandalf the Gray"));
+        ASSERT_TRUE(a.parse_field("EMS:", "HOBBITONMAIL"));
+        ASSERT_TRUE(a.parse_field("MBX:", "OR=Hobbiton"));
+        ASSERT_TRUE(a.parse_field("MBX:", "UN=DT"));
+        ASSERT_TRUE(a.parse_field("MBX:", "GI=Gandalf"));
 
         EXPECT_EQ(a._name, "Gandalf the Gray");
         EXPECT_EQ(a._ems, "HOBBITONMAIL");
@@ -541,24 +733,248 @@ TEST(RawAddressSecond, valid) {
     }
 }
 
+TEST(AddressCache, key) {
+    auto key = [](std::string_view first_line) {
+        RawAddress address;
+        EXPECT_TRUE(address.parse_first_line(first_line));
+        return AddressKey::from(address);
+    };
+
+    // Written differently, or with other options, it is still the same recipient
+    EXPECT_EQ(key("Gandalf the Gray / 111-1111"), key("gandalf  THE gray/0001111111"));
+    EXPECT_EQ(key("Gandalf the Gray / Org: The Good Guys"),
+              key("Gandalf the Gray / Org: the good  guys (RECEIPT)"));
+
+    EXPECT_NE(key("Gandalf the Gray / 111-1111"), key("Gandalf the Gray / 111-1112"));
+    EXPECT_NE(key("Gandalf the Gray / Org: The Good Guys"),
+              key("Gandalf the Gray / Loc: The Good Guys"));
+    EXPECT_NE(key("Gandalf the Gray"), key("Gandalf the Grey"));
+
+    RawAddress a;
+    ASSERT_TRUE(a.parse_first_line("Gandalf the Gray"));
+    ASSERT_TRUE(a.parse_field("EMS:", "INTERNET"));
+    ASSERT_TRUE(a.parse_field("MBX:", "Gandalf@hobbiton.org"));
+    RawAddress b;
+    ASSERT_TRUE(b.parse_first_line("Gandalf the Gray"));
+    ASSERT_TRUE(b.parse_field("EMS:", "internet"));
+    ASSERT_TRUE(b.parse_field("MBX:", "Gandalf@hobbiton.org"));
+    EXPECT_EQ(AddressKey::from(a), AddressKey::from(b));
+
+    b._mbx[0] = "gandalf@hobbiton.org";
+    EXPECT_NE(AddressKey::from(a), AddressKey::from(b));
+}
+
+TEST(AddressCache, resolve) {
+    AddressCache cache;
+    std::map<std::string, int> lookups;
+    auto lookup = [&lookups](const RawAddress& address) -> Resolution {
+        ++lookups[std::string(address._name)];
+        if (address._name == "Nobody") {
+            return std::nullopt;
+        }
+        return ResolvedAddress{.id = "111-1111", .name = std::string(address._name)};
+    };
+
+    RawAddress gandalf{._name = "Gandalf the Gray"};
+    RawAddress nobody{._name = "Nobody"};
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ(cache.resolve(gandalf, lookup),
+                  (ResolvedAddress{.id = "111-1111", .name = "Gandalf the Gray"}));
+        EXPECT_EQ(cache.resolve(nobody, lookup), std::nullopt);
+    }
+    EXPECT_EQ(lookups["Gandalf the Gray"], 1);
+    EXPECT_EQ(lookups["Nobody"], 1);
+    EXPECT_EQ(cache.size(), 2);
+
+    cache.clear();
+    EXPECT_EQ(cache.find(AddressKey::from(gandalf)), std::nullopt);
+
+    // Without negative caching unknown recipients are looked up every time
+    AddressCache positive_only(AddressCacheOptions{.negative_ttl = std::chrono::seconds(0)});
+    lookups.clear();
+    for (int i = 0; i < 3; ++i) {
+        positive_only.resolve(gandalf, lookup);
+        positive_only.resolve(nobody, lookup);
+    }
+    EXPECT_EQ(lookups["Gandalf the Gray"], 1);
+    EXPECT_EQ(lookups["Nobody"], 3);
+}
+
+TEST(AddressCache, eviction) {
+    AddressCache cache(AddressCacheOptions{.capacity = AddressCache::shard_count * 4});
+    auto address = [](size_t i) {
+        return RawAddress{._name = std::pmr::string(std::to_string(i))};
+    };
+    auto lookup = [](const RawAddress& address) -> Resolution {
+        return ResolvedAddress{.name = std::string(address._name)};
+    };
+
+    const AddressKey kept = AddressKey::from(address(0));
+    cache.insert(kept, lookup(address(0)));
+    for (size_t i = 1; i < 1000; ++i) {
+        cache.resolve(address(i), lookup);
+        // Used all along, so never the least recently used of its shard
+        EXPECT_TRUE(cache.find(kept));
+    }
+    EXPECT_LE(cache.size(), AddressCache::shard_count * 4);
+    EXPECT_EQ(cache.find(AddressKey::from(address(1))), std::nullopt);
+    EXPECT_TRUE(cache.find(AddressKey::from(address(999))));
+}
+
+TEST(AddressCache, threads) {
+    AddressCache cache;
+    std::atomic<int> lookups = 0;
+    auto lookup = [&lookups](const RawAddress& address) -> Resolution {
+        ++lookups;
+        return ResolvedAddress{.name = std::string(address._name)};
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 1000; ++i) {
+                RawAddress address{._name = std::pmr::string(std::to_string(i % 100))};
+                EXPECT_EQ(cache.resolve(address, lookup)->name, std::string_view(address._name));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(cache.size(), 100);
+    EXPECT_GE(lookups, 100);
+    EXPECT_LT(lookups, 4 * 100 + 1);
+}
+
+TEST(PackedAddress, roundTrip) {
+    RawAddress a;
+    ASSERT_TRUE(
+        a.parse_first_line("Gandalf the Gray / Org: The Good Guys / Hobbiton (RECEIPT, LIST)"));
+    ASSERT_TRUE(a.parse_field("EMS:", "HOBBITONMAIL"));
+    ASSERT_TRUE(a.parse_field("MBX:", "OR=Hobbiton"));
+    ASSERT_TRUE(a.parse_field("MBX:", "GI=Gandalf"));
+    a._alert = "Ring";
+
+    const PackedAddress packed(a);
+    EXPECT_EQ(packed.name(), "Gandalf the Gray");
+    EXPECT_EQ(packed.organization(), "The Good Guys");
+    EXPECT_EQ(packed.unresolved_org_loc_1(), "Hobbiton");
+    EXPECT_EQ(packed.id(), "");
+    EXPECT_EQ(packed.alert(), "Ring");
+    EXPECT_EQ(packed.ems(), "HOBBITONMAIL");
+    ASSERT_EQ(packed.mbx_count(), 2);
+    EXPECT_EQ(packed.mbx(0), "OR=Hobbiton");
+    EXPECT_EQ(packed.mbx(1), "GI=Gandalf");
+    EXPECT_TRUE(packed.options().receipt);
+    EXPECT_TRUE(packed.options().list);
+    EXPECT_FALSE(packed.options().board);
+
+    const RawAddress unpacked = packed.unpack();
+    EXPECT_EQ(unpacked, a);
+    EXPECT_EQ(unpacked.str(), a.str());
+    std::string formatted;
+    packed.format_to(formatted);
+    EXPECT_EQ(formatted, a.str());
+    EXPECT_EQ(unpacked._alert, a._alert);
+    EXPECT_EQ(unpacked._receipt, a._receipt);
+
+    const PackedAddress copy = packed;
+    EXPECT_EQ(copy, packed);
+    EXPECT_EQ(copy.hash(), packed.hash());
+    EXPECT_EQ(copy.mbx(1), "GI=Gandalf");
+
+    // What is left after a move reads as an empty address
+    PackedAddress moved = copy;
+    PackedAddress target(std::move(moved));
+    EXPECT_EQ(target, packed);
+    EXPECT_EQ(moved.mbx_count(), 0);
+    EXPECT_EQ(moved.name(), "");
+    EXPECT_EQ(moved.allocated_size(), 0);
+    EXPECT_EQ(moved.unpack(), RawAddress());
+    EXPECT_EQ(PackedAddress(moved), moved);
+    moved = std::move(target);
+    EXPECT_EQ(moved, packed);
+    EXPECT_EQ(target.ems(), "");
+
+    // Pointer, hash, counts and options, the strings are what they are
+    EXPECT_LE(sizeof(PackedAddress), 24);
+    EXPECT_EQ(packed.allocated_size(), 10 * sizeof(uint16_t) + 74);
+}
+
+TEST(PackedAddress, equality) {
+    auto packed = [](std::string_view first_line) {
+        RawAddress address;
+        EXPECT_TRUE(address.parse_first_line(first_line));
+        return PackedAddress(address);
+    };
+
+    EXPECT_EQ(packed("Gandalf the Gray / 111-1111"), packed("Gandalf the Gray/1111111"));
+    EXPECT_NE(packed("Gandalf the Gray / 111-1111"), packed("Gandalf the Grey / 111-1111"));
+    EXPECT_NE(packed("Gandalf the Gray (BOARD)"), packed("Gandalf the Gray"));
+    // The same characters split differently between fields
+    EXPECT_NE(packed("Gandalf / Org: The Good Guys"), packed("Gandalf / Loc: The Good Guys"));
+    EXPECT_NE(packed("ab / Org: c").hash(), packed("a / Org: bc").hash());
+
+    std::unordered_set<PackedAddress> recipients;
+    for (int i = 0; i < 100; ++i) {
+        recipients.insert(packed(std::format("Recipient {} / Org: List", i % 10)));
+    }
+    EXPECT_EQ(recipients.size(), 10);
+    EXPECT_TRUE(recipients.contains(packed("Recipient 3 / Org: List")));
+
+    RawAddress huge;
+    huge._name = std::string(40000, 'a');
+    huge._ems = std::string(40000, 'b');
+    EXPECT_THROW(PackedAddress{huge}, std::length_error);
+}
+
+TEST(PackedAddress, envelope) {
+    PduParser parser;
+    for (std::string_view line :
+         {"/env\r\n", "From: Frodo\r\n", "To: Gandalf %2F Org: The Good Guys (RECEIPT)\r\n",
+          "To: Sam\r\n", "Cc: Merry %2F 111-1111\r\n", "Subject: 100%25 sure\r\n",
+          "/end env*ZZZZ\r\n"}) {
+        ASSERT_TRUE(parser.try_parse_line(line));
+    }
+    const EnvPdu env = std::get<EnvPdu>(parser.extract_pdu());
+
+    MessageMetadata metadata;
+    metadata.set_envelope(env);
+    ASSERT_EQ(metadata.to.size(), 2);
+    EXPECT_EQ(metadata.to[0], PackedAddress(env.get_to_address()[0]));
+    EXPECT_EQ(metadata.to[1].name(), "Sam");
+    ASSERT_EQ(metadata.cc.size(), 1);
+    EXPECT_EQ(metadata.cc[0], PackedAddress(env.get_cc_address()[0]));
+    EXPECT_EQ(metadata.from, "Frodo");
+
+    // The kept envelope renders the same with the recipients handed back
+    ASSERT_TRUE(metadata.envelope);
+    EXPECT_TRUE(metadata.envelope->get_to_address().empty());
+    EXPECT_TRUE(metadata.envelope->get_cc_address().empty());
+    std::string header;
+    metadata.envelope->format_to(header, metadata.to, metadata.cc);
+    EXPECT_EQ(header, env.str());
+}
+
 #define DATETIME_GMT_VALID(string, date)                                                           \
     {                                                                                              \
         Date d;                                                                                    \
-        d.parse(string);                                                                           \
+        ASSERT_TRUE(d.parse(string));                                                              \
         EXPECT_EQ(d.to_gmt_string(), date);                                                        \
     }
 
 #define DATETIME_ZONE_VALID(zone)                                                                  \
     {                                                                                              \
         Date d;                                                                                    \
-        d.parse("Sun Aug 11, 2024 07:03 PM " zone);                                                \
+        ASSERT_TRUE(d.parse("Sun Aug 11, 2024 07:03 PM " zone));                                   \
         EXPECT_EQ(d.to_orig_string(), "Sun Aug 11, 2024 07:03 PM " zone);                          \
     }
 
 #define DATETIME_INVALID(string)                                                                   \
     {                                                                                              \
         Date d;                                                                                    \
-        EXPECT_THROW(d.parse(string), std::invalid_argument);                                      \
+        EXPECT_FALSE(d.parse(string));                                                             \
     }
 
 TEST(DateTest, invalid) {
@@ -570,6 +986,11 @@ TEST(DateTest, invalid) {
     DATETIME_INVALID("Sun Aug 33, 2024 12:00 AM GMT");
     DATETIME_INVALID("Sun Aug 11, 2024 12:00 XD GMT");
     DATETIME_INVALID("Sun Aug 11, 2024 12:00 AM XXX");
+    DATETIME_INVALID("Mon Aug 11, 2024 12:00 AM GMT");
+    DATETIME_INVALID("Fri Feb 30, 2024 12:00 AM GMT");
+    DATETIME_INVALID("Sun Aug 11, 2024 13:00 AM GMT");
+    DATETIME_INVALID("Sun Aug 11, 2024 12:60 AM GMT");
+    DATETIME_INVALID("Sun Aug 11; 2024 12:00 AM GMT");
 }
 
 TEST(DateTest, valid) {
@@ -615,6 +1036,34 @@ TEST(DateTest, valid) {
     DATETIME_GMT_VALID("Sun Aug 11, 2024 12:00 AM MTD", "Sat Aug 10, 2024 08:00 PM GMT");
     DATETIME_GMT_VALID("Sun Aug 11, 2024 12:00 AM JST", "Sat Aug 10, 2024 03:00 PM GMT");
     DATETIME_GMT_VALID("Sun Aug 11, 2024 12:00 AM EAD", "Sat Aug 10, 2024 02:00 PM GMT");
+    DATETIME_GMT_VALID("Sun Aug 11, 2024 12:00 AM SNG", "Sat Aug 10, 2024 04:00 PM GMT");
+    DATETIME_GMT_VALID("Sun Aug 11, 2024 12:00 PM GMT", "Sun Aug 11, 2024 12:00 PM GMT");
+    DATETIME_GMT_VALID("Thu Jan 01, 1970 12:00 AM EAD", "Wed Dec 31, 1969 02:00 PM GMT");
+    DATETIME_GMT_VALID("sun aug 11, 2024 12:00 pm GMT", "Sun Aug 11, 2024 12:00 PM GMT");
+    DATETIME_GMT_VALID("sUN AuG 11, 2024 12:00 Pm GMT", "Sun Aug 11, 2024 12:00 PM GMT");
+    DATETIME_GMT_VALID("SUN AUG 11, 2024 07:03 aM GMT", "Sun Aug 11, 2024 07:03 AM GMT");
+}
+
+TEST(DateTest, mixedCase) {
+    // AM and PM are told apart without regard to case, like the names
+    Date pm;
+    ASSERT_TRUE(pm.parse("Sun Aug 11, 2024 07:03 PM GMT"));
+    Date am;
+    ASSERT_TRUE(am.parse("Sun Aug 11, 2024 07:03 AM GMT"));
+
+    for (std::string_view line :
+         {"Sun Aug 11, 2024 07:03 pM GMT", "sun AUG 11, 2024 07:03 Pm GMT"}) {
+        Date d;
+        ASSERT_TRUE(d.parse(line)) << line;
+        EXPECT_TRUE(d == pm) << line;
+    }
+    for (std::string_view line :
+         {"Sun Aug 11, 2024 07:03 aM GMT", "SUN aug 11, 2024 07:03 Am GMT"}) {
+        Date d;
+        ASSERT_TRUE(d.parse(line)) << line;
+        EXPECT_TRUE(d == am) << line;
+    }
+    EXPECT_FALSE(Date().parse("Sun Aug 11, 2024 07:03 PN GMT"));
 }
 
 class PduParserSyntaxErrorException : public ::testing::TestWithParam<std::string>,
@@ -648,7 +1097,7 @@ INSTANTIATE_TEST_SUITE_P(Various, PduParserSyntaxErrorException,
 	"create*ZZZZ*\r",
 	"/create*QWER\r",
 	"/create invalid parameter*09B5\r",
-	"/verify*zzzz\r",
+	"/verify*zzzz\r\n/end verify*zzzz\r\n",
 	"/create/*ZZZZ\r",
 	"//create*ZZZZ\r"
 	));
@@ -717,7 +1166,11 @@ INSTANTIATE_TEST_SUITE_P(Scan, PduParserMalformedDataErrorException,
                          // clang-format off
     testing::Values(
 		"/scan FOLDER=(NOTREAL)*ZZZZ\r",
-		"/scan SUBJECT=(Invalid%00Character)*ZZZZ\r"
+		"/scan SUBJECT=(Invalid%00Character)*ZZZZ\r",
+		"/scan MAXSIZE=(-100)*ZZZZ\r",
+		"/scan MINSIZE=(10k)*ZZZZ\r",
+		"/scan BEFORE=(Yesterday)*ZZZZ\r",
+		"/scan AFTER=(Sun Aug 11, 2024 13:00 PM GMT)*ZZZZ\r"
 	));
 // clang-format on
 
@@ -753,6 +1206,8 @@ class ScanTest : public PduParserTest {
 };
 
 TEST_F(ScanTest, valid) {
+    using namespace std::chrono;
+
     // clang-format off
     CompareFields("", 
     	std::pair(&ScanPdu::get_folder_id, ScanPdu::folder_id::inbox));
@@ -780,13 +1235,21 @@ TEST_F(ScanTest, valid) {
 		std::pair(&ScanPdu::get_folder_id, ScanPdu::folder_id::outbox),
 		std::pair(&ScanPdu::get_from, "Gandalf The Gray"),
 		std::pair(&ScanPdu::get_subject, "Subject Line"));
+	CompareFields("MINSIZE=(100),MAXSIZE=(2048)",
+		std::pair(&ScanPdu::get_min_size, std::optional<size_t>(100)),
+		std::pair(&ScanPdu::get_max_size, std::optional<size_t>(2048)));
+	CompareFields("AFTER=(Sun Aug 11, 2024 07:03 PM GMT)",
+		std::pair(&ScanPdu::get_after, std::optional(sys_days(2024y / August / 11) + 19h + 3min)),
+		std::pair(&ScanPdu::get_before, std::optional<sys_seconds>()));
+	CompareFields("BEFORE=(Sun Aug 11, 2024 07:03 PM EST)",
+		std::pair(&ScanPdu::get_before, std::optional(sys_days(2024y / August / 12) + 0h + 3min)));
     // clang-format on
 }
 
 INSTANTIATE_TEST_SUITE_P(Verify, PduParserSyntaxErrorException,
                          // clang-format off
     testing::Values(
-		"/verify*ZZZZ\r",
+		"/verify*ZZZZ\r\n/end verify*ZZZZ\r\n",
 		"/verify\r\n/end verify*ZZZZ",
 		"/verify\r\n/end verify*ZZZ\r\n",
 		"/verify\r\n/end verify*",
@@ -798,8 +1261,8 @@ INSTANTIATE_TEST_SUITE_P(
     Verify, PduParserMalformedDataErrorException,
     // clang-format off
     testing::Values(
-		"/verify NONEEXISTANT\r",
-		"/verify STUFF STUFF\r",
+		"/verify NONEEXISTANT\r\n/end verify*ZZZZ\r\n",
+		"/verify STUFF STUFF\r\n/end verify*ZZZZ\r\n",
 		// Unescaped "/" in address
 		"/verify\r\nTo: Gandalf/111-1111\r\n/end verify*ZZZZ\r\n",
 		// Invalid options
@@ -819,6 +1282,50 @@ TEST_F(PduParserTest, Verify) {
     EXPECT_THROW(ParseLine("/verify\r\nCc: Gandalf\r\n/end verify*zzzz\r\n"), PduToRequiredError);
 }
 
+TEST(PduParserResult, errors) {
+    {
+        PduParser p;
+        auto result = p.try_parse_line("/send*0000\r\n");
+        ASSERT_FALSE(result);
+        EXPECT_EQ(result.error().code, Mep2ErrorCode::Checksum_Error);
+    }
+
+    {
+        PduParser p;
+        auto result = p.try_parse_line("/nonsense*ZZZZ\r\n");
+        ASSERT_FALSE(result);
+        EXPECT_EQ(result.error().code, Mep2ErrorCode::PDU_Syntax_Error);
+    }
+
+    {
+        // Errors in the body are held back until the end of the PDU
+        PduParser p;
+        EXPECT_TRUE(p.try_parse_line("/verify\r\n"));
+        EXPECT_TRUE(p.try_parse_line("Cc: Gandalf\r\n"));
+        auto result = p.try_parse_line("/end verify*zzzz\r\n");
+        ASSERT_FALSE(result);
+        EXPECT_EQ(result.error().code, Mep2ErrorCode::Envelope_No_To);
+    }
+
+    {
+        // So are errors in the first line of a multi-line PDU, whose body
+        // is skipped up to its /end
+        PduParser p;
+        EXPECT_TRUE(p.try_parse_line("/text BOGUS\r\n"));
+        EXPECT_TRUE(p.try_parse_line("Some text\r\n"));
+        auto result = p.try_parse_line("/end text*zzzz\r\n");
+        ASSERT_FALSE(result);
+        EXPECT_EQ(result.error().code, Mep2ErrorCode::Malformed_Data);
+    }
+
+    {
+        PduParser p;
+        EXPECT_TRUE(p.try_parse_line("/send*0203\r\n"));
+        EXPECT_TRUE(p.is_complete());
+        EXPECT_TRUE(std::holds_alternative<SendPdu>(p.extract_pdu()));
+    }
+}
+
 template <class P> class VerifyEnvTest : public PduParserTest {
   protected:
     P CreatePdu(const std::string& line) {
@@ -915,10 +1422,10 @@ TEST_F(EnvTest, fields) {
 #define SUBJECT "A very fine subject"
 #define MESSAGEID "A very fine message ID"
     std::vector<RawAddress> gandalf_to = {{._name = "Gandalf"}};
-    std::vector<std::string> source_messageid = {
+    std::pmr::vector<std::pmr::string> source_messageid = {
         "source Special-message id 2", "source Special-message id 3", "source Special-message id 4",
         "source Special-message id 5", "source Special-message id 6"};
-    std::vector<std::pair<std::string, std::string>> u_headers = {
+    std::pmr::vector<std::pair<std::pmr::string, std::pmr::string>> u_headers = {
         {"U-BLAH1", "Unknown custom field 2"},
         {"U-GODOT", "Unknown custom field 3"},
         {"U-LLAMAS-ONE-TWO", "Unknown custom field 4"},
@@ -927,7 +1434,7 @@ TEST_F(EnvTest, fields) {
 
     };
     Date d;
-    d.parse("Sun Aug 11, 2024 12:00 AM GMT");
+    ASSERT_TRUE(d.parse("Sun Aug 11, 2024 12:00 AM GMT"));
 
     CompareFields(START END, gandalf_to, {}, std::pair(&EnvPdu::has_date, false),
                   std::pair(&EnvPdu::has_source_date, false));
@@ -984,6 +1491,38 @@ TEST_F(PduParserTest, EnvToString) {
                          "To: Gandalf\r\n"
                          "Cc: Frodo\r\n"
                          "Subject: This is %2F subject\r\n");
+
+    // Appends, whatever is in the buffer already stays
+    std::string buffer = "Comment: kept\r\n";
+    pdu.format_to(buffer);
+    EXPECT_EQ(buffer, "Comment: kept\r\n" + pdu.str());
+}
+
+TEST_F(PduParserTest, FirstLineErrorAtEnd) {
+    // A bad first line of a multi-line PDU throws at its /end, not at once,
+    // and the body in between is dropped
+    RunAsync([&]() -> asio::awaitable<void> {
+        co_await p.parse_line("/text BOGUS\r\n");
+        EXPECT_FALSE(p.is_complete());
+        co_await p.parse_line("Some text\r\n");
+        EXPECT_FALSE(p.is_complete());
+
+        std::optional<Mep2ErrorCode> code;
+        try {
+            co_await p.parse_line("/end text*zzzz\r\n");
+        } catch (const Mep2Error& e) {
+            code = e.code();
+        }
+        EXPECT_EQ(code, Mep2ErrorCode::Malformed_Data);
+    });
+
+    // Same for a checksum where a multi-line PDU has none
+    EXPECT_THROW(ParseLine("/verify*ZZZZ\r\nTo: Gandalf\r\n/end verify*zzzz\r\n"),
+                 PduSyntaxError);
+
+    // The parser is ready for the next PDU
+    ParseLine("/text\r\nSome text\r\n/end text*zzzz\r\n");
+    EXPECT_TRUE(p.is_complete());
 }
 
 TEST_F(PduParserTest, invalidEnv) {
@@ -991,6 +1530,224 @@ TEST_F(PduParserTest, invalidEnv) {
                  PduEnvelopeDataError);
 }
 
+// Counts what the parser's arena takes from upstream
+class CountingResource : public std::pmr::memory_resource {
+  public:
+    size_t allocations{0};
+
+  private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        ++allocations;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+TEST(PduParserArena, reuse) {
+    std::vector<std::string> lines = {"/env ONITE\r\n", "To: Recipient 0 (BOARD)\r\n"};
+    for (int i = 1; i < 100; ++i) {
+        lines.push_back("To: Recipient " + std::to_string(i) + " %2F Org: Some organization\r\n");
+    }
+    lines.push_back("Subject: A subject long enough not to fit in a std::string\r\n");
+    lines.push_back("U-Custom: A value long enough not to fit in a std::string\r\n");
+    lines.push_back("/end env*zzzz\r\n");
+
+    CountingResource upstream;
+    PduParser parser(1024, 1, &upstream);
+    for (int round = 0; round < 3; ++round) {
+        upstream.allocations = 0;
+        for (const auto& line : lines) {
+            ASSERT_TRUE(parser.try_parse_line(line));
+        }
+        ASSERT_TRUE(parser.is_complete());
+
+        EnvPdu pdu = std::get<EnvPdu>(parser.extract_pdu());
+        ASSERT_EQ(pdu.get_to_address().size(), 100);
+        EXPECT_TRUE(pdu.get_to_address()[0]._board);
+        // Every address starts from scratch
+        EXPECT_FALSE(pdu.get_to_address()[1]._board);
+        EXPECT_EQ(pdu.get_to_address()[99]._name, "Recipient 99");
+        EXPECT_EQ(pdu.get_to_address()[99]._organization, "Some organization");
+        EXPECT_EQ(pdu.get_subject(), "A subject long enough not to fit in a std::string");
+        EXPECT_EQ(pdu.get_u_fields()[0].second,
+                  "A value long enough not to fit in a std::string");
+        EXPECT_NE(pdu.get_to_address().get_allocator().resource(),
+                  std::pmr::get_default_resource());
+
+        // A copy doesn't depend on the parser, nor does what it parses later
+        EnvPdu copy = pdu;
+        EXPECT_EQ(copy.get_to_address().get_allocator().resource(),
+                  std::pmr::get_default_resource());
+        EXPECT_EQ(copy.get_to_address()[99], pdu.get_to_address()[99]);
+        ASSERT_TRUE(copy.parse_line("Subject: Another subject too long for a std::string\r\n"));
+        EXPECT_EQ(copy.get_subject().get_allocator().resource(), std::pmr::get_default_resource());
+
+        // Once the arena has grown to fit, it's reused as it is. The first
+        // round finds it too small, the second replaces it.
+        if (round == 0) {
+            EXPECT_GT(upstream.allocations, 0);
+        } else {
+            EXPECT_EQ(upstream.allocations, round == 1 ? 1 : 0);
+        }
+    }
+}
+
+TEST(PduParserArena, ring) {
+    auto env_lines = [](int n) {
+        return std::vector<std::string>{
+            "/env\r\n", "To: Recipient " + std::to_string(n) + " %2F Org: Some organization\r\n",
+            "Subject: A subject long enough not to fit in a std::string\r\n",
+            "/end env*zzzz\r\n"};
+    };
+
+    // Every PDU taken out stays intact until three more have been
+    constexpr size_t arenas = 4;
+    PduParser parser(256, arenas);
+    std::deque<EnvPdu> pdus;
+    for (int n = 0; n < 20; ++n) {
+        // A PDU that is never taken out doesn't use up an arena of its own
+        ASSERT_TRUE(parser.try_parse_line("/env\r\n"));
+        ASSERT_TRUE(parser.try_parse_line("To: Abandoned %2F Org: Some organization\r\n"));
+        parser.reset();
+
+        for (const auto& line : env_lines(n)) {
+            ASSERT_TRUE(parser.try_parse_line(line));
+        }
+
+        pdus.push_back(std::get<EnvPdu>(parser.extract_pdu()));
+        if (pdus.size() == arenas) {
+            pdus.pop_front();
+        }
+
+        for (size_t i = 0; i < pdus.size(); ++i) {
+            const int expected = n - static_cast<int>(pdus.size() - 1 - i);
+            ASSERT_EQ(std::string_view(pdus[i].get_to_address()[0]._name),
+                      "Recipient " + std::to_string(expected));
+            EXPECT_EQ(pdus[i].get_subject(), "A subject long enough not to fit in a std::string");
+        }
+    }
+}
+
+// The value of a sample in Metrics::render() output, 0 when it isn't there
+static uint64_t MetricsSample(std::string_view sample) {
+    const std::string metrics = Metrics::render();
+    const std::string line = std::string(sample) + " ";
+    const size_t start = metrics.find(line);
+    if (start == std::string::npos || (start && metrics[start - 1] != '\n')) {
+        return 0;
+    }
+    return std::stoull(metrics.substr(start + line.size()));
+}
+
+TEST(Metrics, pdus) {
+    constexpr std::string_view env = "mep2_pdus_total{type=\"ENV\"}";
+    constexpr std::string_view parses = "mep2_pdu_parse_seconds_count";
+    const uint64_t envs = MetricsSample(env);
+    const uint64_t parsed = MetricsSample(parses);
+
+    auto parse_envs = [](int count) {
+        PduParser parser;
+        for (int i = 0; i < count; ++i) {
+            ASSERT_TRUE(parser.try_parse_line("/env\r\n"));
+            ASSERT_TRUE(parser.try_parse_line("To: Recipient\r\n"));
+            ASSERT_TRUE(parser.try_parse_line("/end env*zzzz\r\n"));
+            parser.extract_pdu();
+        }
+    };
+
+    // What a thread recorded is still there after it is gone
+    parse_envs(3);
+    std::thread(parse_envs, 4).join();
+    std::thread(parse_envs, 5).join();
+
+    EXPECT_EQ(MetricsSample(env), envs + 12);
+    EXPECT_EQ(MetricsSample(parses), parsed + 12);
+    EXPECT_EQ(MetricsSample("mep2_pdu_parse_seconds_bucket{le=\"+Inf\"}"),
+              MetricsSample(parses));
+
+    Metrics::local().count_reply(Mep2ErrorCode::Malformed_Data);
+    EXPECT_GE(MetricsSample("mep2_replies_total{code=\"303\"}"), 1);
+}
+
+class PduFramerTest : public PduParserTest {
+  protected:
+    PduFramer f;
+
+    // Feeds input in chunks of chunk_size, every chunk goes through the same
+    // buffer so that anything held on to across chunks gets overwritten.
+    std::vector<PduVariant> Feed(std::string_view input, size_t chunk_size) {
+        std::vector<PduVariant> pdus;
+        RunAsync([&]() -> asio::awaitable<void> {
+            std::string buffer;
+            p.reset();
+            f.reset();
+            while (!input.empty()) {
+                buffer = input.substr(0, chunk_size);
+                input.remove_prefix(buffer.length());
+
+                std::string_view chunk(buffer);
+                while (co_await f.feed(p, chunk)) {
+                    pdus.push_back(p.extract_pdu());
+                }
+            }
+        });
+        return pdus;
+    }
+};
+
+TEST_F(PduFramerTest, Chunked) {
+    const std::string input = "/env\r\n"
+                              "To: Gandalf\r\n"
+                              "Date: Sun Aug 11, 2024 12:00 AM GMT\r\n"
+                              "CC: Frodo\r\n"
+                              "Subject: This is %2f subject\r\n"
+                              "/end env*zzzz\r\n"
+                              "/send*0203\r"
+                              "/env\r\nTo: Gandalf\r\n/end env*0869\r\n";
+
+    for (size_t chunk_size = 1; chunk_size <= input.length(); ++chunk_size) {
+        SCOPED_TRACE(testing::Message() << "with chunk_size " << chunk_size);
+        std::vector<PduVariant> pdus = Feed(input, chunk_size);
+        ASSERT_EQ(pdus.size(), 3);
+        ASSERT_TRUE(std::holds_alternative<EnvPdu>(pdus[0]));
+        EXPECT_EQ(std::get<EnvPdu>(pdus[0]).str(), "Date: Sun Aug 11, 2024 12:00 AM GMT\r\n"
+                                                   "To: Gandalf\r\n"
+                                                   "Cc: Frodo\r\n"
+                                                   "Subject: This is %2F subject\r\n");
+        EXPECT_TRUE(std::holds_alternative<SendPdu>(pdus[1]));
+        EXPECT_TRUE(std::holds_alternative<EnvPdu>(pdus[2]));
+        EXPECT_FALSE(f.has_partial_line());
+    }
+}
+
+TEST_F(PduFramerTest, LineTooLong) {
+    const std::string input = "/comment\r\n" + std::string(PduFramer::max_line_length, 'A') +
+                              "\r\n/end comment*zzzz\r\n";
+    EXPECT_THROW(Feed(input, 100), PduSyntaxError);
+}
+
+TEST_F(PduFramerTest, ReadPdu) {
+    const std::string input = "/verify\r\nTo: Gandalf\r\n/end verify*0B01\r\n/turn*0222\r\n";
+    asio::local::stream_protocol::socket client(io_context);
+    asio::local::stream_protocol::socket server(io_context);
+    asio::local::connect_pair(client, server);
+    asio::write(client, asio::buffer(input));
+
+    RunAsync([&]() -> asio::awaitable<void> {
+        co_await f.read_pdu(server, p);
+        EXPECT_TRUE(std::holds_alternative<VerifyPdu>(p.extract_pdu()));
+        co_await f.read_pdu(server, p);
+        EXPECT_TRUE(std::holds_alternative<TurnPdu>(p.extract_pdu()));
+    });
+}
+
 class TextFixture : public PduParserTest {
   protected:
     void ExpectCorrectType(const std::string& type_text, TextPdu::content_type expected) {
@@ -1005,7 +1762,7 @@ class TextFixture : public PduParserTest {
         EXPECT_EQ(pdu.get_content_type_handling(), expected);
     }
 
-    void ExpectDescription(const std::string& description, const std::string& expected) {
+    void ExpectDescription(const std::string& description, std::string_view expected) {
         std::string line = std::format("/text ASCII:{}\r\n/end text*zzzz\r\n", description);
         ParseLine(line);
         TextPdu pdu = std::get<TextPdu>(p.extract_pdu());
@@ -1073,6 +1830,153 @@ TEST_F(TextFixture, Description) {
     }
 }
 
+// Keeps every chunk it is given, and fails once it has been given more
+// than limit bytes
+class RecordingSink : public TextSink {
+  public:
+    std::vector<std::string> chunks;
+    size_t limit = std::numeric_limits<size_t>::max();
+
+    awaitable<PduResult<void>> write_text(std::string_view text) override {
+        size_ += text.size();
+        if (size_ > limit) {
+            co_return pdu_error(Mep2ErrorCode::Insufficient_Space, "Too large");
+        }
+        chunks.emplace_back(text);
+        co_return PduResult<void>{};
+    }
+
+  private:
+    size_t size_ = 0;
+};
+
+static std::string TextBody(size_t lines) {
+    std::string body;
+    for (size_t i = 0; i < lines; ++i) {
+        body += std::format("Line {} of the body, with a %25 code\r\n", i);
+    }
+    return body;
+}
+
+TEST_F(TextFixture, Sink) {
+    const std::string body = TextBody(2000);
+    RecordingSink sink;
+    p.set_text_sink(&sink);
+    ParseLine("/text ASCII\r\n" + body + "/end text*zzzz\r\n");
+    ASSERT_TRUE(p.is_complete());
+    std::get<TextPdu>(p.extract_pdu());
+
+    // In chunks, no bigger than one line past the chunk size
+    ASSERT_GT(sink.chunks.size(), 1);
+    std::string received;
+    for (const auto& chunk : sink.chunks) {
+        EXPECT_LE(chunk.size(), PduParser::text_chunk_size + PduFramer::max_line_length);
+        received += chunk;
+    }
+    EXPECT_EQ(received, body);
+
+    // Other PDUs are left alone
+    sink.chunks.clear();
+    ParseLine("/comment\r\nNot a body\r\n/end comment*zzzz\r\n");
+    EXPECT_TRUE(sink.chunks.empty());
+}
+
+TEST_F(TextFixture, SinkError) {
+    RecordingSink sink;
+    sink.limit = PduParser::text_chunk_size * 2;
+    p.set_text_sink(&sink);
+
+    // Reported at the end, after the whole body has been read
+    EXPECT_THROW(ParseLine("/text\r\n" + TextBody(4000) + "/end text*zzzz\r\n"),
+                 InsufficientSpaceError);
+    EXPECT_EQ(sink.chunks.size(), 1);
+
+    // The next one starts from scratch
+    sink.chunks.clear();
+    sink.limit = std::numeric_limits<size_t>::max();
+    ParseLine("/text\r\nShort\r\n/end text*zzzz\r\n");
+    ASSERT_TRUE(p.is_complete());
+    ASSERT_EQ(sink.chunks.size(), 1);
+    EXPECT_EQ(sink.chunks[0], "Short\r\n");
+}
+
+TEST_F(TextFixture, SinkWithoutParseLine) {
+    RecordingSink sink;
+    p.set_text_sink(&sink);
+
+    // Nothing waits for the sink, so only so much of the body is kept
+    ASSERT_TRUE(p.try_parse_line("/text\r\n"));
+    const std::string text = TextBody(2000);
+    std::string_view body = text;
+    while (!body.empty()) {
+        size_t line = body.find('\n') + 1;
+        EXPECT_TRUE(p.try_parse_line(body.substr(0, line)));
+        body.remove_prefix(line);
+    }
+
+    auto result = p.try_parse_line("/end text*zzzz\r\n");
+    ASSERT_FALSE(result);
+    EXPECT_EQ(result.error().code, Mep2ErrorCode::System_Error);
+    EXPECT_TRUE(sink.chunks.empty());
+}
+
+TEST_F(TextFixture, ChannelBackPressure) {
+    using namespace asio::experimental::awaitable_operators;
+
+    // Far more than the channel holds
+    const std::string body = TextBody(20000);
+    constexpr size_t capacity = 2;
+    PduChannel channel(io_context.get_executor(), capacity);
+    p.set_text_sink(&channel);
+
+    size_t parsed = 0;
+    size_t most_ahead = 0;
+    std::string written;
+
+    auto parse = [&]() -> awaitable<void> {
+        p.reset();
+        co_await p.parse_line("/text\r\n");
+        std::string_view text = body;
+        while (!text.empty()) {
+            size_t line = text.find('\n') + 1;
+            co_await p.parse_line(text.substr(0, line));
+            parsed += line;
+            text.remove_prefix(line);
+        }
+        co_await p.parse_line("/end text*zzzz\r\n");
+        co_await channel.send(p.extract_pdu());
+        channel.close();
+    };
+
+    // A slow disk, far slower than parsing
+    auto write = [&]() -> awaitable<void> {
+        asio::steady_timer timer(co_await asio::this_coro::executor);
+        while (auto item = co_await channel.receive()) {
+            auto* chunk = std::get_if<PduChannel::BodyChunk>(&*item);
+            if (!chunk) {
+                // Behind all of its body
+                auto& pdu = std::get<PduResult<PduVariant>>(*item);
+                EXPECT_TRUE(pdu && std::holds_alternative<TextPdu>(*pdu));
+                EXPECT_EQ(written, body);
+                continue;
+            }
+
+            most_ahead = std::max(most_ahead, parsed - written.size());
+            timer.expires_after(std::chrono::milliseconds(1));
+            co_await timer.async_wait(asio::use_awaitable);
+            written += chunk->text;
+        }
+    };
+
+    RunAsync([&]() -> awaitable<void> { co_await (parse() && write()); });
+    EXPECT_EQ(written, body);
+
+    // The parser waited rather than run ahead: at most the chunks in the
+    // channel, the one being written and the one waiting for room
+    EXPECT_LE(most_ahead,
+              (capacity + 2) * (PduParser::text_chunk_size + PduFramer::max_line_length));
+}
+
 class TemporaryStorageTest : public AsyncTest {
   protected:
     std::filesystem::path temp_root;
@@ -1099,7 +2003,7 @@ TEST_F(TemporaryStorageTest, text) {
         size_t bytes = co_await f.write(data);
         EXPECT_EQ(bytes, data.size());
         filename = f.get_filename();
-        EXPECT_TRUE(f.close());
+        EXPECT_TRUE(co_await f.close());
 
         std::filesystem::path file_path = temp_path / f.get_filename();
         std::ifstream file(file_path);
@@ -1113,7 +2017,7 @@ TEST_F(TemporaryStorageTest, text) {
         MailStoreFile f = p.open_file(filename);
         std::string content = co_await f.read(1024);
         EXPECT_EQ(content.size(), data.size());
-        EXPECT_TRUE(f.close());
+        EXPECT_TRUE(co_await f.close());
 
         EXPECT_EQ(content, data);
     });
@@ -1123,7 +2027,7 @@ TEST_F(TemporaryStorageTest, text) {
         MailStoreFile f = p.open_file(filename);
         std::string content = co_await f.read(5);
         EXPECT_EQ(content.size(), 5);
-        EXPECT_TRUE(f.close());
+        EXPECT_TRUE(co_await f.close());
 
         EXPECT_EQ(content, data.substr(0, 5));
     });
@@ -1160,7 +2064,7 @@ TEST_F(TemporaryStorageTest, binary) {
 
         // EXPECT_EQ(written, decoded_content.size());
         filename = f.get_filename();
-        EXPECT_TRUE(f.close());
+        EXPECT_TRUE(co_await f.close());
 
         std::filesystem::path file_path = temp_path / f.get_filename();
         std::ifstream file(file_path, std::ios::binary | std::ios::in);
@@ -1170,3 +2074,748 @@ TEST_F(TemporaryStorageTest, binary) {
         EXPECT_EQ(content, decoded_content);
     });
 }
+
+TEST_F(TemporaryStorageTest, binaryChunked) {
+    std::filesystem::path temp_path = temp_root / "data";
+    temp_path = temp_path / "lama";
+
+    std::ifstream encoded_file("FAKESHAR.TXT", std::ios::binary | std::ios::in);
+    ASSERT_FALSE(encoded_file.fail());
+    std::string encoded_content((std::istreambuf_iterator<char>(encoded_file)),
+                                std::istreambuf_iterator<char>());
+
+    std::ifstream decoded_file("FAKESHAR.COM", std::ios::binary | std::ios::in);
+    ASSERT_FALSE(decoded_file.fail());
+    std::string decoded_content((std::istreambuf_iterator<char>(decoded_file)),
+                                std::istreambuf_iterator<char>());
+
+    // A % code can be split across chunks at every possible position
+    for (size_t chunk_size : {1, 2, 3, 4, 7, 4096}) {
+        SCOPED_TRACE(testing::Message() << "with chunk_size " << chunk_size);
+
+        RunAsync([&]() -> asio::awaitable<void> {
+            MailStore p(io_context, temp_path, 1024);
+            MailStoreFile f = p.create_file();
+
+            std::string_view encoded(encoded_content);
+            while (!encoded.empty()) {
+                size_t w = co_await f.write_encoded(encoded.substr(0, chunk_size));
+                encoded.remove_prefix(w);
+            }
+
+            EXPECT_TRUE(co_await f.close());
+
+            std::ifstream file(temp_path / f.get_filename(), std::ios::binary | std::ios::in);
+            EXPECT_FALSE(file.fail());
+            std::string content((std::istreambuf_iterator<char>(file)),
+                                std::istreambuf_iterator<char>());
+            EXPECT_EQ(content, decoded_content);
+        });
+    }
+}
+
+TEST_F(TemporaryStorageTest, writeText) {
+    std::filesystem::path temp_path = temp_root / "text";
+    const std::string body = TextBody(1000);
+    std::string decoded = std::regex_replace(body, std::regex("%25"), "%");
+
+    RunAsync([&]() -> asio::awaitable<void> {
+        MailStore store(io_context, temp_path, decoded.size());
+
+        // In chunks the size the parser hands them over in
+        auto write_body = [](MailStoreFile& file, std::string_view text) -> awaitable<void> {
+            while (!text.empty()) {
+                size_t chunk = text.rfind('\n', PduParser::text_chunk_size) + 1;
+                co_await file.write_text(text.substr(0, chunk));
+                text.remove_prefix(chunk);
+            }
+        };
+
+        MailStoreFile file = store.create_file();
+        co_await write_body(file, body);
+        EXPECT_EQ(file.get_size(), decoded.size());
+        EXPECT_EQ(file.view(), decoded);
+        EXPECT_TRUE(co_await file.close());
+
+        // One more line is too much, and nothing of that chunk is written
+        std::optional<Mep2ErrorCode> code;
+        {
+            MailStoreFile too_large = store.create_file();
+            try {
+                co_await write_body(too_large, body + "One more\r\n");
+            } catch (const Mep2Error& e) {
+                code = e.code();
+            }
+            EXPECT_LE(too_large.get_size(), decoded.size());
+        }
+        EXPECT_EQ(code, Mep2ErrorCode::Insufficient_Space);
+
+        code.reset();
+        MailStoreFile bad_code = store.create_file();
+        try {
+            co_await bad_code.write_text("A bad %ZZ code\r\n");
+        } catch (const Mep2Error& e) {
+            code = e.code();
+        }
+        EXPECT_EQ(code, Mep2ErrorCode::Malformed_Data);
+    });
+}
+
+TEST(Mep2Session, format_reply) {
+    EXPECT_EQ(format_reply(Mep2ErrorCode::Success),
+              "/reply\r\n100 Request performed successfully\r\n/end reply*1328\r\n");
+}
+
+TEST_F(TemporaryStorageTest, session) {
+    MailStore store(io_context, temp_root / "session", 1024);
+
+    tcp::acceptor acceptor(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io_context);
+    client.connect(acceptor.local_endpoint());
+    Mep2Session session(acceptor.accept(), store);
+
+    asio::write(client, asio::buffer(std::string_view("/send*0203\r\n"
+                                                      "/send*0000\r\n"
+                                                      "/term*0211\r\n")));
+
+    RunAsync([&]() -> asio::awaitable<void> { co_await session.run(); });
+
+    // The session closes the connection after /term
+    std::string replies;
+    asio::error_code ec;
+    asio::read(client, asio::dynamic_buffer(replies), ec);
+    EXPECT_EQ(ec, asio::error::eof);
+
+    EXPECT_EQ(replies, format_reply(Mep2ErrorCode::Protocol_Violation, "No message to send") +
+                           format_reply(Mep2ErrorCode::Checksum_Error,
+                                        "Wanted: 0000, actual: 0203") +
+                           format_reply(Mep2ErrorCode::Success));
+}
+
+TEST_F(TemporaryStorageTest, sessionPipelined) {
+    MailStore store(io_context, temp_root / "pipelined", 1024);
+
+    tcp::acceptor acceptor(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io_context);
+    client.connect(acceptor.local_endpoint());
+    Mep2Session session(acceptor.accept(), store);
+
+    // Far more than the session reads ahead, all in one go
+    std::string requests;
+    std::string expected;
+    for (size_t i = 0; i < 4 * Mep2Session::pipeline_depth; ++i) {
+        requests += "/env\r\nTo: Recipient " + std::to_string(i) + "\r\n/end env*zzzz\r\n";
+        expected += format_reply(Mep2ErrorCode::Success);
+        if (i % 3 == 0) {
+            requests += "/send*0000\r\n";
+            expected += format_reply(Mep2ErrorCode::Checksum_Error, "Wanted: 0000, actual: 0203");
+        }
+    }
+    requests += "/term*0211\r\n";
+    expected += format_reply(Mep2ErrorCode::Success);
+    // Never read, the session stops at /term
+    requests += "/send*0203\r\n";
+    asio::write(client, asio::buffer(requests));
+
+    RunAsync([&]() -> asio::awaitable<void> { co_await session.run(); });
+
+    // Every reply in the order of the requests
+    std::string replies;
+    asio::error_code ec;
+    asio::read(client, asio::dynamic_buffer(replies), ec);
+    EXPECT_EQ(ec, asio::error::eof);
+    EXPECT_EQ(replies, expected);
+}
+
+TEST_F(TemporaryStorageTest, sessionFirstLineError) {
+    MailStore store(io_context, temp_root / "first_line", 1024);
+
+    tcp::acceptor acceptor(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io_context);
+    client.connect(acceptor.local_endpoint());
+    Mep2Session session(acceptor.accept(), store);
+
+    // The body goes with the bad first line, rather than being read as PDUs
+    // of its own, and the PDU gets a single reply
+    std::string requests = "/text BOGUS\r\nSome text\r\nMore text\r\n/end text*zzzz\r\n"
+                           "/env BOGUS\r\nTo: Recipient\r\n/end env*zzzz\r\n"
+                           "/term*0211\r\n";
+    asio::write(client, asio::buffer(requests));
+
+    RunAsync([&]() -> asio::awaitable<void> { co_await session.run(); });
+
+    std::string replies;
+    asio::error_code ec;
+    asio::read(client, asio::dynamic_buffer(replies), ec);
+    EXPECT_EQ(ec, asio::error::eof);
+    EXPECT_EQ(replies, format_reply(Mep2ErrorCode::Malformed_Data, "Unknown text type") +
+                           format_reply(Mep2ErrorCode::Malformed_Data, "Unknown priority") +
+                           format_reply(Mep2ErrorCode::Success));
+}
+
+TEST_F(TemporaryStorageTest, sessionMessage) {
+    std::filesystem::path temp_path = temp_root / "message";
+    MailStore store(io_context, temp_path, 1024);
+
+    tcp::acceptor acceptor(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io_context);
+    client.connect(acceptor.local_endpoint());
+    Mep2Session session(acceptor.accept(), store);
+
+    const std::string envelope = "/env\r\nTo: Recipient\r\nSubject: Hello\r\n/end env*zzzz\r\n";
+    std::string requests = envelope + "/text\r\nWith a %25 code\r\n/end text*zzzz\r\n" +
+                           "/text\r\nAnd another text\r\n/end text*zzzz\r\n/send*0203\r\n";
+    std::string expected = format_reply(Mep2ErrorCode::Success) +
+                           format_reply(Mep2ErrorCode::Success) +
+                           format_reply(Mep2ErrorCode::Success) +
+                           format_reply(Mep2ErrorCode::Success);
+
+    // Larger than the store takes, the send fails too
+    requests += envelope + "/text\r\n" + TextBody(100) + "/end text*zzzz\r\n/send*0203\r\n";
+    expected += format_reply(Mep2ErrorCode::Success) +
+                format_reply(Mep2ErrorCode::Insufficient_Space, "Message larger than 1024 bytes") +
+                format_reply(Mep2ErrorCode::Insufficient_Space, "Message larger than 1024 bytes");
+
+    // A broken text leaves the message incomplete
+    requests += envelope + "/text\r\nSome text\r\n/end text*0000\r\n/send*0203\r\n";
+    expected += format_reply(Mep2ErrorCode::Success) +
+                format_reply(Mep2ErrorCode::Checksum_Error, "Wanted: 0000, actual: 0910") +
+                format_reply(Mep2ErrorCode::Checksum_Error, "Wanted: 0000, actual: 0910");
+
+    // Nor is one that never gets to its /send
+    requests += envelope + "/term*0211\r\n";
+    expected += format_reply(Mep2ErrorCode::Success) + format_reply(Mep2ErrorCode::Success);
+    asio::write(client, asio::buffer(requests));
+
+    RunAsync([&]() -> asio::awaitable<void> { co_await session.run(); });
+
+    std::string replies;
+    asio::error_code ec;
+    asio::read(client, asio::dynamic_buffer(replies), ec);
+    EXPECT_EQ(ec, asio::error::eof);
+    EXPECT_EQ(replies, expected);
+
+    // Only the first message is delivered, with both of its texts
+    EXPECT_EQ(store.message_count(), 1);
+    std::vector<std::filesystem::path> files;
+    for (const auto& entry : std::filesystem::directory_iterator(temp_path)) {
+        if (entry.is_regular_file()) {
+            files.push_back(entry.path());
+        }
+    }
+    ASSERT_EQ(files.size(), 1);
+    std::ifstream file(files[0], std::ios::binary | std::ios::in);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(content, "With a % code\r\nAnd another text\r\n");
+}
+
+TEST_F(TemporaryStorageTest, abandoned) {
+    std::filesystem::path temp_path = temp_root / "abandoned";
+
+    RunAsync([&]() -> asio::awaitable<void> {
+        MailStore p(io_context, temp_path, 1024);
+        {
+            MailStoreFile f = p.create_file();
+            co_await f.write("Never delivered\r\n");
+        }
+
+        MailStoreFile f = p.create_file();
+        co_await f.write("Delivered\r\n");
+        EXPECT_TRUE(co_await f.close());
+    });
+
+    // Only the delivered file is left, whichever way files were created
+    EXPECT_TRUE(std::filesystem::is_empty(temp_path / "tmp"));
+    size_t files = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(temp_path)) {
+        files += entry.is_regular_file();
+    }
+    EXPECT_EQ(files, 1);
+}
+
+TEST_F(TemporaryStorageTest, query) {
+    using namespace std::chrono;
+    using folder_id = QueryPdu::folder_id;
+    const sys_seconds day = sys_days(2024y / August / 11);
+
+    const std::array<MessageMetadata, 5> messages{{
+        {folder_id::inbox, "Gandalf", "Fireworks", day + 1h, 0},
+        {folder_id::inbox, "gandalf the grey", "You shall not pass", day + 2h, 0},
+        {folder_id::inbox, "Frodo", "Fireworks again", day + 3h, 0},
+        {folder_id::outbox, "Gandalf", "Re: Fireworks", day + 4h, 0},
+        {folder_id::inbox, "Sam", "Po-tay-toes", day + 5h, 0},
+    }};
+
+    std::filesystem::path temp_path = temp_root / "query";
+    MailStore store(io_context, temp_path, MailStoreOptions{.max_size = 1024});
+
+    std::vector<std::string> filenames(messages.size());
+    for (size_t i = 0; i < messages.size(); ++i) {
+        co_spawn(
+            io_context,
+            [&, i]() -> asio::awaitable<void> {
+                MailStoreFile f = store.create_file();
+                f.metadata() = messages[i];
+                // Message i is 10 * (i + 1) bytes long
+                co_await f.write(std::string(10 * (i + 1), 'x'));
+                EXPECT_TRUE(co_await f.close());
+                filenames[i] = f.get_filename();
+            },
+            asio::detached);
+    }
+
+    io_context.run();
+
+    auto expect_query = [&](const MessageQuery& query, std::vector<size_t> expected) {
+        std::vector<std::string> wanted;
+        for (size_t i : expected) {
+            wanted.push_back(filenames[i]);
+        }
+
+        std::vector<std::string> found = store.query(query);
+        std::ranges::sort(wanted);
+        std::ranges::sort(found);
+        EXPECT_EQ(found, wanted);
+    };
+
+    expect_query({}, {0, 1, 2, 4});
+    expect_query({.folder = folder_id::outbox}, {3});
+    expect_query({.folder = folder_id::trash}, {});
+    expect_query({.from = "gandalf"}, {0, 1});
+    expect_query({.subject = "fireworks"}, {0, 2});
+    expect_query({.from = "gandalf", .subject = "fire"}, {0});
+    expect_query({.min_size = 20, .max_size = 30}, {1, 2});
+    expect_query({.min_size = 30}, {2, 4});
+    expect_query({.max_size = 20}, {0, 1});
+    expect_query({.before = day + 3h}, {0, 1});
+    expect_query({.after = day + 3h}, {4});
+    expect_query({.before = day + 5h, .after = day + 1h}, {1, 2});
+    expect_query({.from = "frodo", .min_size = 40}, {});
+
+    // Straight from a SCAN
+    ScanPdu scan;
+    ASSERT_TRUE(scan.parse_options("SUBJECT=(FIRE),MAXSIZE=(10)"));
+    expect_query(MessageQuery::from_pdu(scan), {0});
+}
+
+TEST_F(TemporaryStorageTest, record) {
+    PduParser parser;
+    for (std::string_view line :
+         {"/env\r\n", "From: Frodo\r\n", "To: Gandalf\r\n", "Cc: Sam\r\n",
+          "Subject: There and back again\r\n", "Date: Sun Aug 11, 2024 07:03 PM EST\r\n",
+          "Message-id: 1234\r\n", "U-RING: The one\r\n", "/end env*ZZZZ\r\n"}) {
+        ASSERT_TRUE(parser.try_parse_line(line));
+    }
+    const EnvPdu env = std::get<EnvPdu>(parser.extract_pdu());
+
+    MailStore store(io_context, temp_root / "record", 1024);
+    std::string filename;
+
+    RunAsync([&]() -> asio::awaitable<void> {
+        MailStoreFile f = store.create_file();
+        f.metadata().folder = QueryPdu::folder_id::desk;
+        f.metadata().set_envelope(env);
+        co_await f.write("Some data\r\n");
+        EXPECT_TRUE(co_await f.close());
+        filename = f.get_filename();
+    });
+
+    EXPECT_TRUE(store.read_message(filename, [&](const EmailMessage& message) {
+        EXPECT_EQ(message.folder(), QueryPdu::folder_id::desk);
+        EXPECT_EQ(message.from(), "Frodo");
+        EXPECT_EQ(message.subject(), "There and back again");
+        EXPECT_EQ(message.date(), env.get_date()._gmt_time);
+        EXPECT_EQ(message.size(), 11);
+
+        EmailRecord::Reader record = message.record();
+        ASSERT_EQ(record.getTo().size(), 1);
+        EXPECT_EQ(to_string_view(record.getTo()[0].getName()), "Gandalf");
+        ASSERT_EQ(record.getCc().size(), 1);
+        EXPECT_EQ(to_string_view(record.getCc()[0].getName()), "Sam");
+        EXPECT_EQ(record.getDate().getZone(), env.get_date()._orig_zone);
+        EXPECT_FALSE(record.hasSourceDate());
+        EXPECT_EQ(to_string_view(record.getMessageId()), "1234");
+        ASSERT_EQ(record.getUFields().size(), 1);
+        EXPECT_EQ(to_string_view(record.getUFields()[0].getValue()), "The one");
+        EXPECT_EQ(message.header(), env.str());
+    }));
+    EXPECT_FALSE(store.read_message("nonexistent", [](const EmailMessage&) { FAIL(); }));
+
+    EXPECT_EQ(store.query({.folder = QueryPdu::folder_id::desk, .from = "frodo"}),
+              std::vector{filename});
+}
+
+TEST_F(TemporaryStorageTest, mapGrowth) {
+    constexpr size_t initial_size = 128 * 1024;
+    MailStore store(io_context, temp_root / "growth",
+                    MailStoreOptions{.durable = false, .map_size = initial_size});
+
+    // Far more than fits in the initial map
+    constexpr size_t file_count = 500;
+    for (size_t i = 0; i < file_count; ++i) {
+        co_spawn(
+            io_context,
+            [&, i]() -> asio::awaitable<void> {
+                MailStoreFile f = store.create_file();
+                f.metadata().subject = std::format("{:<200}", i);
+                co_await f.write("Some data\r\n");
+                EXPECT_TRUE(co_await f.close());
+            },
+            asio::detached);
+    }
+
+    io_context.run();
+
+    EXPECT_GT(store.map_size(), initial_size);
+    EXPECT_EQ(store.message_count(), file_count);
+    EXPECT_EQ(store.query({.subject = "42 "}).size(), 1);
+}
+
+TEST_F(TemporaryStorageTest, failedBatchUnlinks) {
+    constexpr size_t map_size = 128 * 1024;
+    const std::filesystem::path path = temp_root / "full";
+    MailStore store(io_context, path,
+                    MailStoreOptions{.durable = false, .map_size = map_size,
+                                     .max_map_size = map_size});
+
+    // The later batches no longer fit in the map, and it can't grow
+    size_t failed = 0;
+    for (size_t i = 0; i < 500; ++i) {
+        co_spawn(
+            io_context,
+            [&, i]() -> asio::awaitable<void> {
+                MailStoreFile f = store.create_file();
+                f.metadata().subject = std::format("{:<200}", i);
+                co_await f.write("Some data\r\n");
+                try {
+                    co_await f.close();
+                } catch (const std::runtime_error& e) {
+                    EXPECT_NE(std::string_view(e.what()).find(strerror(ENOSPC)),
+                              std::string_view::npos)
+                        << e.what();
+                    ++failed;
+                }
+            },
+            asio::detached);
+    }
+
+    io_context.run();
+    EXPECT_GT(failed, 0);
+    EXPECT_EQ(store.map_size(), map_size);
+
+    // Only the messages that made it into the index are left in the store
+    size_t files = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(path)) {
+        files += entry.is_regular_file();
+    }
+    EXPECT_EQ(files, store.message_count());
+    EXPECT_EQ(files + failed, 500);
+}
+
+// Stores a message with subject, and waits until it is committed
+static void StoreMessage(asio::io_context& io_context, MailStore& store, std::string subject) {
+    co_spawn(
+        io_context,
+        [&]() -> asio::awaitable<void> {
+            MailStoreFile f = store.create_file();
+            f.metadata().subject = subject;
+            co_await f.write("Some data\r\n");
+            EXPECT_TRUE(co_await f.close());
+        },
+        asio::detached);
+
+    io_context.restart();
+    io_context.run();
+}
+
+/*
+ * Another process reading from the store at path. It takes a reader slot if
+ * there is one and keeps it until release(), then dies without giving it
+ * back, as a crashed reader would.
+ */
+class ForeignReader {
+  public:
+    enum class result : char { reading = 'R', readers_full = 'F', failed = 'E' };
+
+    explicit ForeignReader(const std::filesystem::path& path) {
+        int ready[2];
+        EXPECT_EQ(pipe(ready), 0);
+        EXPECT_EQ(pipe(_release), 0);
+
+        _pid = fork();
+        if (_pid == 0) {
+            ::close(ready[0]);
+            ::close(_release[1]);
+            auto state = result::failed;
+            try {
+                auto env = lmdb::env::create();
+                env.open((path / "db").c_str(), MDB_NOTLS | MDB_RDONLY, 0664);
+                auto txn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
+                state = result::reading;
+                [[maybe_unused]] auto written = write(ready[1], &state, 1);
+                // Returns once the other end is closed
+                char byte;
+                [[maybe_unused]] auto got = read(_release[0], &byte, 1);
+            } catch (const lmdb::error& e) {
+                state = e.code() == MDB_READERS_FULL ? result::readers_full : result::failed;
+                [[maybe_unused]] auto written = write(ready[1], &state, 1);
+            }
+            _exit(EXIT_SUCCESS);
+        }
+
+        ::close(ready[1]);
+        ::close(_release[0]);
+        EXPECT_EQ(read(ready[0], &_result, 1), 1);
+        ::close(ready[0]);
+    }
+
+    ~ForeignReader() { release(); }
+
+    result get_result() const { return _result; }
+
+    void release() {
+        if (_pid <= 0) {
+            return;
+        }
+        ::close(_release[1]);
+        int status = 0;
+        EXPECT_EQ(waitpid(_pid, &status, 0), _pid);
+        _pid = -1;
+    }
+
+  private:
+    pid_t _pid{-1};
+    int _release[2]{-1, -1};
+    result _result{result::failed};
+};
+
+TEST_F(TemporaryStorageTest, readTxnCache) {
+    const std::filesystem::path path = temp_root / "readers";
+    MailStore store(io_context, path,
+                    MailStoreOptions{.durable = false, .max_readers = 1, .read_txn_cache = 1});
+
+    // Every read reuses the cached transaction, renewed it sees what has
+    // been committed since the last one
+    for (size_t i = 0; i < 3; ++i) {
+        EXPECT_EQ(store.message_count(), i);
+        EXPECT_EQ(store.query({.subject = "Message"}).size(), i);
+        StoreMessage(io_context, store, std::format("Message {}", i));
+    }
+    EXPECT_EQ(store.message_count(), 3);
+
+    // In between reads the cached transaction keeps the one reader slot
+    ForeignReader reader(path);
+    EXPECT_EQ(reader.get_result(), ForeignReader::result::readers_full);
+    EXPECT_EQ(store.message_count(), 3);
+}
+
+TEST_F(TemporaryStorageTest, nestedReads) {
+    MailStore store(io_context, temp_root / "nested",
+                    MailStoreOptions{.durable = false, .max_readers = 2});
+    StoreMessage(io_context, store, "Message");
+
+    // The inner read shares the map lock of the outer one
+    bool read = store.read_message(store.query({})[0], [&](const EmailMessage&) {
+        EXPECT_EQ(store.message_count(), 1);
+    });
+    EXPECT_TRUE(read);
+}
+
+TEST_F(TemporaryStorageTest, readersFull) {
+    const std::filesystem::path path = temp_root / "readers";
+    MailStore store(io_context, path,
+                    MailStoreOptions{.durable = false, .max_readers = 1, .read_txn_cache = 0});
+    StoreMessage(io_context, store, "Message");
+
+    // A live reader in the only slot is left alone
+    ForeignReader reader(path);
+    ASSERT_EQ(reader.get_result(), ForeignReader::result::reading);
+    EXPECT_THROW(store.message_count(), std::runtime_error);
+
+    // Once it has died, its slot is reaped for the next read
+    reader.release();
+    EXPECT_EQ(store.message_count(), 1);
+    EXPECT_EQ(store.message_count(), 1);
+}
+
+TEST_F(TemporaryStorageTest, pickup) {
+    // Long lines, control characters and bytes with the high bit set
+    std::string data;
+    for (size_t i = 0; i < 3 * MailStoreFile::send_chunk_size; ++i) {
+        data.push_back(i % 500 == 499 ? '\r' : static_cast<char>(i * 7));
+    }
+
+    MailStore store(io_context, temp_root / "pickup", data.size());
+    std::string filename;
+
+    RunAsync([&]() -> asio::awaitable<void> {
+        MailStoreFile f = store.create_file();
+        co_await f.write(data);
+        EXPECT_TRUE(co_await f.close());
+        filename = f.get_filename();
+    });
+
+    auto pickup = [&](auto send) {
+        tcp::acceptor acceptor(io_context, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+        tcp::socket client(io_context);
+        client.connect(acceptor.local_endpoint());
+        tcp::socket server = acceptor.accept();
+
+        std::string received;
+        co_spawn(
+            io_context,
+            [&]() -> asio::awaitable<void> {
+                MailStoreFile f = store.open_file(filename);
+                EXPECT_EQ(f.view(), data);
+                co_await send(f, server);
+                server.shutdown(tcp::socket::shutdown_send);
+                EXPECT_TRUE(co_await f.close());
+            },
+            asio::detached);
+        co_spawn(
+            io_context,
+            [&]() -> asio::awaitable<void> {
+                asio::error_code ec;
+                co_await asio::async_read(client, asio::dynamic_buffer(received),
+                                          asio::redirect_error(asio::use_awaitable, ec));
+                EXPECT_EQ(ec, asio::error::eof);
+            },
+            asio::detached);
+
+        io_context.restart();
+        io_context.run();
+        return received;
+    };
+
+    EXPECT_EQ(pickup([&](MailStoreFile& f, tcp::socket& socket) -> asio::awaitable<void> {
+                  EXPECT_EQ(co_await f.send_encoded(socket), encode_string(data).size());
+              }),
+              encode_string(data));
+    EXPECT_EQ(pickup([&](MailStoreFile& f, tcp::socket& socket) -> asio::awaitable<void> {
+                  EXPECT_EQ(co_await f.send_raw(socket), data.size());
+              }),
+              data);
+}
+
+TEST_F(TemporaryStorageTest, groupCommit) {
+    std::filesystem::path temp_path = temp_root / "group";
+    MailStore store(io_context, temp_path, MailStoreOptions{.max_size = 1024});
+
+    // All of these close within one commit window and share a transaction
+    constexpr size_t file_count = 8;
+    size_t committed = 0;
+    for (size_t i = 0; i < file_count; ++i) {
+        co_spawn(
+            io_context,
+            [&, i]() -> asio::awaitable<void> {
+                MailStoreFile f = store.create_file();
+                f.metadata().subject = std::format("Message {}", i);
+                co_await f.write("Some data\r\n");
+                EXPECT_TRUE(co_await f.close());
+                EXPECT_TRUE(std::filesystem::exists(temp_path / f.get_filename()));
+                ++committed;
+            },
+            asio::detached);
+    }
+
+    io_context.run();
+
+    EXPECT_EQ(committed, file_count);
+    EXPECT_EQ(store.message_count(), file_count);
+}
+
+// What a master sends for a message, text_lines as they are on the wire
+static std::string TranscriptMessageText(std::string_view subject, std::string_view text_lines) {
+    return std::format("/create*zzzz\r\n"
+                       "/env\r\nFrom: Frodo\r\nTo: Gandalf\r\nSubject: {}\r\n/end env*zzzz\r\n"
+                       "/text ASCII\r\n{}/end text*zzzz\r\n"
+                       "/send*zzzz\r\n",
+                       subject, text_lines);
+}
+
+TEST(BatchImport, split) {
+    const std::string first = TranscriptMessageText("First", "Some text\r\n");
+    const std::string transcript =
+        first + "/reply\r\n100 Success\r\n/end reply*zzzz\r\n" +
+        // Text without an envelope, in two PDUs with a comment in between
+        "/text\r\nOne\r\n/end text*zzzz\r\n/comment\r\nHi\r\n/end comment*zzzz\r\n" +
+        "/TEXT\r\nTwo\r\n/END TEXT*zzzz\r\n/send*zzzz\r\n" +
+        // An envelope cut short by the next one
+        "/env\r\nFrom: Frodo\r\n/env\r\nTo: Sam\r\n/end env*zzzz\r\n";
+
+    const std::vector<TranscriptMessage> messages = split_transcript(transcript);
+    ASSERT_EQ(messages.size(), 4);
+
+    EXPECT_EQ(messages[0].envelope,
+              "/env\r\nFrom: Frodo\r\nTo: Gandalf\r\nSubject: First\r\n/end env*zzzz\r\n");
+    ASSERT_EQ(messages[0].texts.size(), 1);
+    EXPECT_EQ(messages[0].texts[0], "/text ASCII\r\nSome text\r\n/end text*zzzz\r\n");
+
+    EXPECT_TRUE(messages[1].envelope.empty());
+    ASSERT_EQ(messages[1].texts.size(), 2);
+    EXPECT_EQ(messages[1].texts[1], "/TEXT\r\nTwo\r\n/END TEXT*zzzz\r\n");
+
+    EXPECT_EQ(messages[2].envelope, "/env\r\nFrom: Frodo\r\n");
+    EXPECT_TRUE(messages[2].texts.empty());
+    EXPECT_EQ(messages[3].envelope, "/env\r\nTo: Sam\r\n/end env*zzzz\r\n");
+}
+
+TEST(BatchImport, parse) {
+    const std::string transcript =
+        TranscriptMessageText("Decoded", "100%25 sure\r\nOn two lines\r\n") +
+        TranscriptMessageText("Broken", "Bad %ZZ code\r\n") + "/env\r\nFrom: Frodo\r\n";
+    const std::vector<TranscriptMessage> messages = split_transcript(transcript);
+    ASSERT_EQ(messages.size(), 3);
+
+    auto message = parse_message(messages[0]);
+    ASSERT_TRUE(message);
+    EXPECT_EQ(message->metadata.subject, "Decoded");
+    EXPECT_EQ(message->metadata.from, "Frodo");
+    ASSERT_TRUE(message->metadata.envelope);
+    EXPECT_EQ(message->metadata.to.size(), 1);
+    EXPECT_TRUE(message->metadata.envelope->get_to_address().empty());
+    EXPECT_EQ(message->text, "100% sure\r\nOn two lines\r\n");
+
+    auto broken = parse_message(messages[1]);
+    ASSERT_FALSE(broken);
+    EXPECT_EQ(broken.error().code, Mep2ErrorCode::Malformed_Data);
+
+    auto truncated = parse_message(messages[2]);
+    ASSERT_FALSE(truncated);
+    EXPECT_EQ(truncated.error().code, Mep2ErrorCode::PDU_Syntax_Error);
+}
+
+TEST_F(TemporaryStorageTest, import) {
+    std::string transcript;
+    for (int i = 0; i < 200; ++i) {
+        // Every tenth message doesn't parse
+        transcript += TranscriptMessageText(std::format("Message {}", i),
+                                            i % 10 == 9 ? "%ZZ\r\n" : "Some text\r\n");
+    }
+
+    MailStore store(io_context, temp_root / "import",
+                    MailStoreOptions{.max_size = 1024, .blocking_threads = 4});
+    ImportResult result;
+    RunAsync([&]() -> asio::awaitable<void> {
+        result = co_await import_transcript(store, transcript,
+                                            ImportOptions{.folder = QueryPdu::folder_id::desk});
+    });
+
+    EXPECT_EQ(result.imported, 180);
+    ASSERT_EQ(result.failed.size(), 20);
+    for (const auto& [index, error] : result.failed) {
+        EXPECT_EQ(index % 10, 9);
+        EXPECT_EQ(error.code, Mep2ErrorCode::Malformed_Data);
+    }
+
+    EXPECT_EQ(store.message_count(), 180);
+    const std::vector<std::string> found = store.query(MessageQuery{
+        .folder = QueryPdu::folder_id::desk,
+        .subject = "message 42",
+    });
+    ASSERT_EQ(found.size(), 1);
+    EXPECT_TRUE(store.read_message(found[0], [](const EmailMessage& message) {
+        EXPECT_EQ(message.subject(), "Message 42");
+        EXPECT_EQ(message.size(), std::string_view("Some text\r\n").size());
+    }));
+}